@@ -0,0 +1,587 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-bench.c
+ *
+ * Micro benchmarks for the main library paths: building messages, writing
+ * them out packed and unpacked, reading them back, (de)compressing the
+ * packed format, deep copies and list iteration.
+ *
+ * Each benchmark is run for at least the given time and one line is printed
+ * per benchmark:
+ *
+ *   name iterations ns/op MB/s allocs/op alloc-bytes/op
+ *
+ * MB/s is relative to the unpacked message size (or the input size for the
+ * stream benchmarks). Allocations are counted through capn_init_alloc and
+ * capn_init_mem_alloc so only cover message memory.
+ *
+ * With -e the timed run is also measured with Linux perf_event counters and
+ * six more columns are printed:
+ *
+ *   cycles/op instructions/op IPC L1D-misses/KB LLC-misses/KB branch-misses/op
+ *
+ * Misses are per KB of the same byte count used for MB/s. Counters that
+ * can not be opened (no PMU in a VM, perf_event_paranoid, other systems)
+ * are printed as '-'.
+ *
+ * usage: capn-bench [-t seconds] [-e] [name filter]
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_priv.h"
+#include "addressbook.capnp.h"
+#include "test.capnp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define LIST_LEN 16
+#define STREAM_SZ (64 << 10)
+#define ITER_LEN 4096
+
+static uint64_t g_allocs, g_alloc_bytes;
+static volatile uint64_t g_sink;
+
+static void *count_alloc(void *u, size_t sz) {
+	g_allocs++;
+	g_alloc_bytes += sz;
+	return malloc(sz);
+}
+
+static void *count_realloc(void *u, void *p, size_t sz) {
+	if (!p) {
+		g_allocs++;
+		g_alloc_bytes += sz;
+	}
+	return realloc(p, sz);
+}
+
+static void count_free(void *u, void *p) {
+	free(p);
+}
+
+static const struct capn_allocator counting = {
+	&count_alloc,
+	&count_realloc,
+	&count_free,
+	NULL
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static capn_text text(const char *s) {
+	capn_text t;
+	t.len = strlen(s);
+	t.str = s;
+	t.seg = NULL;
+	return t;
+}
+
+/* Hardware counters */
+
+enum {
+	CTR_CYCLES,
+	CTR_INSTRUCTIONS,
+	CTR_L1D_MISSES,
+	CTR_LLC_MISSES,
+	CTR_BRANCH_MISSES,
+	CTR_NUM
+};
+
+static int g_ctr_fd[CTR_NUM] = {-1, -1, -1, -1, -1};
+
+#ifdef __linux__
+static int ctr_open(uint32_t type, uint64_t config) {
+	struct perf_event_attr a;
+
+	memset(&a, 0, sizeof(a));
+	a.size = sizeof(a);
+	a.type = type;
+	a.config = config;
+	a.disabled = 1;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int) syscall(__NR_perf_event_open, &a, 0, -1, -1, 0);
+}
+
+/* ctr_init opens the counters and returns how many are available */
+static int ctr_init(void) {
+	int i, n = 0;
+
+	g_ctr_fd[CTR_CYCLES] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	g_ctr_fd[CTR_INSTRUCTIONS] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	g_ctr_fd[CTR_L1D_MISSES] = ctr_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	g_ctr_fd[CTR_LLC_MISSES] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	g_ctr_fd[CTR_BRANCH_MISSES] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+	for (i = 0; i < CTR_NUM; i++)
+		n += g_ctr_fd[i] >= 0;
+	return n;
+}
+
+static void ctr_start(void) {
+	int i;
+	for (i = 0; i < CTR_NUM; i++) {
+		if (g_ctr_fd[i] >= 0) {
+			ioctl(g_ctr_fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(g_ctr_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/* ctr_stop stores the counts, scaled up if the counter was multiplexed, or
+ * -1 for counters that are not available */
+static void ctr_stop(double *v) {
+	int i;
+	for (i = 0; i < CTR_NUM; i++) {
+		uint64_t r[3];
+		v[i] = -1;
+		if (g_ctr_fd[i] < 0)
+			continue;
+		ioctl(g_ctr_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(g_ctr_fd[i], r, sizeof(r)) != sizeof(r) || !r[2])
+			continue;
+		v[i] = (double) r[0] * r[1] / r[2];
+	}
+}
+#else
+static int ctr_init(void) {
+	return 0;
+}
+
+static void ctr_start(void) {
+}
+
+static void ctr_stop(double *v) {
+	int i;
+	for (i = 0; i < CTR_NUM; i++)
+		v[i] = -1;
+}
+#endif
+
+static void print_ratio(double num, double den) {
+	if (num < 0 || den <= 0)
+		printf(" -");
+	else
+		printf(" %.2f", num / den);
+}
+
+/* Message builders */
+
+static void build_addressbook(struct capn *c) {
+	static const char *names[] = {"Alice", "Bob", "Carol", "Dave", "Eve"};
+	capn_ptr root = capn_root(c);
+	struct AddressBook ab;
+	AddressBook_ptr abp;
+	int i, j;
+
+	ab.people = new_Person_list(root.seg, 5);
+	for (i = 0; i < 5; i++) {
+		struct Person p;
+		memset(&p, 0, sizeof(p));
+		p.id = 100 + i;
+		p.name = text(names[i]);
+		p.email = text("someone@example.com");
+		p.phones = new_Person_PhoneNumber_list(root.seg, i % 3);
+		for (j = 0; j < i % 3; j++) {
+			struct Person_PhoneNumber pn;
+			pn.number = text("555-1212");
+			pn.type = (enum Person_PhoneNumber_Type) j;
+			set_Person_PhoneNumber(&pn, p.phones, j);
+		}
+		p.employment_which = (enum Person_employment_which) (i % 4);
+		if (p.employment_which == Person_employment_employer)
+			p.employment.employer = text("ACME");
+		if (p.employment_which == Person_employment_school)
+			p.employment.school = text("MIT");
+		set_Person(&p, ab.people, i);
+	}
+
+	abp = new_AddressBook(root.seg);
+	write_AddressBook(&ab, abp);
+	capn_setp(root, 0, abp.p);
+}
+
+static void fill_alltypes(struct TestAllTypes *t, struct capn_segment *seg, int depth) {
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	t->boolField = 1;
+	t->int8Field = -8;
+	t->int16Field = -16;
+	t->int32Field = -32;
+	t->int64Field = -64;
+	t->uInt8Field = 8;
+	t->uInt16Field = 16;
+	t->uInt32Field = 32;
+	t->uInt64Field = 64;
+	t->float32Field = 1.5f;
+	t->float64Field = 2.5;
+	t->textField = text("hello world");
+	t->enumField = TestEnum_bar;
+
+	t->boolList = capn_new_list1(seg, LIST_LEN);
+	t->int8List = capn_new_list8(seg, LIST_LEN);
+	t->int16List = capn_new_list16(seg, LIST_LEN);
+	t->int32List = capn_new_list32(seg, LIST_LEN);
+	t->int64List = capn_new_list64(seg, LIST_LEN);
+	t->float64List = capn_new_list64(seg, LIST_LEN);
+	t->textList = capn_new_ptr_list(seg, LIST_LEN);
+	for (i = 0; i < LIST_LEN; i++) {
+		capn_set1(t->boolList, i, i & 1);
+		capn_set8(t->int8List, i, i);
+		capn_set16(t->int16List, i, i * 3);
+		capn_set32(t->int32List, i, i * 5);
+		capn_set64(t->int64List, i, i * 7);
+		capn_set64(t->float64List, i, i);
+		capn_set_text(t->textList, i, text("list text"));
+	}
+	t->dataField.p = t->int8List.p;
+
+	if (depth) {
+		struct TestAllTypes sub;
+		t->structField = new_TestAllTypes(seg);
+		fill_alltypes(&sub, seg, depth - 1);
+		write_TestAllTypes(&sub, t->structField);
+
+		t->structList = new_TestAllTypes_list(seg, 4);
+		for (i = 0; i < 4; i++) {
+			fill_alltypes(&sub, seg, 0);
+			set_TestAllTypes(&sub, t->structList, i);
+		}
+	}
+}
+
+static void build_alltypes(struct capn *c) {
+	capn_ptr root = capn_root(c);
+	struct TestAllTypes t;
+	TestAllTypes_ptr p;
+
+	p = new_TestAllTypes(root.seg);
+	fill_alltypes(&t, root.seg, 1);
+	write_TestAllTypes(&t, p);
+	capn_setp(root, 0, p.p);
+}
+
+/* Shared inputs, set up once in main */
+
+static struct capn g_book, g_all;
+static struct capn_template g_all_template;
+static capn_ptr g_all_root;
+static uint8_t *g_all_buf, *g_all_packed, *g_out;
+static size_t g_book_sz, g_all_sz, g_all_packed_sz, g_out_sz;
+static capn_list64 g_iter_list;
+static struct capn g_iter;
+
+struct stream_input {
+	uint8_t *raw, *packed;
+	size_t packed_sz;
+};
+
+static struct stream_input g_streams[3];
+static struct stream_input *g_stream;
+
+static ssize_t discard(int fd, const void *p, size_t sz) {
+	g_sink += sz;
+	return sz;
+}
+
+static void bench_build_addressbook(void) {
+	struct capn c;
+	capn_init_alloc(&c, &counting);
+	build_addressbook(&c);
+	capn_free(&c);
+}
+
+static void bench_build_alltypes(void) {
+	struct capn c;
+	capn_init_alloc(&c, &counting);
+	build_alltypes(&c);
+	capn_free(&c);
+}
+
+static void bench_clone_template(void) {
+	struct capn c;
+	capn_clone_template(&c, &g_all_template, &counting);
+	capn_write64(capn_template_ptr(&c, g_all_root), 0, g_sink);
+	capn_free(&c);
+}
+
+static void bench_clone(void) {
+	struct capn c;
+	capn_clone(&c, &g_all, 0);
+	capn_free(&c);
+}
+
+static void bench_clone_coalesced(void) {
+	struct capn c;
+	capn_clone(&c, &g_all, 1);
+	capn_free(&c);
+}
+
+static void bench_write_mem(void) {
+	g_sink += capn_write_mem(&g_all, g_out, g_out_sz, 0);
+}
+
+static void bench_write_mem_packed(void) {
+	g_sink += capn_write_mem(&g_all, g_out, g_out_sz, 1);
+}
+
+static void bench_write_fd(void) {
+	g_sink += capn_write_fd(&g_all, &discard, -1, 0);
+}
+
+static void bench_write_fd_packed(void) {
+	g_sink += capn_write_fd(&g_all, &discard, -1, 1);
+}
+
+static void bench_init_mem(void) {
+	struct capn c;
+	if (!capn_init_mem_alloc(&c, g_all_buf, g_all_sz, 0, &counting)) {
+		g_sink += c.segnum;
+		capn_free(&c);
+	}
+}
+
+static void bench_init_mem_packed(void) {
+	struct capn c;
+	if (!capn_init_mem_alloc(&c, g_all_packed, g_all_packed_sz, 1, &counting)) {
+		g_sink += c.segnum;
+		capn_free(&c);
+	}
+}
+
+static void bench_deflate(void) {
+	struct capn_stream z;
+	memset(&z, 0, sizeof(z));
+	z.next_in = g_stream->raw;
+	z.avail_in = STREAM_SZ;
+	z.next_out = g_out;
+	z.avail_out = g_out_sz;
+	g_sink += capn_deflate(&z);
+}
+
+static void bench_inflate(void) {
+	struct capn_stream z;
+	memset(&z, 0, sizeof(z));
+	z.next_in = g_stream->packed;
+	z.avail_in = g_stream->packed_sz;
+	z.next_out = g_out;
+	z.avail_out = STREAM_SZ;
+	g_sink += capn_inflate(&z);
+}
+
+static void bench_setp_copy(void) {
+	struct capn c;
+	capn_init_alloc(&c, &counting);
+	g_sink += capn_setp(capn_root(&c), 0, capn_getp(capn_root(&g_all), 0, 1));
+	capn_free(&c);
+}
+
+static void bench_iter_list64(void) {
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < ITER_LEN; i++)
+		sum += capn_get64(g_iter_list, i);
+	g_sink += sum;
+}
+
+static void bench_iter_structs(void) {
+	AddressBook_ptr root;
+	struct AddressBook ab;
+	uint64_t sum = 0;
+	int i;
+
+	root.p = capn_getp(capn_root(&g_book), 0, 1);
+	read_AddressBook(&ab, root);
+	for (i = 0; i < capn_len(ab.people); i++) {
+		struct Person p;
+		get_Person(&p, ab.people, i);
+		sum += p.id + p.name.len + capn_len(p.phones);
+	}
+	g_sink += sum;
+}
+
+struct bench {
+	const char *name;
+	void (*fn)(void);
+	size_t *bytes;
+	struct stream_input *stream;
+};
+
+static size_t g_stream_sz = STREAM_SZ;
+static size_t g_iter_sz = ITER_LEN * 8;
+
+static struct bench benches[] = {
+	{"build_addressbook", &bench_build_addressbook, &g_book_sz, NULL},
+	{"build_alltypes", &bench_build_alltypes, &g_all_sz, NULL},
+	{"clone_template", &bench_clone_template, &g_all_sz, NULL},
+	{"clone", &bench_clone, &g_all_sz, NULL},
+	{"clone_coalesced", &bench_clone_coalesced, &g_all_sz, NULL},
+	{"write_mem", &bench_write_mem, &g_all_sz, NULL},
+	{"write_mem_packed", &bench_write_mem_packed, &g_all_sz, NULL},
+	{"write_fd", &bench_write_fd, &g_all_sz, NULL},
+	{"write_fd_packed", &bench_write_fd_packed, &g_all_sz, NULL},
+	{"init_mem", &bench_init_mem, &g_all_sz, NULL},
+	{"init_mem_packed", &bench_init_mem_packed, &g_all_sz, NULL},
+	{"deflate_messages", &bench_deflate, &g_stream_sz, &g_streams[0]},
+	{"deflate_zero", &bench_deflate, &g_stream_sz, &g_streams[1]},
+	{"deflate_nonzero", &bench_deflate, &g_stream_sz, &g_streams[2]},
+	{"inflate_messages", &bench_inflate, &g_stream_sz, &g_streams[0]},
+	{"inflate_zero", &bench_inflate, &g_stream_sz, &g_streams[1]},
+	{"inflate_nonzero", &bench_inflate, &g_stream_sz, &g_streams[2]},
+	{"setp_copy", &bench_setp_copy, &g_all_sz, NULL},
+	{"iter_list64", &bench_iter_list64, &g_iter_sz, NULL},
+	{"iter_structs", &bench_iter_structs, &g_book_sz, NULL},
+};
+
+static void run(struct bench *b, double seconds, int counters) {
+	uint64_t n = 1, i, start, elapsed;
+	double ctr[CTR_NUM], kb;
+
+	g_stream = b->stream;
+
+	/* grow the iteration count until a run takes a tenth of the target */
+	for (;;) {
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			b->fn();
+		elapsed = now_ns() - start;
+		if (elapsed >= seconds * 1e8)
+			break;
+		n *= elapsed < seconds * 1e6 ? 16 : 2;
+	}
+
+	n = (uint64_t) (n * (seconds * 1e9 / elapsed)) + 1;
+	g_allocs = g_alloc_bytes = 0;
+	if (counters)
+		ctr_start();
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		b->fn();
+	elapsed = now_ns() - start;
+	if (counters)
+		ctr_stop(ctr);
+
+	printf("%s %llu %.1f %.1f %.2f %.0f", b->name,
+			(unsigned long long) n,
+			(double) elapsed / n,
+			(double) *b->bytes * n * 1e3 / elapsed,
+			(double) g_allocs / n,
+			(double) g_alloc_bytes / n);
+	if (counters) {
+		kb = (double) *b->bytes * n / 1024;
+		print_ratio(ctr[CTR_CYCLES], n);
+		print_ratio(ctr[CTR_INSTRUCTIONS], n);
+		print_ratio(ctr[CTR_INSTRUCTIONS], ctr[CTR_CYCLES] < 0 ? -1 : ctr[CTR_CYCLES]);
+		print_ratio(ctr[CTR_L1D_MISSES], kb);
+		print_ratio(ctr[CTR_LLC_MISSES], kb);
+		print_ratio(ctr[CTR_BRANCH_MISSES], n);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static size_t pack(const uint8_t *in, size_t sz, uint8_t **out) {
+	struct capn_stream z;
+	size_t cap = sz + sz/4 + 64;
+
+	*out = (uint8_t*) malloc(cap);
+	memset(&z, 0, sizeof(z));
+	z.next_in = in;
+	z.avail_in = sz;
+	z.next_out = *out;
+	z.avail_out = cap;
+	capn_deflate(&z);
+	return cap - z.avail_out;
+}
+
+static void setup(void) {
+	size_t off;
+	int i;
+
+	capn_init_malloc(&g_book);
+	build_addressbook(&g_book);
+	g_book_sz = capn_size(&g_book);
+
+	capn_init_malloc(&g_all);
+	build_alltypes(&g_all);
+	g_all_sz = capn_size(&g_all);
+	capn_template_init(&g_all_template, &g_all);
+	g_all_root = capn_getp(capn_root(&g_all), 0, 1);
+	g_all_buf = (uint8_t*) malloc(g_all_sz);
+	capn_write_mem(&g_all, g_all_buf, g_all_sz, 0);
+	g_all_packed_sz = pack(g_all_buf, g_all_sz, &g_all_packed);
+
+	g_out_sz = 2 * STREAM_SZ + 64;
+	if (g_out_sz < 2 * g_all_sz)
+		g_out_sz = 2 * g_all_sz;
+	g_out = (uint8_t*) malloc(g_out_sz);
+
+	/* serialized address books back to back, all zero words, and
+	 * words without any zero byte (the worst case for packing) */
+	for (i = 0; i < 3; i++)
+		g_streams[i].raw = (uint8_t*) calloc(1, STREAM_SZ);
+	for (off = 0; off + g_book_sz <= STREAM_SZ; off += g_book_sz)
+		capn_write_mem(&g_book, g_streams[0].raw + off, g_book_sz, 0);
+	srand(1);
+	for (off = 0; off < STREAM_SZ; off++)
+		g_streams[2].raw[off] = 1 + rand() % 255;
+	for (i = 0; i < 3; i++)
+		g_streams[i].packed_sz = pack(g_streams[i].raw, STREAM_SZ, &g_streams[i].packed);
+
+	capn_init_malloc(&g_iter);
+	g_iter_list = capn_new_list64(capn_root(&g_iter).seg, ITER_LEN);
+	for (i = 0; i < ITER_LEN; i++)
+		capn_set64(g_iter_list, i, i);
+}
+
+int main(int argc, char **argv) {
+	const char *filter = NULL;
+	double seconds = 0.5;
+	size_t i;
+	int j, counters = 0;
+
+	for (j = 1; j < argc; j++) {
+		if (!strcmp(argv[j], "-t") && j + 1 < argc) {
+			seconds = atof(argv[++j]);
+		} else if (!strcmp(argv[j], "-e")) {
+			counters = 1;
+		} else if (argv[j][0] != '-' && !filter) {
+			filter = argv[j];
+		} else {
+			fprintf(stderr, "usage: %s [-t seconds] [-e] [name filter]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (seconds <= 0)
+		seconds = 0.5;
+
+	setup();
+
+	if (counters && ctr_init() < CTR_NUM)
+		fprintf(stderr, "some hardware counters are not available, they are shown as '-'\n");
+
+	printf("# name iterations ns/op MB/s allocs/op alloc-bytes/op%s\n", counters
+			? " cycles/op instructions/op IPC L1D-misses/KB LLC-misses/KB branch-misses/op" : "");
+	for (i = 0; i < sizeof(benches)/sizeof(benches[0]); i++) {
+		if (filter && !strstr(benches[i].name, filter))
+			continue;
+		run(&benches[i], seconds, counters);
+	}
+
+	return 0;
+}
@@ -0,0 +1,414 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-latency.c
+ *
+ * Request/response latency over a local transport, including building,
+ * writing, reading and decoding the messages on both sides.
+ *
+ * Each connection has a client and a server thread. The client builds a
+ * request carrying a sequence number and a data payload, writes it with
+ * capn_write_fd, and waits for the response. The server reads the request
+ * with capn_init_mem, checks it, and answers with a small message carrying
+ * the sequence number back. The round trip, from the start of the build to
+ * the decoded response, is recorded in a log-linear histogram.
+ *
+ * Unpacked messages are sent in the standard framing and the receiver reads
+ * the segment table to know the message size. Packed messages carry no size
+ * so they are sent with a four byte little endian length prefix.
+ *
+ * usage: capn-latency [-n requests] [-s payload bytes] [-c connections]
+ *                     [-w warmup requests] [-p] [-t]
+ *
+ *   -p  send packed messages
+ *   -t  use TCP over loopback instead of a socketpair
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* Histogram buckets: values below 2^SUB_BITS are exact, above that each
+ * power of two is split into 2^SUB_BITS linear buckets, giving under 1%
+ * relative error over the whole range. */
+#define SUB_BITS 7
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB)
+
+struct hist {
+	uint64_t count, sum, min, max;
+	uint64_t b[BUCKETS];
+};
+
+static int bucket(uint64_t v) {
+	int msb;
+	if (v < SUB)
+		return (int) v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - SUB_BITS + 1) * SUB + (int) ((v >> (msb - SUB_BITS)) & (SUB - 1));
+}
+
+static uint64_t bucket_value(int i) {
+	int e = i / SUB, m = i % SUB;
+	if (e == 0)
+		return m;
+	/* upper bound of the bucket */
+	return ((uint64_t) (SUB + m + 1) << (e - 1)) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v) {
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->b[bucket(v)]++;
+}
+
+static void hist_merge(struct hist *h, const struct hist *o) {
+	int i;
+	if (!o->count)
+		return;
+	if (!h->count || o->min < h->min)
+		h->min = o->min;
+	if (o->max > h->max)
+		h->max = o->max;
+	h->count += o->count;
+	h->sum += o->sum;
+	for (i = 0; i < BUCKETS; i++)
+		h->b[i] += o->b[i];
+}
+
+static uint64_t hist_quantile(const struct hist *h, double q) {
+	uint64_t rank = (uint64_t) (q * h->count), seen = 0;
+	int i;
+	for (i = 0; i < BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen > rank) {
+			uint64_t v = bucket_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+struct opts {
+	int requests, warmup, payload, packed;
+};
+
+struct conn {
+	pthread_t client, server;
+	int cfd, sfd;
+	const struct opts *o;
+	struct hist h;
+	int err;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int read_full(int fd, void *p, size_t sz) {
+	while (sz) {
+		ssize_t r = read(fd, p, sz);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (char*) p + r;
+		sz -= r;
+	}
+	return 0;
+}
+
+static ssize_t write_full(int fd, const void *p, size_t sz) {
+	size_t left = sz;
+	while (left) {
+		ssize_t r = write(fd, p, left);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (const char*) p + r;
+		left -= r;
+	}
+	return sz;
+}
+
+/* struct buf is a per thread receive/send buffer */
+struct buf {
+	uint8_t *p;
+	size_t cap;
+};
+
+static int reserve(struct buf *b, size_t sz) {
+	if (sz > b->cap) {
+		uint8_t *n = (uint8_t*) realloc(b->p, sz);
+		if (!n)
+			return -1;
+		b->p = n;
+		b->cap = sz;
+	}
+	return 0;
+}
+
+static int send_msg(int fd, struct capn *c, int packed, struct buf *b) {
+	int64_t sz;
+	size_t max;
+
+	if (!packed)
+		return capn_write_fd(c, &write_full, fd, 0) < 0 ? -1 : 0;
+
+	/* packed output is at most 10 bytes for every 8 */
+	max = capn_size(c);
+	max += max/4 + 16;
+	if (reserve(b, 4 + max))
+		return -1;
+	sz = capn_write_mem(c, b->p + 4, max, 1);
+	if (sz < 0)
+		return -1;
+	b->p[0] = (uint8_t) sz;
+	b->p[1] = (uint8_t) (sz >> 8);
+	b->p[2] = (uint8_t) (sz >> 16);
+	b->p[3] = (uint8_t) (sz >> 24);
+	return write_full(fd, b->p, 4 + sz) < 0 ? -1 : 0;
+}
+
+static int recv_msg(int fd, struct capn *c, int packed, struct buf *b) {
+	uint32_t hdr, segnum, i;
+	size_t sz;
+
+	if (reserve(b, 4096) || read_full(fd, b->p, 4))
+		return -1;
+
+	if (packed) {
+		sz = b->p[0] | (b->p[1] << 8) | (b->p[2] << 16) | ((uint32_t) b->p[3] << 24);
+		if (reserve(b, sz) || read_full(fd, b->p, sz))
+			return -1;
+		return capn_init_mem(c, b->p, sz, 1);
+	}
+
+	memcpy(&hdr, b->p, 4);
+	segnum = capn_flip32(hdr) + 1;
+	if (segnum > 1024)
+		return -1;
+	sz = 8 * (segnum/2 + 1);
+	if (reserve(b, sz) || read_full(fd, b->p + 4, sz - 4))
+		return -1;
+	for (i = 0; i < segnum; i++) {
+		memcpy(&hdr, b->p + 4 + 4*i, 4);
+		sz += 8 * (size_t) capn_flip32(hdr);
+	}
+	if (reserve(b, sz) || read_full(fd, b->p + 8 * (segnum/2 + 1), sz - 8 * (segnum/2 + 1)))
+		return -1;
+	return capn_init_mem(c, b->p, sz, 0);
+}
+
+static void *server(void *u) {
+	struct conn *cn = (struct conn*) u;
+	struct buf b = {NULL, 0};
+
+	for (;;) {
+		struct capn req, resp;
+		capn_ptr p, r;
+		capn_data d;
+		uint64_t seq;
+
+		if (recv_msg(cn->sfd, &req, cn->o->packed, &b))
+			break;
+		p = capn_getp(capn_root(&req), 0, 1);
+		seq = capn_read64(p, 0);
+		d = capn_get_data(p, 0);
+		if (d.p.len != cn->o->payload)
+			seq = ~seq;
+		capn_free(&req);
+
+		capn_init_malloc(&resp);
+		r = capn_root(&resp);
+		p = capn_new_struct(r.seg, 8, 0);
+		capn_write64(p, 0, seq);
+		capn_setp(r, 0, p);
+		if (send_msg(cn->sfd, &resp, cn->o->packed, &b)) {
+			capn_free(&resp);
+			break;
+		}
+		capn_free(&resp);
+	}
+
+	free(b.p);
+	return NULL;
+}
+
+static void *client(void *u) {
+	struct conn *cn = (struct conn*) u;
+	const struct opts *o = cn->o;
+	struct buf b = {NULL, 0};
+	uint8_t *payload = (uint8_t*) malloc(o->payload + 1);
+	int i;
+
+	memset(payload, 0xA5, o->payload + 1);
+
+	for (i = 0; i < o->warmup + o->requests; i++) {
+		uint64_t start = now_ns();
+		struct capn req, resp;
+		capn_ptr r, p;
+		capn_list8 data;
+
+		capn_init_malloc(&req);
+		r = capn_root(&req);
+		p = capn_new_struct(r.seg, 8, 1);
+		capn_write64(p, 0, i);
+		data = capn_new_list8(p.seg, o->payload);
+		capn_setv8(data, 0, payload, o->payload);
+		capn_setp(p, 0, data.p);
+		capn_setp(r, 0, p);
+
+		if (send_msg(cn->cfd, &req, o->packed, &b) || recv_msg(cn->cfd, &resp, o->packed, &b)) {
+			capn_free(&req);
+			cn->err = 1;
+			break;
+		}
+		capn_free(&req);
+
+		p = capn_getp(capn_root(&resp), 0, 1);
+		if (capn_read64(p, 0) != (uint64_t) i)
+			cn->err = 1;
+		capn_free(&resp);
+
+		if (i >= o->warmup)
+			hist_add(&cn->h, now_ns() - start);
+	}
+
+	shutdown(cn->cfd, SHUT_WR);
+	free(payload);
+	free(b.p);
+	return NULL;
+}
+
+static int tcp_pair(int fds[2]) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int one = 1, l;
+
+	l = socket(AF_INET, SOCK_STREAM, 0);
+	if (l < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(l, (struct sockaddr*) &addr, sizeof(addr))
+			|| listen(l, 1)
+			|| getsockname(l, (struct sockaddr*) &addr, &len)) {
+		close(l);
+		return -1;
+	}
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0 || connect(fds[0], (struct sockaddr*) &addr, sizeof(addr))) {
+		close(l);
+		return -1;
+	}
+	fds[1] = accept(l, NULL, NULL);
+	close(l);
+	if (fds[1] < 0)
+		return -1;
+
+	setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct opts o = {100000, 1000, 256, 0};
+	struct conn *conns;
+	struct hist *total;
+	int i, n = 1, tcp = 0, err = 0;
+	uint64_t start, elapsed;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p")) {
+			o.packed = 1;
+		} else if (!strcmp(argv[i], "-t")) {
+			tcp = 1;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			o.requests = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			o.payload = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			n = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+			o.warmup = atoi(argv[++i]);
+		} else {
+			break;
+		}
+	}
+	if (i < argc || o.requests <= 0 || o.payload < 0 || n <= 0 || o.warmup < 0) {
+		fprintf(stderr, "usage: %s [-n requests] [-s payload bytes] [-c connections] [-w warmup] [-p] [-t]\n", argv[0]);
+		return 2;
+	}
+
+	conns = (struct conn*) calloc(n, sizeof(*conns));
+	total = (struct hist*) calloc(1, sizeof(*total));
+	if (!conns || !total) {
+		perror("calloc");
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		int fds[2];
+		if (tcp ? tcp_pair(fds) : socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+			perror(tcp ? "tcp" : "socketpair");
+			return 1;
+		}
+		conns[i].cfd = fds[0];
+		conns[i].sfd = fds[1];
+		conns[i].o = &o;
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		pthread_create(&conns[i].server, NULL, &server, &conns[i]);
+		pthread_create(&conns[i].client, NULL, &client, &conns[i]);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(conns[i].client, NULL);
+		pthread_join(conns[i].server, NULL);
+		close(conns[i].cfd);
+		close(conns[i].sfd);
+		hist_merge(total, &conns[i].h);
+		err |= conns[i].err;
+	}
+	elapsed = now_ns() - start;
+
+	if (err || !total->count) {
+		fprintf(stderr, "transport or message error\n");
+		return 1;
+	}
+
+	printf("transport %s packed %d connections %d payload %d\n", tcp ? "tcp" : "socketpair", o.packed, n, o.payload);
+	printf("requests %llu\n", (unsigned long long) total->count);
+	printf("throughput %.0f req/s\n", (double) (o.requests + o.warmup) * n * 1e9 / elapsed);
+	printf("mean %llu ns\n", (unsigned long long) (total->sum / total->count));
+	printf("min %llu ns\n", (unsigned long long) total->min);
+	printf("p50 %llu ns\n", (unsigned long long) hist_quantile(total, 0.5));
+	printf("p90 %llu ns\n", (unsigned long long) hist_quantile(total, 0.9));
+	printf("p99 %llu ns\n", (unsigned long long) hist_quantile(total, 0.99));
+	printf("p99.9 %llu ns\n", (unsigned long long) hist_quantile(total, 0.999));
+	printf("max %llu ns\n", (unsigned long long) total->max);
+
+	free(total);
+	free(conns);
+	return 0;
+}
@@ -0,0 +1,187 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* shm-latency.c
+ *
+ * Cross-process latency of handing a message over through shared memory.
+ *
+ * The parent builds a message directly in a shared region and sends the
+ * descriptor offset over a pipe. The child attaches the segments, reads the
+ * message, releases it and acknowledges. The time from the start of the
+ * build to the acknowledgement is recorded per message.
+ *
+ * usage: shm-latency [-n messages] [-s payload bytes]
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int read_full(int fd, void *p, size_t sz) {
+	while (sz) {
+		ssize_t r = read(fd, p, sz);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (char*) p + r;
+		sz -= r;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *p, size_t sz) {
+	while (sz) {
+		ssize_t r = write(fd, p, sz);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		p = (const char*) p + r;
+		sz -= r;
+	}
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static int reader(struct capn_shm *m, int in, int out) {
+	int64_t desc;
+
+	while (!read_full(in, &desc, sizeof(desc))) {
+		struct capn c;
+		capn_ptr p;
+		capn_data d;
+		uint64_t sum;
+
+		if (capn_init_shm_desc(&c, m, desc))
+			return 1;
+
+		p = capn_getp(capn_root(&c), 0, 1);
+		d = capn_get_data(p, 0);
+		sum = capn_read64(p, 0) + d.p.len;
+		if (d.p.len)
+			sum += (uint8_t) d.p.data[d.p.len-1];
+		capn_shm_free(&c);
+
+		if (write_full(out, &sum, sizeof(sum)))
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct capn_shm m;
+	int tochild[2], toparent[2];
+	int i, n = 100000, payload = 256;
+	uint64_t *lat, total = 0;
+	uint8_t *buf;
+	pid_t pid;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-n")) {
+			n = atoi(argv[i+1]);
+		} else if (!strcmp(argv[i], "-s")) {
+			payload = atoi(argv[i+1]);
+		} else {
+			break;
+		}
+	}
+	if (i < argc || n <= 0 || payload < 0) {
+		fprintf(stderr, "usage: %s [-n messages] [-s payload bytes]\n", argv[0]);
+		return 2;
+	}
+
+	if (capn_shm_create(&m, NULL, 64 << 20)) {
+		perror("capn_shm_create");
+		return 1;
+	}
+
+	if (pipe(tochild) || pipe(toparent)) {
+		perror("pipe");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (pid == 0) {
+		close(tochild[1]);
+		close(toparent[0]);
+		_exit(reader(&m, tochild[0], toparent[1]));
+	}
+	close(tochild[0]);
+	close(toparent[1]);
+
+	lat = (uint64_t*) calloc(n, sizeof(*lat));
+	buf = (uint8_t*) malloc(payload + 1);
+	memset(buf, 0xA5, payload + 1);
+
+	for (i = 0; i < n; i++) {
+		uint64_t start = now_ns(), sum;
+		struct capn c;
+		capn_ptr root, p;
+		capn_list8 data;
+		int64_t desc;
+
+		capn_init_shm(&c, &m);
+		root = capn_root(&c);
+		p = capn_new_struct(root.seg, 8, 1);
+		capn_write64(p, 0, i);
+		data = capn_new_list8(p.seg, payload);
+		capn_setv8(data, 0, buf, payload);
+		capn_setp(p, 0, data.p);
+		capn_setp(root, 0, p);
+
+		desc = capn_shm_publish(&c);
+		capn_shm_free(&c);
+		if (desc < 0) {
+			fprintf(stderr, "capn_shm_publish failed\n");
+			return 1;
+		}
+
+		if (write_full(tochild[1], &desc, sizeof(desc)) || read_full(toparent[0], &sum, sizeof(sum))) {
+			fprintf(stderr, "reader went away\n");
+			return 1;
+		}
+		if (sum != (uint64_t) i + payload + (payload ? 0xA5 : 0)) {
+			fprintf(stderr, "reader saw a corrupt message\n");
+			return 1;
+		}
+
+		lat[i] = now_ns() - start;
+		total += lat[i];
+	}
+
+	close(tochild[1]);
+	waitpid(pid, NULL, 0);
+
+	qsort(lat, n, sizeof(*lat), &cmp_u64);
+	printf("messages %d payload %d\n", n, payload);
+	printf("mean %llu ns\n", (unsigned long long) (total / n));
+	printf("min %llu ns\n", (unsigned long long) lat[0]);
+	printf("p50 %llu ns\n", (unsigned long long) lat[n/2]);
+	printf("p99 %llu ns\n", (unsigned long long) lat[(int) (n * 0.99)]);
+	printf("max %llu ns\n", (unsigned long long) lat[n-1]);
+
+	free(buf);
+	free(lat);
+	capn_shm_close(&m);
+	return 0;
+}
@@ -50,6 +50,8 @@ static int g_valc;
 static int g_val0used, g_nullused;
 
 static int g_fieldgetset = 0;
+static int g_listbuilder = 0;
+static int g_dirtymask = 0;
 
 static struct capn_tree *g_node_tree;
 
@@ -714,6 +716,9 @@ struct strings {
 	struct str pub_get_header;
 	struct str pub_set;
 	struct str pub_set_header;
+	struct str dirty_set;
+	struct str dirty_enum;
+	int ndirty;
 };
 
 static const char *field_name(struct field *f) {
@@ -954,6 +959,216 @@ static void define_setter_functions(struct node* node, struct field* field,
         str_release(&setter_body);
 }
 
+/* dirty_member gives the member of a struct whose set code was added to
+ * s->set from mark on its own bit in the dirty mask: write_X_dirty only runs
+ * that code when the bit is set. Plain fields also get an update function
+ * that assigns the field and sets the bit. */
+static void dirty_member(struct node *n, struct field *f, struct strings *s, const char *name, int mark) {
+	int bit = s->ndirty;
+	int i, start;
+
+	if (s->set.len == mark)
+		return;
+
+	str_addf(&s->dirty_enum, "%s\n\t%s_dirty_%s = %d", bit ? "," : "", n->name.str, name, bit);
+	str_addf(&s->dirty_set, "\tif (s->_dirty[%d] & (1u << %d)) {\n", bit/32, bit%32);
+	for (i = start = mark; i < s->set.len; i++) {
+		if (s->set.str[i] == '\n') {
+			str_addf(&s->dirty_set, "\t%.*s", i + 1 - start, s->set.str + start);
+			start = i + 1;
+		}
+	}
+	str_addf(&s->dirty_set, "\t}\n");
+
+	if (f && f->f.which == Field_slot) {
+		str_addf(&s->pub_set_header, "\nvoid %s_update_%s(struct %s *s, %s v);\n",
+				n->name.str, name, n->name.str, f->v.tname);
+		str_addf(&s->pub_set, "\nvoid %s_update_%s(struct %s *s, %s v)\n{\n",
+				n->name.str, name, n->name.str, f->v.tname);
+		str_addf(&s->pub_set, "\ts->%s = v;\n", name);
+		str_addf(&s->pub_set, "\ts->_dirty[%d] |= 1u << %d;\n}\n", bit/32, bit%32);
+	}
+
+	s->ndirty++;
+}
+
+/* field_annotation looks for the annotation id on f and reads its value
+ * into v if it is there */
+static bool field_annotation(struct field *f, uint64_t id, struct Value *v) {
+	int i;
+
+	for (i = capn_len(f->f.annotations)-1; i >= 0; i--) {
+		struct Annotation a;
+		get_Annotation(&a, f->f.annotations, i);
+		if (a.id == id) {
+			if (v)
+				read_Value(v, a.value);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* define_sortkey generates X_list_sort_by_<field> and X_list_find_by_<field>
+ * for a field annotated with $C::sortkey, on top of capn_list_sort and
+ * capn_list_find. Only scalar and text fields can be keys. */
+static void define_sortkey(struct node *n, struct field *f, struct strings *s) {
+	const char *name = field_name(f);
+	const char *tname = f->v.tname;
+
+	switch (f->v.t.which) {
+	case Type__void:
+	case Type_data:
+	case Type__list:
+	case Type__struct:
+	case Type__interface:
+	case Type_anyPointer:
+		fprintf(stderr, "$C::sortkey on %s.%s, which is neither a scalar nor text\n", n->name.str, name);
+		exit(2);
+	default:
+		break;
+	}
+
+	str_addf(&s->pub_get, "\nstatic int %s_key_%s(capn_ptr p, const void *k)\n{\n", n->name.str, name);
+	str_addf(&s->pub_get, "\t%s x, y = *(const %s*) k;\n", tname, tname);
+	get_member(&s->pub_get, f, "p", "\t", "x");
+	if (f->v.t.which == Type_text) {
+		str_addf(&s->pub_get, "\treturn capn_cmp_text(x, y);\n}\n");
+	} else {
+		str_addf(&s->pub_get, "\treturn (x > y) - (x < y);\n}\n");
+	}
+
+	str_addf(&s->pub_get, "\nstatic int %s_cmp_%s(capn_ptr a, capn_ptr b, void *arg)\n{\n", n->name.str, name);
+	str_addf(&s->pub_get, "\t%s y;\n\t(void) arg;\n", tname);
+	get_member(&s->pub_get, f, "b", "\t", "y");
+	str_addf(&s->pub_get, "\treturn %s_key_%s(a, &y);\n}\n", n->name.str, name);
+
+	str_addf(&s->pub_get_header, "\nint %s_list_sort_by_%s(%s_list l);\n", n->name.str, name, n->name.str);
+	str_addf(&s->pub_get, "\nint %s_list_sort_by_%s(%s_list l)\n{\n", n->name.str, name, n->name.str);
+	str_addf(&s->pub_get, "\treturn capn_list_sort(l.p, %s_cmp_%s, NULL);\n}\n", n->name.str, name);
+
+	str_addf(&s->pub_get_header, "\nint %s_list_find_by_%s(%s_list l, %s v);\n", n->name.str, name, n->name.str, tname);
+	str_addf(&s->pub_get, "\nint %s_list_find_by_%s(%s_list l, %s v)\n{\n", n->name.str, name, n->name.str, tname);
+	str_addf(&s->pub_get, "\treturn capn_list_find(l.p, %s_key_%s, &v);\n}\n", n->name.str, name);
+}
+
+static struct field *find_field(struct node *n, const char *name, size_t len) {
+	int i;
+
+	for (i = 0; i < capn_len(n->n._struct.fields); i++) {
+		struct field *f = &n->fields[i];
+		if ((size_t) f->f.name.len == len && !memcmp(f->f.name.str, name, len))
+			return f;
+	}
+	return NULL;
+}
+
+static bool hashable(enum Type_which t) {
+	switch (t) {
+	case Type__bool:
+	case Type_int8:
+	case Type_int16:
+	case Type_int32:
+	case Type_int64:
+	case Type_uint8:
+	case Type_uint16:
+	case Type_uint32:
+	case Type_uint64:
+	case Type__enum:
+	case Type_text:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* decode_slot decodes the type and default of f once. The key of a hash
+ * index is decoded by the struct holding the index, which may come before
+ * the struct of the key, and both have to share the default constant. */
+static void decode_slot(struct field *f) {
+	if (!f->v.tname)
+		decode_value(&f->v, f->f.slot.type, f->f.slot.defaultValue, NULL);
+}
+
+/* define_hashindex generates X_build_<field> and X_find_<field> for a
+ * List(UInt32) field annotated with $C::hashindex("list.key"), which holds
+ * a capn_hash_build table of the struct list in the field list by its
+ * field key. */
+static void define_hashindex(struct node *n, struct field *f, struct strings *s) {
+	const char *name = field_name(f);
+	struct Value v;
+	struct Type et;
+	struct field *lf, *kf;
+	struct node *en;
+	const char *dot, *hash;
+
+	if (!field_annotation(f, 0xb85e2f4c6d9a1370UL, &v))
+		return;
+
+	if (v.which != Value_text || !(dot = strchr(v.text.str, '.'))) {
+		fprintf(stderr, "schema breakage on $C::hashindex annotation of %s.%s\n", n->name.str, name);
+		exit(2);
+	}
+	if (f->v.t.which == Type__list)
+		read_Type(&et, f->v.t._list.elementType);
+	if (f->v.t.which != Type__list || et.which != Type_uint32) {
+		fprintf(stderr, "$C::hashindex on %s.%s, which is not a List(UInt32)\n", n->name.str, name);
+		exit(2);
+	}
+
+	lf = find_field(n, v.text.str, dot - v.text.str);
+	if (lf && lf->f.which == Field_slot && lf->v.t.which == Type__list)
+		read_Type(&et, lf->v.t._list.elementType);
+	if (!lf || lf->f.which != Field_slot || lf->v.t.which != Type__list || et.which != Type__struct) {
+		fprintf(stderr, "$C::hashindex on %s.%s: %.*s is not a list of structs\n",
+				n->name.str, name, (int) (dot - v.text.str), v.text.str);
+		exit(2);
+	}
+
+	en = find_node(et._struct.typeId);
+	kf = find_field(en, dot + 1, strlen(dot + 1));
+	if (kf && kf->f.which == Field_slot)
+		decode_slot(kf);
+	if (!kf || kf->f.which != Field_slot || !hashable(kf->v.t.which)) {
+		fprintf(stderr, "$C::hashindex on %s.%s: %s.%s is neither an integer, an enum nor text\n",
+				n->name.str, name, en->name.str, dot + 1);
+		exit(2);
+	}
+	hash = kf->v.t.which == Type_text ? "capn_hash_text(%s)" : "capn_hash64((uint64_t) %s)";
+
+	str_addf(&s->pub_get, "\nstatic uint32_t %s_hash_%s(capn_ptr p, void *arg)\n{\n", n->name.str, name);
+	str_addf(&s->pub_get, "\t%s x;\n\t(void) arg;\n", kf->v.tname);
+	get_member(&s->pub_get, kf, "p", "\t", "x");
+	str_addf(&s->pub_get, "\treturn ");
+	str_addf(&s->pub_get, hash, "x");
+	str_addf(&s->pub_get, ";\n}\n");
+
+	str_addf(&s->pub_get, "\nstatic int %s_eq_%s(capn_ptr p, const void *k)\n{\n", n->name.str, name);
+	str_addf(&s->pub_get, "\t%s x, y = *(const %s*) k;\n", kf->v.tname, kf->v.tname);
+	get_member(&s->pub_get, kf, "p", "\t", "x");
+	if (kf->v.t.which == Type_text) {
+		str_addf(&s->pub_get, "\treturn !capn_cmp_text(x, y);\n}\n");
+	} else {
+		str_addf(&s->pub_get, "\treturn x == y;\n}\n");
+	}
+
+	str_addf(&s->pub_get_header, "\nint %s_build_%s(%s_ptr p);\n", n->name.str, name, n->name.str);
+	str_addf(&s->pub_get, "\nint %s_build_%s(%s_ptr p)\n{\n", n->name.str, name, n->name.str);
+	str_addf(&s->pub_get, "\tcapn_list32 t;\n");
+	str_addf(&s->pub_get, "\tt = capn_hash_build(p.p.seg, capn_getp(p.p, %d, 1), %s_hash_%s, NULL);\n",
+			lf->f.slot.offset, n->name.str, name);
+	str_addf(&s->pub_get, "\tif (t.p.type == CAPN_NULL)\n\t\treturn -1;\n");
+	str_addf(&s->pub_get, "\treturn capn_setp(p.p, %d, t.p);\n}\n", f->f.slot.offset);
+
+	str_addf(&s->pub_get_header, "\nint %s_find_%s(%s_ptr p, %s v);\n", n->name.str, name, n->name.str, kf->v.tname);
+	str_addf(&s->pub_get, "\nint %s_find_%s(%s_ptr p, %s v)\n{\n", n->name.str, name, n->name.str, kf->v.tname);
+	str_addf(&s->pub_get, "\tcapn_list32 t;\n");
+	str_addf(&s->pub_get, "\tt.p = capn_getp(p.p, %d, 1);\n", f->f.slot.offset);
+	str_addf(&s->pub_get, "\treturn capn_hash_find(t, capn_getp(p.p, %d, 1), ", lf->f.slot.offset);
+	str_addf(&s->pub_get, hash, "v");
+	str_addf(&s->pub_get, ", %s_eq_%s, &v);\n}\n", n->name.str, name);
+}
+
 static void define_group(struct strings *s, struct node *n, const char *group_name, bool enclose_unions) {
 	struct field *f;
 	int flen = capn_len(n->n._struct.fields);
@@ -964,7 +1179,7 @@ static void define_group(struct strings *s, struct node *n, const char *group_na
 	int empty = 1;
 
 	for (f = n->fields; f < n->fields + flen; f++) {
-		decode_value(&f->v, f->f.slot.type, f->f.slot.defaultValue, NULL);
+		decode_slot(f);
 		if (f->v.t.which != Type__void)
 			empty = 0;
 	}
@@ -983,9 +1198,22 @@ static void define_group(struct strings *s, struct node *n, const char *group_na
 		str_addf(&s->var, "%s.", group_name);
 	}
 
+	/* the members of the struct itself get a dirty bit each, and can be
+	 * sort keys unless they are in a union */
+	const bool top = !group_name && !n->n._struct.isGroup;
+	int dirty = g_dirtymask && top;
+	int mark;
+
 	/* fields before the union members */
 	for (f = n->fields; f < n->fields + flen && !in_union(f); f++) {
+		mark = s->set.len;
 		define_field(s, f);
+		if (dirty)
+			dirty_member(n, f, s, field_name(f), mark);
+		if (top && f->f.which == Field_slot && field_annotation(f, 0xa3f1d56b8c2e7049UL, NULL))
+			define_sortkey(n, f, s);
+		if (top && f->f.which == Field_slot)
+			define_hashindex(n, f, s);
 
 		if (!g_fieldgetset) {
 			continue;
@@ -1018,14 +1246,24 @@ static void define_group(struct strings *s, struct node *n, const char *group_na
 
 		const bool keep_union_name = named_union && !enclose_unions;
 
+		mark = s->set.len;
 		do_union(s, n, f, keep_union_name ? group_name : NULL);
+		if (dirty)
+			dirty_member(n, NULL, s, "which", mark);
 
 		while (f < n->fields + flen && in_union(f))
 			f++;
 
 		/* fields after the unnamed union */
 		for (;f < n->fields + flen; f++) {
+			mark = s->set.len;
 			define_field(s, f);
+			if (dirty)
+				dirty_member(n, f, s, field_name(f), mark);
+			if (top && f->f.which == Field_slot && field_annotation(f, 0xa3f1d56b8c2e7049UL, NULL))
+				define_sortkey(n, f, s);
+			if (top && f->f.which == Field_slot)
+				define_hashindex(n, f, s);
 		}
 
 		if (enclose_unions)
@@ -1060,6 +1298,9 @@ static void define_struct(struct node *n) {
 	str_reset(&s.pub_set);
 	str_reset(&s.pub_get_header);
 	str_reset(&s.pub_set_header);
+	str_reset(&s.dirty_set);
+	str_reset(&s.dirty_enum);
+	s.ndirty = 0;
 
 	str_add(&s.dtab, "\t", -1);
 	str_add(&s.ftab, "\t", -1);
@@ -1073,8 +1314,15 @@ static void define_struct(struct node *n) {
 			s.decl.len == 0 ? "capnp_nowarn " : "",
 			n->name.str);
 	str_add(&HDR, s.decl.str, s.decl.len);
+	if (s.ndirty) {
+		str_addf(&HDR, "\tuint32_t _dirty[%d];\n", (s.ndirty + 31) / 32);
+	}
 	str_addf(&HDR, "};\n");
 
+	if (s.ndirty) {
+		str_addf(&HDR, "\nenum %s_dirty {%s\n};\n", n->name.str, s.dirty_enum.str);
+	}
+
 	for (i = capn_len(n->n.annotations)-1; i >= 0; i--) {
 		struct Annotation a;
 		struct Value v;
@@ -1113,6 +1361,9 @@ static void define_struct(struct node *n) {
 	str_addf(&SRC, "void read_%s(struct %s *s capnp_unused, %s_ptr p) {\n", n->name.str, n->name.str, n->name.str);
 	str_addf(&SRC, "\tcapn_resolve(&p.p);\n\tcapnp_use(s);\n");
 	str_add(&SRC, s.get.str, s.get.len);
+	for (i = 0; i < (s.ndirty + 31) / 32; i++) {
+		str_addf(&SRC, "\ts->_dirty[%d] = 0;\n", i);
+	}
 	str_addf(&SRC, "}\n");
 
 	str_addf(&SRC, "void write_%s(const struct %s *s capnp_unused, %s_ptr p) {\n", n->name.str, n->name.str, n->name.str);
@@ -1132,6 +1383,44 @@ static void define_struct(struct node *n) {
 	str_addf(&SRC, "\twrite_%s(s, p);\n", n->name.str);
 	str_addf(&SRC, "}\n");
 
+	if (s.ndirty) {
+		str_addf(&HDR, "\nvoid write_%s_dirty(struct %s *s, %s_ptr p);\n", n->name.str, n->name.str, n->name.str);
+		str_addf(&HDR, "\nvoid %s_mark_dirty(struct %s *s, enum %s_dirty f);\n", n->name.str, n->name.str, n->name.str);
+
+		str_addf(&SRC, "void write_%s_dirty(struct %s *s, %s_ptr p) {\n", n->name.str, n->name.str, n->name.str);
+		str_addf(&SRC, "\tcapn_resolve(&p.p);\n");
+		str_add(&SRC, s.dirty_set.str, s.dirty_set.len);
+		for (i = 0; i < (s.ndirty + 31) / 32; i++) {
+			str_addf(&SRC, "\ts->_dirty[%d] = 0;\n", i);
+		}
+		str_addf(&SRC, "}\n");
+
+		str_addf(&SRC, "void %s_mark_dirty(struct %s *s, enum %s_dirty f) {\n", n->name.str, n->name.str, n->name.str);
+		str_addf(&SRC, "\ts->_dirty[f/32] |= 1u << (f%%32);\n");
+		str_addf(&SRC, "}\n");
+	}
+
+	if (g_listbuilder) {
+		str_addf(&SRC, "int begin_%s_list(struct capn_list_builder *b, struct capn_segment *s, int hint) {\n", n->name.str);
+		str_addf(&SRC, "\treturn capn_list_begin(b, s, %d, %d, hint);\n", 8*n->n._struct.dataWordCount, n->n._struct.pointerCount);
+		str_addf(&SRC, "}\n");
+
+		str_addf(&SRC, "int append_%s(const struct %s *s, struct capn_list_builder *b) {\n", n->name.str, n->name.str);
+		str_addf(&SRC, "\t%s_list l;\n", n->name.str);
+		str_addf(&SRC, "\tint i = capn_list_grow(b, 1);\n");
+		str_addf(&SRC, "\tif (i < 0)\n\t\treturn -1;\n");
+		str_addf(&SRC, "\tl.p = b->p;\n");
+		str_addf(&SRC, "\tset_%s(s, l, i);\n", n->name.str);
+		str_addf(&SRC, "\treturn 0;\n");
+		str_addf(&SRC, "}\n");
+
+		str_addf(&SRC, "%s_list finish_%s_list(struct capn_list_builder *b) {\n", n->name.str, n->name.str);
+		str_addf(&SRC, "\t%s_list l;\n", n->name.str);
+		str_addf(&SRC, "\tl.p = capn_list_finish(b);\n");
+		str_addf(&SRC, "\treturn l;\n");
+		str_addf(&SRC, "}\n");
+	}
+
 	str_add(&SRC, s.pub_get.str, s.pub_get.len);
 	str_add(&SRC, s.pub_set.str, s.pub_set.len);
 
@@ -1404,6 +1693,12 @@ int main() {
 			case 0xf72bc690355d66deUL:	/* $C::fieldgetset */
 				g_fieldgetset = 1;
 				break;
+			case 0xd1c9e3b7a2f4580bUL:	/* $C::listbuilder */
+				g_listbuilder = 1;
+				break;
+			case 0xe6a7c2d8b15f3a94UL:	/* $C::dirtymask */
+				g_dirtymask = 1;
+				break;
 			case 0x8c99797357b357e9UL:	/* $C::donotinclude */
 				if (v.which != Value_uint64)
 				{
@@ -1483,6 +1778,11 @@ int main() {
 		declare(file_node, "void write_%s(const struct %s*, %s_ptr);\n", 3);
 		declare(file_node, "void get_%s(struct %s*, %s_list, int i);\n", 3);
 		declare(file_node, "void set_%s(const struct %s*, %s_list, int i);\n", 3);
+		if (g_listbuilder) {
+			declare(file_node, "int begin_%s_list(struct capn_list_builder*, struct capn_segment*, int hint);\n", 1);
+			declare(file_node, "int append_%s(const struct %s*, struct capn_list_builder*);\n", 2);
+			declare(file_node, "%s_list finish_%s_list(struct capn_list_builder*);\n", 2);
+		}
 
 		str_addf(&HDR, "\n#ifdef __cplusplus\n}\n#endif\n#endif\n");
 
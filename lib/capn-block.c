@@ -0,0 +1,295 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-block.c
+ *
+ * Message log cut into blocks, each led by a header message with the
+ * min/max of some integer keys and a bloom filter over some text keys of
+ * the messages in it. See struct capn_block_writer in capnp_c.h.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BLOCK_DEF_SIZE (1 << 20)
+#define BLOCK_DEF_BITS 10
+#define BLOCK_MAGIC UINT64_C(0x314b4c424e504143) /* "CAPNBLK1" */
+
+/* The header root struct: 3 data words and 3 pointers
+ *
+ *   0   magic
+ *   8   messages (32 bits), texts (16 bits), hashes (8 bits)
+ *   16  size of the messages that follow, in bytes
+ *
+ * and the pointers min, max (List(Int64), one per key) and bloom
+ * (List(UInt64), the filter bits).
+ */
+#define HDR_DATASZ 24
+#define HDR_PTRS 3
+
+/* Bloom filter bits are picked by double hashing, the text index is mixed
+ * in so that one filter serves all the text keys */
+static void bloom_hash(int text, capn_text t, uint32_t *h1, uint32_t *h2) {
+	*h1 = capn_hash_text(t) + (uint32_t) text * 0x9e3779b9u;
+	*h2 = capn_hash64(((uint64_t) text << 32) | *h1) | 1;
+}
+
+static int reserve(const struct capn_allocator *a, void **p, size_t *cap, size_t sz) {
+	size_t n = *cap ? 2 * *cap : 4096;
+	void *np;
+
+	if (sz <= *cap)
+		return 0;
+	if (n < sz)
+		n = sz;
+	if ((np = a->realloc(a->user, *p, n)) == NULL)
+		return -1;
+	*p = np;
+	*cap = n;
+	return 0;
+}
+
+static int write_all(struct capn_block_writer *w, const void *p, size_t sz) {
+	while (sz) {
+		ssize_t r = w->write_fd(w->fd, p, sz);
+		if (r <= 0)
+			return -1;
+		p = (const char*) p + r;
+		sz -= r;
+	}
+	return 0;
+}
+
+int capn_block_write(struct capn_block_writer *w, struct capn *c) {
+	const struct capn_allocator *a = w->alloc ? w->alloc : &capn_default_allocator;
+	int i, n = capn_size(c);
+	capn_ptr root;
+
+	if (n <= 0 || w->nkeys < 0 || w->ntexts < 0 || w->ntexts > 0xFFFF)
+		return -1;
+	if (!w->vals) {
+		w->vals = (int64_t*) a->alloc(a->user, sizeof(int64_t) * (3 * w->nkeys + 1));
+		w->texts = (capn_text*) a->alloc(a->user, sizeof(capn_text) * (w->ntexts + 1));
+		if (!w->vals || !w->texts)
+			return -1;
+		w->min = w->vals + w->nkeys;
+		w->max = w->min + w->nkeys;
+	}
+	if (reserve(a, (void**) &w->buf, &w->cap, w->len + n)
+			|| reserve(a, (void**) &w->hashes, &w->hashcap, 2 * sizeof(uint32_t) * (w->nhashes + w->ntexts)))
+		return -1;
+
+	memset(w->vals, 0, sizeof(int64_t) * w->nkeys);
+	memset(w->texts, 0, sizeof(capn_text) * w->ntexts);
+	root = capn_getp(capn_root(c), 0, 1);
+	if (w->keys && w->keys(root, w->vals, w->texts, w->arg))
+		return -1;
+	if (capn_write_mem(c, w->buf + w->len, n, 0) != n)
+		return -1;
+	w->len += n;
+
+	for (i = 0; i < w->nkeys; i++) {
+		if (!w->messages || w->vals[i] < w->min[i])
+			w->min[i] = w->vals[i];
+		if (!w->messages || w->vals[i] > w->max[i])
+			w->max[i] = w->vals[i];
+	}
+	for (i = 0; i < w->ntexts; i++) {
+		if (!w->texts[i].str)
+			continue;
+		bloom_hash(i, w->texts[i], &w->hashes[2*w->nhashes], &w->hashes[2*w->nhashes+1]);
+		w->nhashes++;
+	}
+	w->messages++;
+
+	if (w->len >= (w->block_size ? w->block_size : BLOCK_DEF_SIZE))
+		return capn_block_flush(w);
+	return 0;
+}
+
+int capn_block_flush(struct capn_block_writer *w) {
+	const struct capn_allocator *a = w->alloc ? w->alloc : &capn_default_allocator;
+	int bits = w->bloom_bits > 0 ? w->bloom_bits : BLOCK_DEF_BITS;
+	int i, k = (bits * 69 + 50) / 100, ret = -1;
+	size_t j, nwords = (w->nhashes * bits + 63) / 64;
+	capn_list64 min, max, bloom;
+	capn_ptr root, hdr;
+	uint64_t *words;
+	struct capn c;
+
+	if (!w->messages)
+		return 0;
+	if (k < 1)
+		k = 1;
+	if (k > 16)
+		k = 16;
+	if (nwords < 1)
+		nwords = 1;
+	if (nwords >= (1u << 29))
+		return -1;
+
+	capn_init_alloc(&c, a);
+	root = capn_root(&c);
+	hdr = capn_new_struct(root.seg, HDR_DATASZ, HDR_PTRS);
+	min = capn_new_list64(root.seg, w->nkeys);
+	max = capn_new_list64(root.seg, w->nkeys);
+	bloom = capn_new_list64(root.seg, (int) nwords);
+	if (capn_setp(root, 0, hdr) || capn_setp(hdr, 0, min.p)
+			|| capn_setp(hdr, 1, max.p) || capn_setp(hdr, 2, bloom.p))
+		goto end;
+
+	capn_write64(hdr, 0, BLOCK_MAGIC);
+	capn_write32(hdr, 8, w->messages);
+	capn_write16(hdr, 12, (uint16_t) w->ntexts);
+	capn_write8(hdr, 14, (uint8_t) k);
+	capn_write64(hdr, 16, w->len);
+	for (i = 0; i < w->nkeys; i++) {
+		capn_set64(min, i, (uint64_t) w->min[i]);
+		capn_set64(max, i, (uint64_t) w->max[i]);
+	}
+
+	/* the filter is sized once all the texts of the block are known */
+	words = (uint64_t*) a->alloc(a->user, nwords * 8);
+	if (!words)
+		goto end;
+	memset(words, 0, nwords * 8);
+	for (j = 0; j < w->nhashes; j++) {
+		uint32_t h1 = w->hashes[2*j], h2 = w->hashes[2*j+1];
+		for (i = 0; i < k; i++) {
+			uint64_t bit = (h1 + (uint64_t) i * h2) % (nwords * 64);
+			words[bit / 64] |= UINT64_C(1) << (bit % 64);
+		}
+	}
+	capn_setv64(bloom, 0, words, (int) nwords);
+	a->free(a->user, words);
+
+	if (capn_write_fd(&c, w->write_fd, w->fd, 0) < 0 || write_all(w, w->buf, w->len))
+		goto end;
+
+	w->len = 0;
+	w->nhashes = 0;
+	w->messages = 0;
+	ret = 0;
+end:
+	capn_free(&c);
+	return ret;
+}
+
+void capn_block_writer_free(struct capn_block_writer *w) {
+	const struct capn_allocator *a = w->alloc ? w->alloc : &capn_default_allocator;
+
+	a->free(a->user, w->buf);
+	a->free(a->user, w->hashes);
+	a->free(a->user, w->vals);
+	a->free(a->user, w->texts);
+	w->buf = NULL;
+	w->hashes = NULL;
+	w->vals = w->min = w->max = NULL;
+	w->texts = NULL;
+	w->len = w->cap = w->nhashes = w->hashcap = 0;
+	w->messages = 0;
+}
+
+/* read_at reads sz bytes at off in the file to the reader buffer at pos.
+ * Returns 1 at the end of the file (only if nothing was read), 0 on
+ * success and -1 on error or a short read. */
+static int read_at(struct capn_block_reader *r, size_t pos, size_t sz, uint64_t off) {
+	const struct capn_allocator *a = r->alloc ? r->alloc : &capn_default_allocator;
+	size_t done = 0;
+
+	if (reserve(a, (void**) &r->buf, &r->cap, pos + sz))
+		return -1;
+	while (done < sz) {
+		ssize_t n = pread(r->fd, r->buf + pos + done, sz - done, (off_t) (off + done));
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return done == 0 && pos == 0 ? 1 : -1;
+		done += n;
+	}
+	return 0;
+}
+
+int capn_block_next(struct capn_block_reader *r, struct capn_block *b) {
+	uint32_t segnum;
+	size_t table;
+	int64_t total;
+	capn_ptr hdr;
+	int ret;
+
+	/* segment count, segment table, then the rest of the header */
+	ret = read_at(r, 0, 8, r->off);
+	if (ret == 1) {
+		/* the messages of the last block are never read, so check
+		 * that they are all there */
+		struct stat st;
+		if (fstat(r->fd, &st) || (uint64_t) st.st_size != r->off)
+			return -1;
+		return 0;
+	} else if (ret) {
+		return -1;
+	}
+	segnum = capn_flip32(*(const uint32_t*) r->buf) + 1;
+	if (segnum == 0 || segnum > CAPN_BLOCK_SEGS)
+		return -1;
+	table = 8 * (segnum/2 + 1);
+	if (table > 8 && read_at(r, 8, table - 8, r->off + 8))
+		return -1;
+	total = capn_frame_size(r->buf, (size_t) -1);
+	if (total <= 0 || read_at(r, table, total - table, r->off + table))
+		return -1;
+	if (capn_init_frame(&r->c, r->segs, CAPN_BLOCK_SEGS, r->buf, total) != total)
+		return -1;
+
+	hdr = capn_getp(capn_root(&r->c), 0, 1);
+	if (capn_read64(hdr, 0) != BLOCK_MAGIC)
+		return -1;
+
+	memset(b, 0, sizeof(*b));
+	b->off = r->off + total;
+	b->size = capn_read64(hdr, 16);
+	b->messages = capn_read32(hdr, 8);
+	b->ntexts = capn_read16(hdr, 12);
+	b->nhash = capn_read8(hdr, 14);
+	b->min.p = capn_getp(hdr, 0, 1);
+	b->max.p = capn_getp(hdr, 1, 1);
+	b->bloom.p = capn_getp(hdr, 2, 1);
+	if (b->min.p.len != b->max.p.len || b->bloom.p.len == 0 || (b->size & 7))
+		return -1;
+
+	r->off = b->off + b->size;
+	return 1;
+}
+
+void capn_block_reader_free(struct capn_block_reader *r) {
+	const struct capn_allocator *a = r->alloc ? r->alloc : &capn_default_allocator;
+
+	a->free(a->user, r->buf);
+	r->buf = NULL;
+	r->cap = 0;
+}
+
+int capn_block_overlaps(const struct capn_block *b, int key, int64_t lo, int64_t hi) {
+	if (key < 0 || key >= b->min.p.len)
+		return 1;
+	return lo <= (int64_t) capn_get64(b->max, key) && hi >= (int64_t) capn_get64(b->min, key);
+}
+
+int capn_block_may_contain(const struct capn_block *b, int text, capn_text t) {
+	uint64_t m = (uint64_t) b->bloom.p.len * 64;
+	uint32_t h1, h2;
+	int i;
+
+	if (text < 0 || text >= b->ntexts)
+		return 1;
+	bloom_hash(text, t, &h1, &h2);
+	for (i = 0; i < b->nhash; i++) {
+		uint64_t bit = (h1 + (uint64_t) i * h2) % m;
+		if (!(capn_get64(b->bloom, (int) (bit / 64)) & (UINT64_C(1) << (bit % 64))))
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,151 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-delta.c
+ *
+ * Delta coding of consecutive messages: each frame is the XOR of a message
+ * with the previous one, packed. See struct capn_delta in capnp_c.h.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include "capnp_priv.h"
+#include <string.h>
+
+#define KEYFRAME (1u << 31)
+
+void capn_delta_init(struct capn_delta *d, unsigned keyframe, const struct capn_allocator *a) {
+	memset(d, 0, sizeof(*d));
+	d->alloc = a ? a : &capn_default_allocator;
+	d->keyframe = keyframe;
+}
+
+void capn_delta_free(struct capn_delta *d) {
+	d->alloc->free(d->alloc->user, d->ref);
+	d->alloc->free(d->alloc->user, d->buf);
+	d->ref = d->buf = NULL;
+	d->len = d->cap = 0;
+}
+
+/* reserve makes room for sz bytes in both buffers, keeping the reference */
+static int reserve(struct capn_delta *d, size_t sz) {
+	const struct capn_allocator *a = d->alloc;
+	size_t cap = d->cap ? 2 * d->cap : 4096;
+	uint8_t *p;
+
+	if (sz <= d->cap)
+		return 0;
+	if (cap < sz)
+		cap = sz;
+
+	if ((p = (uint8_t*) a->realloc(a->user, d->ref, cap)) == NULL)
+		return -1;
+	d->ref = p;
+	if ((p = (uint8_t*) a->realloc(a->user, d->buf, cap)) == NULL)
+		return -1;
+	d->buf = p;
+	d->cap = cap;
+	return 0;
+}
+
+/* xor_words XORs the first n bytes of from into to, n is a whole number of
+ * words */
+static void xor_words(uint8_t *to, const uint8_t *from, size_t n) {
+	uint64_t *t = (uint64_t*) to;
+	const uint64_t *f = (const uint64_t*) from;
+	size_t i;
+
+	for (i = 0; i < n/8; i++)
+		t[i] ^= f[i];
+}
+
+static void swap(struct capn_delta *d, size_t len) {
+	uint8_t *p = d->ref;
+	d->ref = d->buf;
+	d->buf = p;
+	d->len = len;
+}
+
+int64_t capn_delta_encode(struct capn_delta *d, struct capn *c, uint8_t *p, size_t sz) {
+	struct capn_stream z;
+	uint32_t hdr[2];
+	int key, n = capn_size(c);
+	size_t common;
+	uint8_t *words;
+
+	if (n <= 0 || sz < 8 || reserve(d, n))
+		return -1;
+	if (capn_write_mem(c, d->buf, n, 0) != n)
+		return -1;
+
+	key = !d->len || (d->keyframe && d->count >= d->keyframe);
+	common = d->len < (size_t) n ? d->len : (size_t) n;
+
+	if (key) {
+		words = d->buf;
+	} else {
+		/* the delta goes over the reference, which is then swapped
+		 * for the new message */
+		words = d->ref;
+		xor_words(words, d->buf, common);
+		memcpy(words + common, d->buf + common, n - common);
+	}
+
+	memset(&z, 0, sizeof(z));
+	z.next_in = words;
+	z.avail_in = n;
+	z.next_out = p + 8;
+	z.avail_out = sz - 8;
+	if (capn_deflate(&z)) {
+		if (!key)
+			xor_words(words, d->buf, common);
+		return -1;
+	}
+
+	hdr[0] = capn_flip32((uint32_t) n/8 | (key ? KEYFRAME : 0));
+	hdr[1] = capn_flip32((uint32_t) (sz - 8 - z.avail_out));
+	memcpy(p, hdr, 8);
+
+	d->count = key ? 1 : d->count + 1;
+	swap(d, n);
+	return (int64_t) (sz - z.avail_out);
+}
+
+int64_t capn_delta_decode(struct capn_delta *d, struct capn *c, const uint8_t *p, size_t sz) {
+	struct capn_stream z;
+	uint32_t hdr[2];
+	size_t n, packed, common;
+	int key;
+
+	if (sz < 8)
+		return 0;
+	memcpy(hdr, p, 8);
+	hdr[0] = capn_flip32(hdr[0]);
+	packed = capn_flip32(hdr[1]);
+	key = (hdr[0] & KEYFRAME) != 0;
+	n = (size_t) (hdr[0] & ~KEYFRAME) * 8;
+
+	if (sz - 8 < packed)
+		return 0;
+	if ((!key && !d->len) || n == 0 || reserve(d, n))
+		return -1;
+
+	memset(&z, 0, sizeof(z));
+	z.next_in = p + 8;
+	z.avail_in = packed;
+	z.next_out = d->buf;
+	z.avail_out = n;
+	if (capn_inflate(&z) || z.avail_out || z.avail_in)
+		return -1;
+
+	if (!key) {
+		common = d->len < n ? d->len : n;
+		xor_words(d->buf, d->ref, common);
+	}
+
+	d->count = key ? 1 : d->count + 1;
+	swap(d, n);
+	if (capn_init_mem_alloc(c, d->ref, n, 0, d->alloc))
+		return -1;
+	return (int64_t) (8 + packed);
+}
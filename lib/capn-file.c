@@ -0,0 +1,272 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-file.c
+ *
+ * Segment allocation backed by a file mapping, so that a message can be
+ * built directly on disk in the standard framing, and forwarding of
+ * messages from a file without reading them in.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+/* The file starts with a 4096 byte block reserved for the segment table,
+ *
+ *   [segnum-1][segsiz] * segnum [padding]
+ *
+ * Segment data follows, each segment being a multiple of 4096 bytes so that
+ * every segment starts on a block boundary. The table has room for
+ * FILE_MAX_SEGS segments, fewer than the 512 the reference implementation
+ * accepts in a message.
+ *
+ * On finish the data of the first segment is moved down to just after the
+ * table, and the table is filled in with the capacity of each segment (the
+ * unused tail of a segment is still zero and so reads back as padding) and
+ * the used length of the last segment. The space the table did not use
+ * becomes zero padding at the end of the first segment, so the other
+ * segments stay where they are. Moving the whole segment keeps the
+ * pointers into it valid, as far pointers are relative to the segment.
+ */
+
+#define FILE_HDR_SZ 4096
+#define FILE_MAX_SEGS 511
+#define FILE_DEF_SEGSZ (1 << 20)
+#define FILE_MAX_SEGSZ (1 << 30)
+
+struct file_segment {
+	struct capn_segment s;
+	char *map;
+	size_t maplen;
+};
+
+static struct capn_segment *create(void *u, uint32_t id, int sz) {
+	struct capn_file *f = (struct capn_file*) u;
+	struct file_segment *fs;
+	size_t cap, delta;
+	off_t base;
+	long pagesz;
+	void *map;
+
+	if (id >= FILE_MAX_SEGS || f->end == 0)
+		return NULL;
+
+	cap = (size_t) sz > f->segsz ? (size_t) sz : f->segsz;
+	cap = (cap + 4095) & ~(size_t)4095;
+	if (f->segsz < FILE_MAX_SEGSZ)
+		f->segsz *= 2;
+
+	/* grow the file sparsely and map the new tail */
+	if (ftruncate(f->fd, (off_t) (f->end + cap)))
+		return NULL;
+
+	pagesz = sysconf(_SC_PAGESIZE);
+	base = (off_t) (f->end & ~(uint64_t)(pagesz - 1));
+	delta = f->end - base;
+	map = mmap(NULL, cap + delta, PROT_READ|PROT_WRITE, MAP_SHARED, f->fd, base);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	fs = (struct file_segment*) calloc(1, sizeof(*fs));
+	if (!fs) {
+		munmap(map, cap + delta);
+		return NULL;
+	}
+
+	fs->map = (char*) map;
+	fs->maplen = cap + delta;
+	fs->s.data = fs->map + delta;
+	fs->s.cap = cap;
+	fs->s.user = fs;
+	f->end += cap;
+	return &fs->s;
+}
+
+static struct capn_segment *create_local(void *u, int sz) {
+	struct capn_segment *s;
+	(void) u;
+	sz += sizeof(*s);
+	if (sz < 4096) {
+		sz = 4096;
+	} else {
+		sz = (sz + 4095) & ~4095;
+	}
+	s = (struct capn_segment*) calloc(1, sz);
+	if (!s)
+		return NULL;
+	s->data = (char*) (s+1);
+	s->cap = sz - sizeof(*s);
+	s->user = s;
+	return s;
+}
+
+int capn_init_file(struct capn *c, struct capn_file *f, int fd, size_t segsz) {
+	memset(c, 0, sizeof(*c));
+	memset(f, 0, sizeof(*f));
+
+	/* reserve (and zero) the segment table */
+	if (ftruncate(fd, 0) || ftruncate(fd, FILE_HDR_SZ))
+		return -1;
+
+	f->fd = fd;
+	f->end = FILE_HDR_SZ;
+	f->segsz = segsz ? segsz : FILE_DEF_SEGSZ;
+
+	c->create = &create;
+	c->create_local = &create_local;
+	c->user = f;
+	return 0;
+}
+
+int64_t capn_file_finish(struct capn *c) {
+	struct capn_file *f = (struct capn_file*) c->user;
+	uint32_t hdr[FILE_MAX_SEGS + 1];
+	struct capn_segment *s;
+	size_t table, shift, len0;
+	uint64_t total;
+	char *map;
+	uint32_t i;
+
+	if (c->segnum == 0 || c->segnum > FILE_MAX_SEGS || f->end == 0)
+		return -1;
+
+	table = 8 * (c->segnum/2 + 1);
+	shift = FILE_HDR_SZ - table;
+	len0 = c->seglist->len;
+	total = table;
+
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = capn_flip32(c->segnum - 1);
+	for (i = 0, s = c->seglist; s != NULL; i++, s = s->next) {
+		/* segments are contiguous in the file, so all but the
+		 * last one are written out to their full capacity, and the
+		 * first one takes up the space the table does not need */
+		size_t sz = s->next ? s->cap : s->len;
+		if (i == 0 && s->next)
+			sz += shift;
+		hdr[1 + i] = capn_flip32((uint32_t) (sz / 8));
+		total += sz;
+	}
+
+	map = (char*) mmap(NULL, FILE_HDR_SZ + len0, PROT_READ|PROT_WRITE, MAP_SHARED, f->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	memmove(map + table, map + FILE_HDR_SZ, len0);
+	memset(map + table + len0, 0, shift);
+	memcpy(map, hdr, table);
+	munmap(map, FILE_HDR_SZ + len0);
+
+	if (ftruncate(f->fd, (off_t) total))
+		return -1;
+
+	f->end = 0;
+	return (int64_t) total;
+}
+
+void capn_file_free(struct capn *c) {
+	struct capn_segment *s;
+
+	for (s = c->seglist; s != NULL; s = s->next) {
+		struct file_segment *fs = (struct file_segment*) s->user;
+		munmap(fs->map, fs->maplen);
+	}
+
+	capn_free(c);
+}
+
+static int pread_all(int fd, void *p, size_t sz, uint64_t off) {
+	while (sz) {
+		ssize_t r = pread(fd, p, sz, (off_t) off);
+		if (r <= 0)
+			return -1;
+		p = (char*) p + r;
+		sz -= r;
+		off += r;
+	}
+	return 0;
+}
+
+/* send copies [off, end) of in to out, in the kernel where possible */
+static int send_range(int out, int in, uint64_t *off, uint64_t end) {
+#ifdef __linux__
+	while (*off < end) {
+		size_t sz = end - *off < (1u << 30) ? (size_t) (end - *off) : (1u << 30);
+		off_t o = (off_t) *off;
+		ssize_t r = sendfile(out, in, &o, sz);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		*off = (uint64_t) o;
+	}
+#endif
+	/* fall back to a copy through userspace, e.g. when out is not
+	 * supported by sendfile */
+	while (*off < end) {
+		char buf[1 << 16];
+		size_t sz = end - *off < sizeof(buf) ? (size_t) (end - *off) : sizeof(buf);
+		ssize_t r = pread(in, buf, sz, (off_t) *off);
+		size_t done = 0;
+		if (r <= 0)
+			return -1;
+		while (done < (size_t) r) {
+			ssize_t w = write(out, buf + done, r - done);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				return -1;
+			done += w;
+			*off += w;
+		}
+	}
+	return 0;
+}
+
+int64_t capn_forward_fd(int out, int in, uint64_t *off, int64_t count) {
+	/* a table of 1024 segments takes 513 words */
+	uint32_t hdr[2 * 513];
+	uint64_t end = *off;
+	int64_t n = 0;
+	struct stat st;
+
+	if (fstat(in, &st))
+		return -1;
+
+	/* walk the segment tables to find where the last message ends */
+	while ((count <= 0 || n < count) && end + 8 <= (uint64_t) st.st_size) {
+		uint32_t segnum;
+		size_t table;
+		int64_t sz;
+
+		if (pread_all(in, hdr, 8, end))
+			return -1;
+		segnum = capn_flip32(hdr[0]) + 1;
+		if (segnum == 0 || segnum > 1024)
+			return -1;
+		table = 8 * (segnum/2 + 1);
+		if (end + table > (uint64_t) st.st_size)
+			break;
+		if (table > 8 && pread_all(in, hdr + 2, table - 8, end + 8))
+			return -1;
+
+		sz = capn_frame_size(hdr, (size_t) (st.st_size - end));
+		if (sz < 0)
+			return -1;
+		if (sz == 0)
+			break;
+		end += sz;
+		n++;
+	}
+
+	if (send_range(out, in, off, end))
+		return -1;
+	return n;
+}
@@ -33,7 +33,26 @@ struct check_segment_alignment {
 	unsigned int foo : (sizeof(struct capn_segment)&7) ? -1 : 1;
 };
 
-static struct capn_segment *create(void *u, uint32_t id, int sz) {
+static void *default_alloc(void *u, size_t sz) {
+	return malloc(sz);
+}
+
+static void *default_realloc(void *u, void *p, size_t sz) {
+	return realloc(p, sz);
+}
+
+static void default_free(void *u, void *p) {
+	free(p);
+}
+
+const struct capn_allocator capn_default_allocator = {
+	&default_alloc,
+	&default_realloc,
+	&default_free,
+	NULL
+};
+
+static struct capn_segment *new_segment(const struct capn_allocator *a, int sz) {
 	struct capn_segment *s;
 	sz += sizeof(*s);
 	if (sz < 4096) {
@@ -41,44 +60,136 @@ static struct capn_segment *create(void *u, uint32_t id, int sz) {
 	} else {
 		sz = (sz + 4095) & ~4095;
 	}
-	s = (struct capn_segment*) calloc(1, sz);
+	s = (struct capn_segment*) a->alloc(a->user, sz);
+	if (!s)
+		return NULL;
+	memset(s, 0, sz);
 	s->data = (char*) (s+1);
 	s->cap = sz - sizeof(*s);
 	s->user = s;
 	return s;
 }
 
+static struct capn_segment *create(void *u, uint32_t id, int sz) {
+	return new_segment(&capn_default_allocator, sz);
+}
+
 static struct capn_segment *create_local(void *u, int sz) {
 	return create(u, 0, sz);
 }
 
+/* Messages with their own allocator keep it in c->user */
+static struct capn_segment *create_alloc(void *u, uint32_t id, int sz) {
+	return new_segment((const struct capn_allocator*) u, sz);
+}
+
+static struct capn_segment *create_local_alloc(void *u, int sz) {
+	return create_alloc(u, 0, sz);
+}
+
+static int is_malloc(const struct capn *c) {
+	return c->create == &create || c->create == &create_alloc;
+}
+
 void capn_init_malloc(struct capn *c) {
+	capn_init_alloc(c, NULL);
+}
+
+void capn_init_alloc(struct capn *c, const struct capn_allocator *a) {
 	memset(c, 0, sizeof(*c));
-	c->create = &create;
-	c->create_local = &create_local;
+	if (a) {
+		c->create = &create_alloc;
+		c->create_local = &create_local_alloc;
+		c->user = (void*) a;
+		c->alloc = a;
+	} else {
+		c->create = &create;
+		c->create_local = &create_local;
+	}
 }
 
 void capn_free(struct capn *c) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
 	struct capn_segment *s = c->seglist;
 	while (s != NULL) {
 		struct capn_segment *n = s->next;
-		free(s->user);
+		if (s->user)
+			a->free(a->user, s->user);
 		s = n;
 	}
 	capn_reset_copy(c);
+	capn_intern_disable(c);
+	capn_orphans_disable(c);
 }
 
 void capn_reset_copy(struct capn *c) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
 	struct capn_segment *s = c->copylist;
 	while (s != NULL) {
 		struct capn_segment *n = s->next;
-		free(s->user);
+		if (s->user)
+			a->free(a->user, s->user);
 		s = n;
 	}
 	c->copy = NULL;
 	c->copylist = NULL;
 }
 
+/* Segments of attached blobs may end mid word, they are written out padded
+ * with zeros to the next word */
+#define SEG_PADDED(seg) (((seg)->len + 7) & ~7)
+
+static struct capn_segment *attach(struct capn *c, const void *p, size_t sz) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	struct capn_segment *s;
+
+	/* list lengths are 29 bits */
+	if (!is_malloc(c) || sz >= (1u << 29))
+		return NULL;
+
+	/* make sure the blob does not become the root segment */
+	if (!capn_root(c).seg)
+		return NULL;
+
+	s = (struct capn_segment*) a->alloc(a->user, sizeof(*s));
+	if (!s)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+
+	/* cap == len so new_data never allocates in it */
+	s->data = (char*) p;
+	s->len = s->cap = (int) sz;
+	s->user = s;
+	capn_append_segment(c, s);
+	return s;
+}
+
+capn_data capn_attach_data(struct capn *c, const void *p, size_t sz) {
+	capn_data d;
+	memset(&d, 0, sizeof(d));
+	d.p.seg = attach(c, p, sz);
+	if (d.p.seg) {
+		d.p.type = CAPN_LIST;
+		d.p.data = d.p.seg->data;
+		d.p.len = (int) sz;
+		d.p.datasz = 1;
+	}
+	return d;
+}
+
+capn_text capn_attach_text(struct capn *c, const char *str, size_t len) {
+	capn_text t;
+	memset(&t, 0, sizeof(t));
+	if (str[len] != '\0')
+		return t;
+	t.seg = attach(c, str, len + 1);
+	if (t.seg) {
+		t.str = str;
+		t.len = (int) len;
+	}
+	return t;
+}
+
 #define ZBUF_SZ 4096
 
 static int read_fp(void *p, size_t sz, FILE *f, struct capn_stream *z, uint8_t* zbuf, int packed) {
@@ -114,7 +225,7 @@ static int read_fp(void *p, size_t sz, FILE *f, struct capn_stream *z, uint8_t*
 	}
 }
 
-static int init_fp(struct capn *c, FILE *f, struct capn_stream *z, int packed) {
+static int init_fp(struct capn *c, FILE *f, struct capn_stream *z, int packed, const struct capn_allocator *a) {
 	/*
 	 * Initialize 'c' from the contents of 'f', assuming the message has been
 	 * serialized with the standard framing format. From https://capnproto.org/encoding.html:
@@ -132,7 +243,8 @@ static int init_fp(struct capn *c, FILE *f, struct capn_stream *z, int packed) {
 	uint8_t zbuf[ZBUF_SZ];
 	char *data = NULL;
 
-	capn_init_malloc(c);
+	capn_init_alloc(c, a);
+	a = c->alloc ? c->alloc : &capn_default_allocator;
 
 	/* Read the first four bytes to know how many headers we have */
 	if (read_fp(&segnum, 4, f, z, zbuf, packed))
@@ -155,10 +267,12 @@ static int init_fp(struct capn *c, FILE *f, struct capn_stream *z, int packed) {
 		total += hdr[i];
 	}
 
-	/* Allocate space for the data and the capn_segment structs */
-	s = (struct capn_segment*) calloc(1, total + (sizeof(*s) * segnum));
+	/* Allocate space for the data and the capn_segment structs. The data
+	 * is read in full below so only the headers need zeroing. */
+	s = (struct capn_segment*) a->alloc(a->user, total + (sizeof(*s) * segnum));
 	if (!s)
 		goto err;
+	memset(s, 0, sizeof(*s) * segnum);
 
 	/* Now read the data and setup the capn_segment structs */
 	data = (char*) (s+segnum);
@@ -175,26 +289,294 @@ static int init_fp(struct capn *c, FILE *f, struct capn_stream *z, int packed) {
     /* Set the entire region to be freed on the last segment */
 	s[segnum-1].user = s;
 
+	CAPN_PROBE4(init_done, c, segnum, total, packed);
 	return 0;
 
 err:
 	memset(c, 0, sizeof(*c));
-	free(s);
+	if (s)
+		a->free(a->user, s);
 	return -1;
 }
 
 int capn_init_fp(struct capn *c, FILE *f, int packed) {
+	return capn_init_fp_alloc(c, f, packed, NULL);
+}
+
+int capn_init_fp_alloc(struct capn *c, FILE *f, int packed, const struct capn_allocator *a) {
 	struct capn_stream z;
 	memset(&z, 0, sizeof(z));
-	return init_fp(c, f, &z, packed);
+	return init_fp(c, f, &z, packed, a);
 }
 
 int capn_init_mem(struct capn *c, const uint8_t *p, size_t sz, int packed) {
+	return capn_init_mem_alloc(c, p, sz, packed, NULL);
+}
+
+int capn_init_mem_alloc(struct capn *c, const uint8_t *p, size_t sz, int packed, const struct capn_allocator *a) {
 	struct capn_stream z;
 	memset(&z, 0, sizeof(z));
 	z.next_in = p;
 	z.avail_in = sz;
-	return init_fp(c, NULL, &z, packed);
+	return init_fp(c, NULL, &z, packed, a);
+}
+
+int64_t capn_frame_size(const void *p, size_t sz) {
+	const uint32_t *hdr = (const uint32_t*) p;
+	uint32_t i, segnum;
+	uint64_t total;
+
+	if (sz < 4)
+		return 0;
+	segnum = capn_flip32(hdr[0]);
+	if (segnum > 1023)
+		return -1;
+	segnum++;
+
+	total = 8 * (segnum/2 + 1);
+	if (total > sz)
+		return 0;
+	for (i = 0; i < segnum; i++) {
+		uint32_t n = capn_flip32(hdr[1+i]);
+		if (n > INT_MAX/8)
+			return -1;
+		total += 8 * (uint64_t) n;
+	}
+
+	return total <= sz ? (int64_t) total : 0;
+}
+
+int64_t capn_init_frame(struct capn *c, struct capn_segment *segs, int nsegs, const void *p, size_t sz) {
+	const uint32_t *hdr = (const uint32_t*) p;
+	int64_t total = capn_frame_size(p, sz);
+	uint32_t i, segnum;
+	char *data;
+
+	memset(c, 0, sizeof(*c));
+	if (total <= 0)
+		return total;
+
+	segnum = capn_flip32(hdr[0]) + 1;
+	if (segnum > (uint32_t) nsegs)
+		return -1;
+
+	data = (char*) p + 8 * (segnum/2 + 1);
+	memset(segs, 0, sizeof(*segs) * segnum);
+	for (i = 0; i < segnum; i++) {
+		segs[i].len = segs[i].cap = 8 * capn_flip32(hdr[1+i]);
+		segs[i].data = data;
+		data += segs[i].len;
+		capn_append_segment(c, &segs[i]);
+	}
+
+	CAPN_PROBE4(init_done, c, segnum, total, 0);
+	return total;
+}
+
+int capn_template_init(struct capn_template *t, struct capn *proto) {
+	struct capn_segment *s;
+
+	memset(t, 0, sizeof(*t));
+	if (proto->segnum == 0)
+		return -1;
+
+	t->proto = proto;
+	t->segnum = proto->segnum;
+	for (s = proto->seglist; s != NULL; s = s->next)
+		t->size += SEG_PADDED(s);
+	return 0;
+}
+
+/* clone_block copies the first segnum segments of src, size bytes in all,
+ * into c using one block for the segment headers and the data, as in
+ * init_fp */
+static int clone_block(struct capn *c, const struct capn *src, uint32_t segnum, size_t size) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	struct capn_segment *s, *from;
+	char *data;
+	uint32_t i;
+
+	s = (struct capn_segment*) a->alloc(a->user, sizeof(*s) * segnum + size);
+	if (!s)
+		return -1;
+	memset(s, 0, sizeof(*s) * segnum);
+	data = (char*) (s + segnum);
+
+	for (i = 0, from = src->seglist; i < segnum; i++, from = from->next) {
+		memcpy(data, from->data, from->len);
+		memset(data + from->len, 0, SEG_PADDED(from) - from->len);
+		s[i].data = data;
+		s[i].len = s[i].cap = SEG_PADDED(from);
+		data += s[i].len;
+		capn_append_segment(c, &s[i]);
+	}
+
+	s[segnum-1].user = s;
+	return 0;
+}
+
+int capn_clone_template(struct capn *c, const struct capn_template *t, const struct capn_allocator *a) {
+	capn_init_alloc(c, a);
+	if (t->segnum == 0 || t->proto->segnum < t->segnum)
+		return -1;
+	return clone_block(c, t->proto, t->segnum, t->size);
+}
+
+int capn_clone(struct capn *dst, const struct capn *src, int coalesce) {
+	struct capn_segment *from;
+	size_t size = 0;
+
+	capn_init_alloc(dst, src->alloc);
+	if (src->segnum == 0)
+		return -1;
+
+	if (coalesce) {
+		for (from = src->seglist; from != NULL; from = from->next)
+			size += SEG_PADDED(from);
+		if (clone_block(dst, src, src->segnum, size))
+			goto err;
+		return 0;
+	}
+
+	/* each segment gets its own allocation, with the slack create
+	 * leaves so that the copy can keep growing in place */
+	for (from = src->seglist; from != NULL; from = from->next) {
+		struct capn_segment *s = dst->create(dst->user, dst->segnum, SEG_PADDED(from));
+		if (!s)
+			goto err;
+		memcpy(s->data, from->data, from->len);
+		s->len = SEG_PADDED(from);
+		capn_append_segment(dst, s);
+	}
+	return 0;
+
+err:
+	capn_free(dst);
+	capn_init_alloc(dst, src->alloc);
+	return -1;
+}
+
+capn_ptr capn_template_ptr(struct capn *c, capn_ptr p) {
+	struct capn_segment *s = c->seglist;
+
+	if (!p.seg || !s || p.seg->id >= c->segnum) {
+		memset(&p, 0, sizeof(p));
+		return p;
+	}
+
+	/* the cloned segment headers are an array, see capn_clone_template */
+	s += p.seg->id;
+	p.data = s->data + (p.data - p.seg->data);
+	p.seg = s;
+	return p;
+}
+
+int capn_savepoint(struct capn *c, struct capn_savepoint *sp) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	struct capn_segment *s;
+	int *len = sp->len;
+	uint32_t i;
+
+	/* rollback frees segments as capn_free does for the malloc create */
+	sp->segnum = c->segnum;
+	sp->more = NULL;
+	if (!is_malloc(c))
+		return -1;
+	if (c->segnum > CAPN_SAVEPOINT_SEGS) {
+		sp->more = (int*) a->alloc(a->user, c->segnum * sizeof(int));
+		if (!sp->more)
+			return -1;
+		len = sp->more;
+	}
+
+	for (i = 0, s = c->seglist; i < c->segnum && s != NULL; i++, s = s->next)
+		len[i] = s->len;
+	return 0;
+}
+
+int capn_rollback(struct capn *c, const struct capn_savepoint *sp) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	const int *len = sp->more ? sp->more : sp->len;
+	struct capn_segment *s, *last = NULL, *drop = NULL;
+	uint32_t i;
+
+	if (!is_malloc(c) || sp->segnum > c->segnum)
+		return -1;
+
+	for (i = 0, s = c->seglist; i < sp->segnum && s != NULL; i++, s = s->next) {
+		if (s->len > (size_t) len[i])
+			memset(s->data + len[i], 0, s->len - len[i]);
+		s->len = len[i];
+		last = s;
+	}
+
+	if (sp->segnum < c->segnum) {
+		/* unlink the segments created since, and rebuild the segment
+		 * tree from the ones that are left */
+		drop = s;
+		c->segnum = sp->segnum;
+		c->lastseg = last;
+		c->segtree = NULL;
+		if (last) {
+			last->next = NULL;
+		} else {
+			c->seglist = NULL;
+		}
+		for (s = c->seglist, last = NULL; s != NULL; last = s, s = s->next) {
+			if (last) {
+				last->hdr.link[1] = &s->hdr;
+				s->hdr.parent = &last->hdr;
+			} else {
+				s->hdr.parent = NULL;
+			}
+			c->segtree = capn_tree_insert(c->segtree, &s->hdr);
+		}
+	}
+
+	/* this looks at the dropped segments, so they are freed after */
+	capn_intern_prune(c);
+	capn_orphans_prune(c);
+
+	while (drop != NULL) {
+		s = drop->next;
+		if (drop->user)
+			a->free(a->user, drop->user);
+		drop = s;
+	}
+
+	/* the copy tree may point at copies that were just released */
+	capn_reset_copy(c);
+	return 0;
+}
+
+void capn_savepoint_release(struct capn *c, struct capn_savepoint *sp) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	if (sp->more) {
+		a->free(a->user, sp->more);
+		sp->more = NULL;
+	}
+}
+
+static const uint8_t zero_pad[8] = {0};
+
+/* deflate_seg packs a segment into z, including its padding */
+static int deflate_seg(struct capn_stream *z, struct capn_segment *seg)
+{
+	size_t aligned = seg->len & ~7;
+	uint8_t tail[8];
+	int ret;
+
+	z->next_in = (uint8_t*) seg->data;
+	z->avail_in = aligned;
+	ret = capn_deflate(z);
+	if (ret != 0 || aligned == (size_t) seg->len)
+		return ret;
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, seg->data + aligned, seg->len - aligned);
+	z->next_in = tail;
+	z->avail_in = sizeof(tail);
+	return capn_deflate(z);
 }
 
 static void header_calc(struct capn *c, uint32_t *headerlen, size_t *headersz)
@@ -221,8 +603,8 @@ static int header_render(struct capn *c, struct capn_segment *seg, uint32_t *hea
 	for (i = 0; i < c->segnum; i++, seg = seg->next) {
 		if (0 == seg)
 			return -1;
-		*datasz += seg->len;
-		header[1 + i] = capn_flip32(seg->len / 8);
+		*datasz += SEG_PADDED(seg);
+		header[1 + i] = capn_flip32(SEG_PADDED(seg) / 8);
 	}
 	if (0 != seg)
 		return -1;
@@ -263,9 +645,7 @@ static int64_t capn_write_mem_packed(struct capn *c, uint8_t *p, size_t sz)
 		return -1;
 
 	for (seg = root.seg; seg; seg = seg->next) {
-		z.next_in = (uint8_t *)seg->data;
-		z.avail_in = seg->len;
-		ret = capn_deflate(&z);
+		ret = deflate_seg(&z, seg);
 		if (ret != 0 || z.avail_in != 0)
 			return -1;
 	}
@@ -286,8 +666,12 @@ capn_write_mem(struct capn *c, uint8_t *p, size_t sz, int packed)
 	if (c->segnum == 0)
 		return -1;
 
-	if (packed)
-		return capn_write_mem_packed(c, p, sz);
+	if (packed) {
+		int64_t n = capn_write_mem_packed(c, p, sz);
+		if (n >= 0)
+			CAPN_PROBE4(write_done, c, c->segnum, n, 1);
+		return n;
+	}
 
 	root = capn_root(c);
 	header_calc(c, &headerlen, &headersz);
@@ -307,9 +691,11 @@ capn_write_mem(struct capn *c, uint8_t *p, size_t sz, int packed)
 
 	for (seg = root.seg; seg; seg = seg->next) {
 		memcpy(p, seg->data, seg->len);
-		p += seg->len;
+		memset(p + seg->len, 0, SEG_PADDED(seg) - seg->len);
+		p += SEG_PADDED(seg);
 	}
 
+	CAPN_PROBE4(write_done, c, c->segnum, headersz + datasz, 0);
 	return (int64_t)(headersz + datasz);
 }
 
@@ -332,6 +718,29 @@ static int _write_fd(ssize_t (*write_fd)(int fd, const void *p, size_t count), i
 	return 0;
 }
 
+/* _write_packed deflates sz bytes from in and writes them out through buf,
+ * which is flushed whenever it fills up */
+static int _write_packed(ssize_t (*write_fd)(int fd, const void *p, size_t count), int fd, struct capn_stream *z,
+		const uint8_t *in, size_t sz, uint8_t *buf, size_t bufsz, size_t *datasz)
+{
+	int ret;
+
+	z->next_in = in;
+	z->avail_in = sz;
+	do {
+		z->next_out = buf;
+		z->avail_out = bufsz;
+		ret = capn_deflate(z);
+		if (ret != 0 && ret != CAPN_NEED_MORE)
+			return -1;
+		if (_write_fd(write_fd, fd, buf, bufsz - z->avail_out) < 0)
+			return -1;
+		*datasz += bufsz - z->avail_out;
+	} while (ret == CAPN_NEED_MORE);
+
+	return 0;
+}
+
 int capn_write_fd(struct capn *c, ssize_t (*write_fd)(int fd, const void *p, size_t count), int fd, int packed)
 {
 	unsigned char buf[4096];
@@ -383,28 +792,33 @@ int capn_write_fd(struct capn *c, ssize_t (*write_fd)(int fd, const void *p, siz
 
 	datasz = headersz;
 	for (seg = root.seg; seg; seg = seg->next) {
-		size_t bufsz;
+		size_t aligned = seg->len & ~7, pad = SEG_PADDED(seg) - seg->len;
 		if (packed) {
+			uint8_t tail[8];
 			memset(&z, 0, sizeof(z));
-			z.next_in = (uint8_t*)seg->data;
-			z.avail_in = seg->len;
-			z.next_out = buf;
-			z.avail_out = sizeof(buf);
-			ret = capn_deflate(&z);
-			if (ret != 0)
+			ret = _write_packed(write_fd, fd, &z, (uint8_t*)seg->data, aligned, buf, sizeof(buf), &datasz);
+			if (ret < 0)
 				return -1;
-			p = buf;
-			bufsz = sizeof(buf) - z.avail_out;
+			if (pad) {
+				memset(tail, 0, sizeof(tail));
+				memcpy(tail, seg->data + aligned, seg->len - aligned);
+				ret = _write_packed(write_fd, fd, &z, tail, sizeof(tail), buf, sizeof(buf), &datasz);
+				if (ret < 0)
+					return -1;
+			}
 		} else {
-			p = (uint8_t*)seg->data;
-			bufsz = seg->len;
+			/* written straight from the segment, which for
+			 * attached blobs is the caller's buffer */
+			ret = _write_fd(write_fd, fd, seg->data, seg->len);
+			if (ret == 0 && pad)
+				ret = _write_fd(write_fd, fd, (void*) zero_pad, pad);
+			if (ret < 0)
+				return -1;
+			datasz += seg->len + pad;
 		}
-		ret = _write_fd(write_fd, fd, p, bufsz);
-		if (ret < 0)
-			return -1;
-		datasz += bufsz;
 	}
 
+	CAPN_PROBE4(write_done, c, c->segnum, datasz, packed);
 	return datasz;
 }
 
@@ -426,7 +840,7 @@ int capn_size(struct capn *c)
 	for (i = 0; i < c->segnum; i++, seg = seg->next) {
 		if (0 == seg)
 			return -1;
-		datasz += seg->len;
+		datasz += SEG_PADDED(seg);
 	}
 	if (0 != seg)
 		return -1;
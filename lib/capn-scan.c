@@ -0,0 +1,271 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-scan.c
+ *
+ * Parallel scan of a log of framed messages on a work stealing pool of
+ * threads.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SCAN_DEF_CHUNK (4 << 20)
+#define SCAN_MAX_SEGS 1024
+
+/* The log is cut into ranges at message boundaries. Each worker owns a
+ * slice [lo, hi) of the range array and works through it from the front.
+ * A worker whose slice is empty steals the back half of another slice, so
+ * ranges only ever move between workers and a scan is done once every
+ * worker has found all slices empty. */
+struct scan_range {
+	uint64_t begin, end;
+};
+
+struct scan_worker {
+	const struct capn_scan *sc;
+	const char *base;
+	struct scan_range *ranges;
+	struct scan_worker *all;
+	int nworkers, self;
+	int *stop;
+
+	pthread_mutex_t lock;
+	size_t lo, hi;
+
+	pthread_t thread;
+	int started;
+	void *state;
+	int64_t messages;
+	int err;
+};
+
+static int take(struct scan_worker *w, size_t *r) {
+	int ok = 0;
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi) {
+		*r = w->lo++;
+		ok = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ok;
+}
+
+static int steal(struct scan_worker *w) {
+	int i;
+
+	for (i = 1; i < w->nworkers; i++) {
+		struct scan_worker *v = &w->all[(w->self + i) % w->nworkers];
+		size_t lo, hi;
+
+		pthread_mutex_lock(&v->lock);
+		hi = v->hi;
+		lo = v->hi - (v->hi - v->lo + 1) / 2;
+		v->hi = lo;
+		pthread_mutex_unlock(&v->lock);
+
+		if (lo < hi) {
+			pthread_mutex_lock(&w->lock);
+			w->lo = lo;
+			w->hi = hi;
+			pthread_mutex_unlock(&w->lock);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int scan_range(struct scan_worker *w, struct capn_segment *segs, const struct scan_range *r) {
+	const struct capn_scan *sc = w->sc;
+	uint64_t off = r->begin;
+	struct capn c;
+
+	while (off < r->end) {
+		int64_t framesz = capn_init_frame(&c, segs, SCAN_MAX_SEGS, w->base + off, r->end - off);
+		if (framesz <= 0)
+			return -1;
+		if (sc->message(w->state, &c, off, sc->arg))
+			return -1;
+		w->messages++;
+		off += framesz;
+	}
+	return 0;
+}
+
+static void *work(void *p) {
+	struct scan_worker *w = (struct scan_worker*) p;
+	struct capn_segment *segs;
+	size_t r;
+
+	segs = (struct capn_segment*) malloc(SCAN_MAX_SEGS * sizeof(*segs));
+	if (!segs) {
+		w->err = -1;
+		__atomic_store_n(w->stop, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+		if (!take(w, &r) && !(steal(w) && take(w, &r)))
+			break;
+		if (scan_range(w, segs, &w->ranges[r])) {
+			w->err = -1;
+			__atomic_store_n(w->stop, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(segs);
+	return NULL;
+}
+
+/* split cuts [0, sz) into ranges of about chunk bytes, either at the
+ * offsets of the index or by walking the segment tables */
+static struct scan_range *split(const struct capn_scan *sc, const char *p, size_t sz, size_t *pn) {
+	size_t chunk = sc->chunk ? sc->chunk : SCAN_DEF_CHUNK;
+	size_t n = 0, cap = 16, i = 0;
+	uint64_t begin = 0, off = 0;
+	struct scan_range *r;
+
+	if (sc->index) {
+		if (sc->nindex == 0) {
+			*pn = 0;
+			return (struct scan_range*) malloc(sizeof(*r));
+		}
+		begin = off = sc->index[0];
+		if (off > sz)
+			return NULL;
+	}
+
+	r = (struct scan_range*) malloc(cap * sizeof(*r));
+	while (r && off < sz) {
+		if (sc->index) {
+			uint64_t next = ++i < sc->nindex ? sc->index[i] : sz;
+			if (next <= off || next > sz)
+				goto err;
+			off = next;
+		} else {
+			int64_t framesz = capn_frame_size(p + off, sz - off);
+			if (framesz <= 0)
+				goto err;
+			off += framesz;
+		}
+
+		if (off - begin >= chunk || off == sz) {
+			if (n == cap) {
+				struct scan_range *nr = (struct scan_range*) realloc(r, (cap *= 2) * sizeof(*r));
+				if (!nr)
+					goto err;
+				r = nr;
+			}
+			r[n].begin = begin;
+			r[n].end = off;
+			n++;
+			begin = off;
+		}
+	}
+
+	*pn = n;
+	return r;
+
+err:
+	free(r);
+	return NULL;
+}
+
+int64_t capn_scan_mem(const struct capn_scan *sc, const void *p, size_t sz) {
+	struct scan_worker *w;
+	struct scan_range *ranges;
+	size_t nranges, per;
+	int64_t messages = 0;
+	int i, n = sc->threads, stop = 0, err = 0;
+
+	if (((uintptr_t) p & 7) || !sc->message)
+		return -1;
+
+	ranges = split(sc, (const char*) p, sz, &nranges);
+	if (!ranges)
+		return -1;
+
+	if (n <= 0)
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if ((size_t) n > nranges)
+		n = (int) nranges;
+	if (n <= 0)
+		n = 1;
+
+	w = (struct scan_worker*) calloc(n, sizeof(*w));
+	if (!w) {
+		free(ranges);
+		return -1;
+	}
+
+	per = (nranges + n - 1) / n;
+	for (i = 0; i < n; i++) {
+		w[i].sc = sc;
+		w[i].base = (const char*) p;
+		w[i].ranges = ranges;
+		w[i].all = w;
+		w[i].nworkers = n;
+		w[i].self = i;
+		w[i].stop = &stop;
+		w[i].lo = i * per < nranges ? i * per : nranges;
+		w[i].hi = w[i].lo + per < nranges ? w[i].lo + per : nranges;
+		pthread_mutex_init(&w[i].lock, NULL);
+	}
+
+	for (i = 0; i < n && !err; i++) {
+		w[i].state = sc->init ? sc->init(sc->arg) : NULL;
+		if (sc->init && !w[i].state)
+			err = -1;
+	}
+
+	/* The calling thread is worker 0. Workers that fail to start have
+	 * their ranges stolen by the others. */
+	if (!err) {
+		for (i = 1; i < n; i++) {
+			w[i].started = !pthread_create(&w[i].thread, NULL, &work, &w[i]);
+		}
+		work(&w[0]);
+		for (i = 1; i < n; i++) {
+			if (w[i].started)
+				pthread_join(w[i].thread, NULL);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (w[i].state && sc->reduce)
+			sc->reduce(w[i].state, sc->arg);
+		messages += w[i].messages;
+		err |= w[i].err;
+		pthread_mutex_destroy(&w[i].lock);
+	}
+
+	free(w);
+	free(ranges);
+	return err ? -1 : messages;
+}
+
+int64_t capn_scan_fd(const struct capn_scan *sc, int fd) {
+	struct stat st;
+	int64_t ret;
+	void *map;
+
+	if (fstat(fd, &st))
+		return -1;
+	if (st.st_size == 0)
+		return capn_scan_mem(sc, NULL, 0);
+
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, (size_t) st.st_size, MADV_WILLNEED);
+
+	ret = capn_scan_mem(sc, map, (size_t) st.st_size);
+	munmap(map, (size_t) st.st_size);
+	return ret;
+}
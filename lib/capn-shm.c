@@ -0,0 +1,368 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-shm.c
+ *
+ * Segment allocation inside a shared memory region, so that a message built
+ * by one process can be read in place by another.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
+#include "capnp_c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The region starts with a struct shm_header followed by blocks. Each block
+ * is a struct shm_block followed by its data. Blocks are carved off the top
+ * of the region and returned to a free list once their reference count
+ * drops to zero. All links are offsets from the start of the region as the
+ * region will be mapped at different addresses in each process.
+ */
+
+#define SHM_MAGIC UINT64_C(0x314d48534e504143) /* "CAPNSHM1" */
+
+struct shm_header {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t top;
+	uint64_t free;
+	uint32_t lock;
+	uint32_t pad;
+};
+
+struct shm_block {
+	uint32_t refs;
+	uint32_t pad;
+	uint64_t size;
+	uint64_t next;
+};
+
+#define SHM_FIRST_BLOCK ((sizeof(struct shm_header) + 7) & ~(size_t)7)
+
+static struct shm_header *shm_hdr(struct capn_shm *m) {
+	return (struct shm_header*) m->base;
+}
+
+static void shm_lock(struct shm_header *h) {
+	while (__atomic_exchange_n(&h->lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+}
+
+static void shm_unlock(struct shm_header *h) {
+	__atomic_store_n(&h->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct shm_block *shm_block_of(struct capn_shm *m, const char *data) {
+	if (data < m->base + SHM_FIRST_BLOCK + sizeof(struct shm_block) || data >= m->base + m->size)
+		return NULL;
+	return (struct shm_block*) (data - sizeof(struct shm_block));
+}
+
+/* shm_alloc returns zeroed data of at least sz bytes with a single
+ * reference, or NULL if the region is exhausted */
+static char *shm_alloc(struct capn_shm *m, size_t sz) {
+	struct shm_header *h = shm_hdr(m);
+	struct shm_block *b = NULL;
+	uint64_t *link;
+
+	sz = (sz + 7) & ~(size_t)7;
+
+	shm_lock(h);
+
+	/* first fit from the free list */
+	for (link = &h->free; *link; link = &b->next) {
+		b = (struct shm_block*) (m->base + *link);
+		if (b->size >= sz)
+			break;
+	}
+	if (*link) {
+		*link = b->next;
+	} else {
+		b = NULL;
+	}
+
+	if (!b) {
+		if (h->top + sizeof(*b) + sz > h->size) {
+			shm_unlock(h);
+			return NULL;
+		}
+		b = (struct shm_block*) (m->base + h->top);
+		b->size = sz;
+		h->top += sizeof(*b) + sz;
+		shm_unlock(h);
+	} else {
+		shm_unlock(h);
+		/* fresh blocks come from ftruncate and are already zero */
+		memset(b+1, 0, b->size);
+	}
+
+	b->next = 0;
+	__atomic_store_n(&b->refs, 1, __ATOMIC_RELEASE);
+	return (char*) (b+1);
+}
+
+static void shm_retain(struct shm_block *b) {
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void shm_release(struct capn_shm *m, struct shm_block *b) {
+	struct shm_header *h = shm_hdr(m);
+
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	shm_lock(h);
+	b->next = h->free;
+	h->free = (uint64_t) ((char*) b - m->base);
+	shm_unlock(h);
+}
+
+static int shm_map(struct capn_shm *m, int fd, size_t size, int init) {
+	struct shm_header *h;
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	h = (struct shm_header*) p;
+	if (init) {
+		h->size = size;
+		h->top = SHM_FIRST_BLOCK;
+		h->free = 0;
+		h->lock = 0;
+		__atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || h->size != size) {
+		munmap(p, size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	m->fd = fd;
+	m->size = size;
+	m->base = (char*) p;
+	return 0;
+}
+
+int capn_shm_create(struct capn_shm *m, const char *name, size_t size) {
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+	m->fd = -1;
+
+	if (size < SHM_FIRST_BLOCK + 4096) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (name) {
+		fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	} else {
+#ifdef MFD_CLOEXEC
+		fd = memfd_create("capnp", MFD_CLOEXEC);
+#else
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "/capnp-%d-%p", (int) getpid(), (void*) m);
+		fd = shm_open(tmp, O_RDWR|O_CREAT|O_EXCL, 0600);
+		if (fd >= 0)
+			shm_unlink(tmp);
+#endif
+	}
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, (off_t) size) || shm_map(m, fd, size, 1)) {
+		int err = errno;
+		close(fd);
+		if (name)
+			shm_unlink(name);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int capn_shm_attach(struct capn_shm *m, int fd) {
+	struct stat st;
+
+	memset(m, 0, sizeof(*m));
+	m->fd = -1;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	return shm_map(m, fd, (size_t) st.st_size, 0);
+}
+
+int capn_shm_open(struct capn_shm *m, const char *name) {
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+
+	if (capn_shm_attach(m, fd)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+void capn_shm_close(struct capn_shm *m) {
+	if (m->base)
+		munmap(m->base, m->size);
+	if (m->fd >= 0)
+		close(m->fd);
+	memset(m, 0, sizeof(*m));
+	m->fd = -1;
+}
+
+static struct capn_segment *create(void *u, uint32_t id, int sz) {
+	struct capn_shm *m = (struct capn_shm*) u;
+	struct capn_segment *s;
+	char *data;
+
+	(void) id;
+	if (sz < 4096) {
+		sz = 4096;
+	} else {
+		sz = (sz + 4095) & ~4095;
+	}
+
+	data = shm_alloc(m, sz);
+	if (!data)
+		return NULL;
+
+	s = (struct capn_segment*) calloc(1, sizeof(*s));
+	if (!s) {
+		shm_release(m, shm_block_of(m, data));
+		return NULL;
+	}
+
+	s->data = data;
+	s->cap = sz;
+	s->user = s;
+	return s;
+}
+
+static struct capn_segment *create_local(void *u, int sz) {
+	struct capn_segment *s;
+	(void) u;
+	sz += sizeof(*s);
+	if (sz < 4096) {
+		sz = 4096;
+	} else {
+		sz = (sz + 4095) & ~4095;
+	}
+	s = (struct capn_segment*) calloc(1, sz);
+	if (!s)
+		return NULL;
+	s->data = (char*) (s+1);
+	s->cap = sz - sizeof(*s);
+	s->user = s;
+	return s;
+}
+
+void capn_init_shm(struct capn *c, struct capn_shm *m) {
+	memset(c, 0, sizeof(*c));
+	c->create = &create;
+	c->create_local = &create_local;
+	c->user = m;
+}
+
+int64_t capn_shm_publish(struct capn *c) {
+	struct capn_shm *m = (struct capn_shm*) c->user;
+	struct capn_segment *s;
+	uint64_t *desc;
+	uint32_t i;
+
+	if (c->segnum == 0)
+		return -1;
+
+	for (s = c->seglist; s != NULL; s = s->next) {
+		if (!shm_block_of(m, s->data))
+			return -1;
+	}
+
+	desc = (uint64_t*) shm_alloc(m, 8 + 16 * c->segnum);
+	if (!desc)
+		return -1;
+
+	desc[0] = c->segnum;
+	for (i = 0, s = c->seglist; s != NULL; i++, s = s->next) {
+		/* the reader inherits this reference */
+		shm_retain(shm_block_of(m, s->data));
+		desc[1 + 2*i] = (uint64_t) (s->data - m->base);
+		desc[2 + 2*i] = s->len;
+	}
+
+	return (int64_t) ((char*) desc - m->base);
+}
+
+int capn_init_shm_desc(struct capn *c, struct capn_shm *m, int64_t off) {
+	struct shm_block *db;
+	const uint64_t *desc;
+	uint64_t i, segnum;
+
+	capn_init_shm(c, m);
+
+	if (off < 0 || (off & 7) || (uint64_t) off > m->size - 8)
+		return -1;
+	desc = (const uint64_t*) (m->base + off);
+	db = shm_block_of(m, (const char*) desc);
+	if (!db)
+		return -1;
+
+	segnum = desc[0];
+	if (segnum == 0 || segnum > (db->size - 8) / 16)
+		return -1;
+
+	for (i = 0; i < segnum; i++) {
+		uint64_t soff = desc[1 + 2*i], slen = desc[2 + 2*i];
+		struct shm_block *b = shm_block_of(m, m->base + soff);
+		if (!b || soff > m->size || slen > b->size)
+			return -1;
+	}
+
+	for (i = 0; i < segnum; i++) {
+		struct capn_segment *s = (struct capn_segment*) calloc(1, sizeof(*s));
+		if (!s) {
+			/* drop the references we could not take over */
+			for (; i < segnum; i++)
+				shm_release(m, shm_block_of(m, m->base + desc[1 + 2*i]));
+			capn_shm_free(c);
+			shm_release(m, db);
+			return -1;
+		}
+		s->data = m->base + desc[1 + 2*i];
+		s->len = s->cap = desc[2 + 2*i];
+		s->user = s;
+		capn_append_segment(c, s);
+	}
+
+	shm_release(m, db);
+	return 0;
+}
+
+void capn_shm_free(struct capn *c) {
+	struct capn_shm *m = (struct capn_shm*) c->user;
+	struct capn_segment *s;
+
+	for (s = c->seglist; s != NULL; s = s->next) {
+		struct shm_block *b = shm_block_of(m, s->data);
+		if (b)
+			shm_release(m, b);
+	}
+
+	capn_free(c);
+}
@@ -16,7 +16,9 @@ static unsigned min(unsigned a, unsigned b) { return (a < b) ? a : b; }
 #endif
 
 int capn_deflate(struct capn_stream* s) {
-	if (s->avail_in % 8) {
+	/* a run of raw words may have been cut short by a full output
+	 * buffer, the rest of the input is still word aligned */
+	if ((s->avail_in - s->raw) % 8) {
 		return CAPN_MISALIGNED;
 	}
 
@@ -11,7 +11,7 @@
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 #endif
 
-#include "capnp_c.h"
+#include "capnp_priv.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -193,6 +193,9 @@ static char *new_data(struct capn *c, int sz, struct capn_segment **ps) {
 	}
 
 	capn_append_segment(c, s);
+	CAPN_STAT(c, segments, 1);
+	CAPN_STAT(c, seg_bytes, s->cap);
+	CAPN_PROBE3(segment_create, c, s->id, s->cap);
 end:
 	*ps = s;
 	s->len += sz;
@@ -250,6 +253,8 @@ static uint64_t lookup_double(struct capn_segment **s, char **d, uint64_t val) {
 	size_t off = (U32(val) >> 3) * 8;
 	char *p;
 
+	CAPN_STAT((*s)->capn, double_far_reads, 1);
+
 	if ((*s = lookup_segment((*s)->capn, *s, U32(val >> 32))) == NULL) {
 		return 0;
 	}
@@ -284,6 +289,8 @@ static uint64_t lookup_double(struct capn_segment **s, char **d, uint64_t val) {
 static uint64_t lookup_far(struct capn_segment **s, char **d, uint64_t val) {
 	size_t off = (U32(val) >> 3) * 8;
 
+	CAPN_STAT((*s)->capn, far_reads, 1);
+
 	if ((*s = lookup_segment((*s)->capn, *s, U32(val >> 32))) == NULL) {
 		return 0;
 	}
@@ -560,6 +567,9 @@ static int write_ptr(struct capn_segment *s, char *d, capn_ptr p) {
 		 * of it. This happens when new_object had to move
 		 * the data to a new segment. */
 		write_far_ptr(d, p.seg, pdata-8);
+		CAPN_STAT(s->capn, far_ptrs, 1);
+		CAPN_STAT(s->capn, tag_reuse, 1);
+		CAPN_PROBE3(far_ptr, s->capn, p.seg->id, 1);
 		return 0;
 
 	} else if (p.seg->len + 8 <= p.seg->cap) {
@@ -568,6 +578,8 @@ static int write_ptr(struct capn_segment *s, char *d, capn_ptr p) {
 		write_ptr_tag(t, p, pdata - t - 8);
 		write_far_ptr(d, p.seg, t);
 		p.seg->len += 8;
+		CAPN_STAT(s->capn, far_ptrs, 1);
+		CAPN_PROBE3(far_ptr, s->capn, p.seg->id, 0);
 		return 0;
 
 	} else {
@@ -589,6 +601,8 @@ static int write_ptr(struct capn_segment *s, char *d, capn_ptr p) {
 		write_far_ptr(t, p.seg, pdata);
 		write_ptr_tag(t+8, p, 0);
 		write_double_far(d, s, t);
+		CAPN_STAT(s->capn, double_far_ptrs, 1);
+		CAPN_PROBE2(double_far_ptr, s->capn, p.seg->id);
 		return 0;
 	}
 }
@@ -675,6 +689,9 @@ static int copy_ptr(struct capn_segment *seg, char *data, struct capn_ptr *t, st
 	if (write_ptr(seg, data, *t))
 		return -1;
 
+	CAPN_STAT(c, copies, 1);
+	CAPN_STAT(c, copy_bytes, fend - fbegin);
+
 	/* add the copy to the copy tree so we can look for overlapping
 	 * source pointers and handle recursive structures */
 	if (!zero_sized) {
@@ -775,9 +792,190 @@ static void copy_list_member(capn_ptr* t, capn_ptr *f, int *dep) {
 
 #define MAX_COPY_DEPTH 32
 
+#define MAX_LIST_LEN ((1 << 29) - 1)
+
+/* list_bytes is the space n elements of the list p take up, including the
+ * tag of a composite list */
+static int64_t list_bytes(const capn_ptr *p, int n) {
+	switch (p->type) {
+	case CAPN_BIT_LIST:
+		return ((I64(n) + 63) / 64) * 8;
+	case CAPN_PTR_LIST:
+		return 8 * I64(n);
+	default:
+		if (p->is_composite_list)
+			return 8 + I64(n) * (p->datasz + 8*p->ptrs);
+		return (I64(n) * p->datasz + 7) & ~7;
+	}
+}
+
+static char *list_start(const capn_ptr *p) {
+	return p->data - (p->is_composite_list ? 8 : 0);
+}
+
+/* The orphan table keeps the objects capn_setp unlinked, binned by their
+ * size in words. Blocks of up to ORPHAN_WORDS words are handed out again by
+ * new_object, bin 0 holds the bigger ones for capn_zero_orphans. */
+#define ORPHAN_WORDS 16
+
+struct orphan {
+	struct capn_segment *seg;
+	char *data;
+	int sz;
+};
+
+struct orphan_bin {
+	struct orphan *v;
+	uint32_t len, cap;
+};
+
+struct capn_orphans {
+	struct orphan_bin bin[ORPHAN_WORDS + 1];
+};
+
+static int orphan_push(struct capn *c, struct orphan_bin *b, struct capn_segment *seg, char *data, int sz) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+
+	if (b->len == b->cap) {
+		uint32_t cap = b->cap ? 2 * b->cap : 16;
+		struct orphan *v = (struct orphan*) a->realloc(a->user, b->v, cap * sizeof(*v));
+		if (!v)
+			return -1;
+		b->v = v;
+		b->cap = cap;
+	}
+
+	b->v[b->len].seg = seg;
+	b->v[b->len].data = data;
+	b->v[b->len].sz = sz;
+	b->len++;
+	return 0;
+}
+
+/* orphan_add records that old was unlinked, unless tgt is the same object.
+ * Objects at the very start of a segment are skipped: those are blobs from
+ * capn_attach_* (or objects without a tag in front), whose memory may not
+ * be ours to reuse. */
+static void orphan_add(struct capn *c, capn_ptr old, capn_ptr tgt) {
+	struct capn_orphans *t = c->orphans;
+	char *start;
+	int64_t sz;
+
+	if (!old.seg || old.seg->capn != c || old.data == tgt.data)
+		return;
+
+	/* interned strings are shared, also after interning is turned off */
+	if (c->interned && old.type == CAPN_LIST && old.datasz == 1)
+		return;
+
+	switch (old.type) {
+	case CAPN_STRUCT:
+		start = old.data;
+		sz = old.datasz + 8*old.ptrs;
+		break;
+	case CAPN_LIST:
+	case CAPN_PTR_LIST:
+	case CAPN_BIT_LIST:
+		start = list_start(&old);
+		sz = list_bytes(&old, old.len);
+		break;
+	default:
+		return;
+	}
+
+	if (sz <= 0 || start == old.seg->data || start + sz > old.seg->data + old.seg->len)
+		return;
+
+	if (!orphan_push(c, &t->bin[sz <= 8*ORPHAN_WORDS ? sz/8 : 0], old.seg, start, (int) sz))
+		CAPN_STAT(c, orphan_bytes, sz);
+}
+
+/* orphan_take returns a zeroed orphaned block of bytes in s, or NULL */
+static char *orphan_take(struct capn_orphans *t, struct capn_segment *s, int bytes) {
+	int w, i;
+
+	for (w = bytes/8; w <= ORPHAN_WORDS; w++) {
+		struct orphan_bin *b = &t->bin[w];
+		for (i = (int) b->len - 1; i >= 0; i--) {
+			struct orphan o = b->v[i];
+			if (o.seg != s)
+				continue;
+
+			b->v[i] = b->v[--b->len];
+			if (o.sz > bytes)
+				orphan_push(s->capn, &t->bin[(o.sz - bytes)/8], s, o.data + bytes, o.sz - bytes);
+			memset(o.data, 0, bytes);
+			CAPN_STAT(s->capn, orphan_reused, bytes);
+			return o.data;
+		}
+	}
+
+	return NULL;
+}
+
+int capn_orphans_enable(struct capn *c) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+
+	if (c->orphans)
+		return 0;
+
+	c->orphans = (struct capn_orphans*) a->alloc(a->user, sizeof(*c->orphans));
+	if (!c->orphans)
+		return -1;
+	memset(c->orphans, 0, sizeof(*c->orphans));
+	return 0;
+}
+
+void capn_orphans_disable(struct capn *c) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	int w;
+
+	if (c->orphans) {
+		for (w = 0; w <= ORPHAN_WORDS; w++)
+			a->free(a->user, c->orphans->bin[w].v);
+		a->free(a->user, c->orphans);
+		c->orphans = NULL;
+	}
+}
+
+void capn_zero_orphans(struct capn *c) {
+	uint32_t i;
+	int w;
+
+	if (!c->orphans)
+		return;
+
+	for (w = 0; w <= ORPHAN_WORDS; w++) {
+		struct orphan_bin *b = &c->orphans->bin[w];
+		for (i = 0; i < b->len; i++)
+			memset(b->v[i].data, 0, b->v[i].sz);
+	}
+}
+
+void capn_orphans_prune(struct capn *c) {
+	uint32_t i;
+	int w;
+
+	if (!c->orphans)
+		return;
+
+	for (w = 0; w <= ORPHAN_WORDS; w++) {
+		struct orphan_bin *b = &c->orphans->bin[w];
+		for (i = 0; i < b->len;) {
+			struct orphan *o = &b->v[i];
+			if (o->seg->id >= c->segnum || o->data + o->sz > o->seg->data + o->seg->len) {
+				*o = b->v[--b->len];
+			} else {
+				i++;
+			}
+		}
+	}
+}
+
 /* TODO: handle CAPN_BIT_LIST and setting from an inner bit list member */
 int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 	struct capn_ptr to[MAX_COPY_DEPTH], from[MAX_COPY_DEPTH];
+	capn_ptr old = {CAPN_NULL};
 	char *data;
 	int err, dep = 0;
 
@@ -801,6 +999,9 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		to[0] = p;
 		to[0].data += off * (p.datasz + 8*p.ptrs);
 		from[0] = tgt;
+		CAPN_PROBE2(copy_start, p.seg->capn, tgt.data);
+		CAPN_STAT(p.seg->capn, copies, 1);
+		CAPN_STAT(p.seg->capn, copy_bytes, p.datasz + 8*p.ptrs);
 		copy_list_member(to, from, &dep);
 		break;
 
@@ -817,9 +1018,15 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		goto copy_ptr;
 
 	copy_ptr:
+		if (p.seg->capn->orphans)
+			old = read_ptr(p.seg, data);
+
 		err = write_ptr(p.seg, data, tgt);
-		if (err != NEED_TO_COPY)
+		if (err != NEED_TO_COPY) {
+			if (!err && old.type != CAPN_NULL)
+				orphan_add(p.seg->capn, old, tgt);
 			return err;
+		}
 
 		/* Depth first copy the source whilst using a pointer stack to
 		 * maintain the ptr to set and size left to copy at each level.
@@ -830,8 +1037,11 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		 */
 
 		from[0] = tgt;
-		if (copy_ptr(p.seg, data, to, from, &dep))
-			return -1;
+		CAPN_PROBE2(copy_start, p.seg->capn, tgt.data);
+		if (copy_ptr(p.seg, data, to, from, &dep)) {
+			err = -1;
+			goto end;
+		}
 		break;
 
 	default:
@@ -843,7 +1053,8 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		struct capn_ptr *fc = &from[dep-1], *fn = &from[dep];
 
 		if (dep+1 == MAX_COPY_DEPTH) {
-			return -1;
+			err = -1;
+			goto end;
 		}
 
 		if (!tc->len) {
@@ -864,8 +1075,10 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		} else { /* CAPN_PTR_LIST */
 			*fn = read_ptr(fc->seg, fc->data);
 
-			if (fn->type && copy_ptr(tc->seg, tc->data, tn, fn, &dep))
-				return -1;
+			if (fn->type && copy_ptr(tc->seg, tc->data, tn, fn, &dep)) {
+				err = -1;
+				goto end;
+			}
 
 			fc->data += 8;
 			tc->data += 8;
@@ -873,7 +1086,12 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt) {
 		}
 	}
 
-	return 0;
+	err = 0;
+	if (old.type != CAPN_NULL)
+		orphan_add(p.seg->capn, old, tgt);
+end:
+	CAPN_PROBE2(copy_end, p.seg->capn, err);
+	return err;
 }
 
 /* TODO: handle CAPN_LIST, CAPN_PTR_LIST for bit lists */
@@ -958,6 +1176,12 @@ static void new_object(capn_ptr *p, int bytes) {
 	/* all allocations are 8 byte aligned */
 	bytes = (bytes + 7) & ~7;
 
+	if (s->capn && s->capn->orphans && bytes <= 8*ORPHAN_WORDS) {
+		p->data = orphan_take(s->capn->orphans, s, bytes);
+		if (p->data)
+			return;
+	}
+
 	if (s->len + bytes <= s->cap) {
 		p->data = s->data + s->len;
 		s->len += bytes;
@@ -1051,15 +1275,155 @@ capn_ptr capn_new_ptr_list(struct capn_segment *seg, int sz) {
 	return p;
 }
 
+/* The intern table is an open addressed hash table of the strings created
+ * by capn_new_string, keyed by their FNV-1a hash. Empty slots have a
+ * CAPN_NULL ptr. */
+struct intern_entry {
+	uint32_t hash;
+	capn_ptr p;
+};
+
+struct capn_intern {
+	uint32_t mask, count;
+	struct intern_entry *v;
+};
+
+static uint32_t intern_hash(const char *str, int len) {
+	uint32_t h = 2166136261u;
+	int i;
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t) str[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* intern_find returns the entry for str or the empty slot to insert it in */
+static struct intern_entry *intern_find(struct capn_intern *t, uint32_t hash, const char *str, int len) {
+	uint32_t i = hash & t->mask;
+	for (;;) {
+		struct intern_entry *e = &t->v[i];
+		if (e->p.type == CAPN_NULL)
+			return e;
+		if (e->hash == hash && e->p.len == len + 1 && !memcmp(e->p.data, str, len))
+			return e;
+		i = (i + 1) & t->mask;
+	}
+}
+
+static int intern_grow(struct capn *c, struct capn_intern *t, uint32_t size) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	struct intern_entry *old = t->v;
+	uint32_t i, oldsize = old ? t->mask + 1 : 0;
+
+	t->v = (struct intern_entry*) a->alloc(a->user, size * sizeof(*t->v));
+	if (!t->v) {
+		t->v = old;
+		return -1;
+	}
+	memset(t->v, 0, size * sizeof(*t->v));
+	t->mask = size - 1;
+
+	for (i = 0; i < oldsize; i++) {
+		struct intern_entry *e = &old[i];
+		if (e->p.type != CAPN_NULL)
+			*intern_find(t, e->hash, e->p.data, e->p.len - 1) = *e;
+	}
+
+	if (old)
+		a->free(a->user, old);
+	return 0;
+}
+
+int capn_intern_enable(struct capn *c, int hint) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	uint32_t size = 16;
+
+	if (c->strtab)
+		return 0;
+
+	while (size < (uint32_t) hint + (uint32_t) hint/3 && size < (1u << 30))
+		size *= 2;
+
+	c->strtab = (struct capn_intern*) a->alloc(a->user, sizeof(*c->strtab));
+	if (!c->strtab)
+		return -1;
+	memset(c->strtab, 0, sizeof(*c->strtab));
+	if (intern_grow(c, c->strtab, size)) {
+		a->free(a->user, c->strtab);
+		c->strtab = NULL;
+		return -1;
+	}
+	c->interned = 1;
+	return 0;
+}
+
+void capn_intern_disable(struct capn *c) {
+	const struct capn_allocator *a = c->alloc ? c->alloc : &capn_default_allocator;
+	if (c->strtab) {
+		a->free(a->user, c->strtab->v);
+		a->free(a->user, c->strtab);
+		c->strtab = NULL;
+	}
+}
+
+void capn_intern_prune(struct capn *c) {
+	struct capn_intern *t = c->strtab;
+	uint32_t i;
+
+	if (!t)
+		return;
+
+	for (i = 0; i <= t->mask; i++) {
+		struct intern_entry *e = &t->v[i];
+		if (e->p.type != CAPN_NULL && (e->p.seg->id >= c->segnum
+					|| e->p.data >= e->p.seg->data + e->p.seg->len)) {
+			memset(e, 0, sizeof(*e));
+			t->count--;
+		}
+	}
+
+	/* rehash what is left so that no probe runs over the holes */
+	if (intern_grow(c, t, t->mask + 1))
+		capn_intern_disable(c);
+}
+
 capn_ptr capn_new_string(struct capn_segment *seg, const char *str, ssize_t sz) {
 	capn_ptr p = {CAPN_LIST};
+	struct capn_intern *t = (seg && seg->capn) ? seg->capn->strtab : NULL;
+	struct intern_entry *e = NULL;
+	uint32_t hash = 0;
+
 	p.seg = seg;
 	p.len = ((sz >= 0) ? (size_t)sz : strlen(str)) + 1;
 	p.datasz = 1;
+
+	if (t) {
+		hash = intern_hash(str, p.len - 1);
+		e = intern_find(t, hash, str, p.len - 1);
+		if (e->p.type != CAPN_NULL) {
+			CAPN_STAT(seg->capn, intern_hits, 1);
+			CAPN_STAT(seg->capn, intern_bytes, (p.len + 7) & ~7);
+			return e->p;
+		}
+	}
+
 	new_object(&p, p.len);
 	if (p.data) {
 		memcpy(p.data, str, p.len - 1);
 		p.data[p.len - 1] = '\0';
+
+		/* keep the load under 3/4, if the table can't grow the
+		 * string is just not interned */
+		if (e && (t->count + 1) * 4 > (t->mask + 1) * 3) {
+			e = intern_grow(seg->capn, t, 2 * (t->mask + 1)) ? NULL
+				: intern_find(t, hash, str, p.len - 1);
+		}
+		if (e) {
+			e->hash = hash;
+			e->p = p;
+			t->count++;
+		}
 	}
 	return p;
 }
@@ -1089,6 +1453,12 @@ int capn_set_text(capn_ptr p, int off, capn_text tgt) {
 	return capn_setp(p, off, m);
 }
 
+int capn_cmp_text(capn_text a, capn_text b) {
+	int n = a.len < b.len ? a.len : b.len;
+	int r = n > 0 ? memcmp(a.str, b.str, n) : 0;
+	return r ? r : (a.len > b.len) - (a.len < b.len);
+}
+
 capn_data capn_get_data(capn_ptr p, int off) {
 	capn_data ret;
 	ret.p = capn_getp(p, off, 1);
@@ -1098,6 +1468,351 @@ capn_data capn_get_data(capn_ptr p, int off) {
 	return ret;
 }
 
+static int list_begin(struct capn_list_builder *b, capn_ptr p) {
+	b->p = p;
+	b->p.len = 0;
+	if (p.type == CAPN_BIT_LIST)
+		b->p.datasz = 0;
+	return p.type == CAPN_NULL ? -1 : 0;
+}
+
+int capn_list_begin(struct capn_list_builder *b, struct capn_segment *seg, int datasz, int ptrs, int hint) {
+	b->cap = hint > 0 ? hint : 8;
+	return list_begin(b, capn_new_list(seg, b->cap, datasz, ptrs));
+}
+
+int capn_list_begin1(struct capn_list_builder *b, struct capn_segment *seg, int hint) {
+	b->cap = hint > 0 ? hint : 64;
+	return list_begin(b, capn_new_list1(seg, b->cap).p);
+}
+
+int capn_list_begin_ptr(struct capn_list_builder *b, struct capn_segment *seg, int hint) {
+	b->cap = hint > 0 ? hint : 8;
+	return list_begin(b, capn_new_ptr_list(seg, b->cap));
+}
+
+/* list_move copies the elements of b->p to a new list with room for cap */
+static int list_move(struct capn_list_builder *b, int cap) {
+	capn_ptr *p = &b->p, n;
+	int i, j;
+
+	switch (p->type) {
+	case CAPN_BIT_LIST:
+		n = capn_new_list1(p->seg, cap).p;
+		break;
+	case CAPN_PTR_LIST:
+		n = capn_new_ptr_list(p->seg, cap);
+		break;
+	default:
+		n = capn_new_list(p->seg, cap, p->datasz, p->ptrs);
+		break;
+	}
+	if (n.type == CAPN_NULL)
+		return -1;
+	n.len = p->len;
+
+	if (p->type == CAPN_PTR_LIST) {
+		/* pointers are relative to where they are, so they are set
+		 * again rather than copied */
+		for (i = 0; i < p->len; i++) {
+			if (capn_setp(n, i, capn_getp(*p, i, 1)))
+				return -1;
+		}
+	} else if (p->ptrs) {
+		for (i = 0; i < p->len; i++) {
+			capn_ptr from = capn_getp(*p, i, 0), to = capn_getp(n, i, 0);
+			memcpy(to.data, from.data, from.datasz);
+			for (j = 0; j < p->ptrs; j++) {
+				if (capn_setp(to, j, capn_getp(from, j, 1)))
+					return -1;
+			}
+		}
+	} else {
+		memcpy(n.data, p->data, list_bytes(p, p->len) - (p->is_composite_list ? 8 : 0));
+	}
+
+	*p = n;
+	b->cap = cap;
+	return 0;
+}
+
+/* list_reserve makes room for need elements */
+static int list_reserve(struct capn_list_builder *b, int need) {
+	capn_ptr *p = &b->p;
+	struct capn_segment *s = p->seg;
+	int64_t have = list_bytes(p, b->cap);
+	int cap = b->cap < MAX_LIST_LEN/2 ? 2 * b->cap : MAX_LIST_LEN;
+
+	if (cap < need)
+		cap = need;
+
+	/* extend in place if nothing was allocated after the list */
+	if (list_start(p) + have == s->data + s->len) {
+		if (s->len + list_bytes(p, cap) - have <= s->cap) {
+			s->len += (int) (list_bytes(p, cap) - have);
+			b->cap = cap;
+			return 0;
+		} else if (s->len + list_bytes(p, need) - have <= s->cap) {
+			s->len += (int) (list_bytes(p, need) - have);
+			b->cap = need;
+			return 0;
+		}
+	}
+
+	return list_move(b, cap);
+}
+
+int capn_list_grow(struct capn_list_builder *b, int n) {
+	int first = b->p.len;
+
+	if (b->p.type == CAPN_NULL || n < 0 || first > MAX_LIST_LEN - n)
+		return -1;
+	if (first + n > b->cap && list_reserve(b, first + n))
+		return -1;
+
+	b->p.len += n;
+	if (b->p.type == CAPN_BIT_LIST)
+		b->p.datasz = (b->p.len + 7) / 8;
+	return first;
+}
+
+int capn_list_append1(struct capn_list_builder *b, int v) {
+	capn_list1 l;
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	l.p = b->p;
+	return capn_set1(l, i, v);
+}
+
+int capn_list_append_ptr(struct capn_list_builder *b, capn_ptr tgt) {
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	return capn_setp(b->p, i, tgt);
+}
+
+capn_ptr capn_list_finish(struct capn_list_builder *b) {
+	capn_ptr *p = &b->p;
+	struct capn_segment *s = p->seg;
+	int64_t have, used;
+
+	if (p->type == CAPN_NULL)
+		return *p;
+
+	have = list_bytes(p, b->cap);
+	used = list_bytes(p, p->len);
+	if (list_start(p) + have == s->data + s->len) {
+		s->len -= (int) (have - used);
+		b->cap = p->len;
+	}
+
+	if (p->is_composite_list) {
+		uint64_t hdr = STRUCT_PTR | (U64(p->len) << 2) | (U64(p->datasz/8) << 32) | (U64(p->ptrs) << 48);
+		*(uint64_t*) list_start(p) = capn_flip64(hdr);
+	}
+
+	/* new_object tagged the list with the length it started with */
+	if (p->has_ptr_tag)
+		write_ptr_tag(list_start(p) - 8, *p, 0);
+
+	return *p;
+}
+
+/* list_msort sorts the element indexes idx[0..n) of l with a merge sort,
+ * using tmp for the merges. Equal elements keep their order. */
+static void list_msort(capn_ptr l, int *idx, int *tmp, int n,
+		int (*cmp)(capn_ptr, capn_ptr, void*), void *arg) {
+	int h = n / 2, i = 0, j = h, k = 0;
+
+	if (n < 2)
+		return;
+
+	list_msort(l, idx, tmp, h, cmp, arg);
+	list_msort(l, idx + h, tmp, n - h, cmp, arg);
+
+	while (i < h && j < n) {
+		if (cmp(capn_getp(l, idx[j], 0), capn_getp(l, idx[i], 0), arg) < 0) {
+			tmp[k++] = idx[j++];
+		} else {
+			tmp[k++] = idx[i++];
+		}
+	}
+	while (i < h) {
+		tmp[k++] = idx[i++];
+	}
+	/* the rest of the second half is already in place */
+	memcpy(idx, tmp, k * sizeof(*idx));
+}
+
+/* list_move_ptr fixes up the pointer at p after it moved by words words.
+ * Struct and list pointers are relative to where they are, far pointers
+ * and capabilities are not. */
+static void list_move_ptr(char *p, int64_t words) {
+	uint64_t val = capn_flip64(*(uint64_t*) p);
+	int64_t off;
+
+	if (!val || (val & 3) > LIST_PTR)
+		return;
+
+	off = (I32(U32(val)) >> 2) - words;
+	val = (val & ~U64(0xFFFFFFFF)) | (U32(off) << 2) | (val & 3);
+	*(uint64_t*) p = capn_flip64(val);
+}
+
+int capn_list_sort(capn_ptr l, int (*cmp)(capn_ptr, capn_ptr, void*), void *arg) {
+	struct capn *c;
+	const struct capn_allocator *a;
+	int64_t sz;
+	int *idx;
+	char *buf;
+	int i, j;
+
+	capn_resolve(&l);
+	if (l.type != CAPN_LIST)
+		return -1;
+	if (l.len < 2)
+		return 0;
+
+	c = l.seg ? l.seg->capn : NULL;
+	a = c && c->alloc ? c->alloc : &capn_default_allocator;
+	sz = l.datasz + 8*l.ptrs;
+	idx = (int*) a->alloc(a->user, 2 * (size_t) l.len * sizeof(*idx));
+	buf = (char*) a->alloc(a->user, (size_t) (l.len * sz));
+	if (!idx || !buf) {
+		if (idx)
+			a->free(a->user, idx);
+		if (buf)
+			a->free(a->user, buf);
+		return -1;
+	}
+
+	for (i = 0; i < l.len; i++) {
+		idx[i] = i;
+	}
+	list_msort(l, idx, idx + l.len, l.len, cmp, arg);
+
+	for (i = 0; i < l.len; i++) {
+		char *d = buf + i*sz;
+		memcpy(d, l.data + idx[i]*sz, sz);
+		for (j = 0; j < l.ptrs; j++) {
+			list_move_ptr(d + l.datasz + 8*j, (i - idx[i]) * (sz/8));
+		}
+	}
+	memcpy(l.data, buf, l.len * sz);
+
+	a->free(a->user, buf);
+	a->free(a->user, idx);
+	return 0;
+}
+
+int capn_list_find(capn_ptr l, int (*key)(capn_ptr, const void*), const void *k) {
+	int lo = 0, hi;
+
+	capn_resolve(&l);
+	if (l.type != CAPN_LIST)
+		return -1;
+
+	hi = l.len;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (key(capn_getp(l, mid, 0), k) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < l.len && key(capn_getp(l, lo, 0), k) == 0)
+		return lo;
+	return -1;
+}
+
+capn_list32 capn_hash_build(struct capn_segment *seg, capn_ptr l, uint32_t (*hash)(capn_ptr, void*), void *arg) {
+	capn_list32 t = {{CAPN_NULL}};
+	uint32_t m, b;
+	int i;
+
+	capn_resolve(&l);
+	if (l.type == CAPN_NULL) {
+		l.len = 0;
+	} else if (l.type != CAPN_LIST) {
+		return t;
+	}
+
+	for (m = 1; m < 2 * (uint32_t) l.len; m *= 2) {}
+	if (m > MAX_LIST_LEN)
+		return t;
+
+	t = capn_new_list32(seg, (int) m);
+	if (t.p.type == CAPN_NULL)
+		return t;
+
+	for (i = 0; i < l.len; i++) {
+		b = hash(capn_getp(l, i, 0), arg) & (m - 1);
+		while (capn_get32(t, (int) b)) {
+			b = (b + 1) & (m - 1);
+		}
+		capn_set32(t, (int) b, (uint32_t) i + 1);
+	}
+	return t;
+}
+
+int capn_hash_find(capn_list32 t, capn_ptr l, uint32_t h, int (*eq)(capn_ptr, const void*), const void *k) {
+	uint32_t m, n, v;
+
+	capn_resolve(&t.p);
+	capn_resolve(&l);
+	m = (uint32_t) t.p.len;
+	if (t.p.type != CAPN_LIST || t.p.datasz != 4 || !m || (m & (m - 1)) || l.type != CAPN_LIST)
+		return -1;
+
+	for (n = 0; n < m; n++) {
+		v = capn_get32(t, (int) ((h + n) & (m - 1)));
+		if (!v)
+			return -1;
+		if (v <= (uint32_t) l.len && eq(capn_getp(l, (int) v - 1, 0), k))
+			return (int) v - 1;
+	}
+	return -1;
+}
+
+/* the 64 bit finalizer of MurmurHash3, folded to 32 bits */
+uint32_t capn_hash64(uint64_t v) {
+	v ^= v >> 33;
+	v *= UINT64_C(0xff51afd7ed558ccd);
+	v ^= v >> 33;
+	v *= UINT64_C(0xc4ceb9fe1a85ec53);
+	v ^= v >> 33;
+	return (uint32_t) (v ^ (v >> 32));
+}
+
+/* 32 bit FNV-1a */
+uint32_t capn_hash_text(capn_text t) {
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < t.len; i++) {
+		h = (h ^ (uint8_t) t.str[i]) * 16777619u;
+	}
+	return h;
+}
+
+void capn_stats_get(struct capn *c, struct capn_stats *st) {
+	struct capn_segment *s;
+
+	*st = c->stats;
+	st->cap = st->len = 0;
+	for (s = c->seglist; s != NULL; s = s->next) {
+		st->cap += s->cap;
+		st->len += s->len;
+	}
+}
+
+void capn_stats_reset(struct capn *c) {
+	memset(&c->stats, 0, sizeof(c->stats));
+}
+
 #define SZ 8
 #include "capn-list.inc"
 #undef SZ
@@ -67,9 +67,47 @@ extern "C" {
  * seglist and copylist are linked lists which can be used to free up segments
  * on cleanup, but should not be modified by the user.
  *
- * lookup, create, create_local, and user can be set by the user. Other values
- * should be zero initialized.
+ * alloc is the allocator used to release segments in capn_free and
+ * capn_reset_copy (via seg->user). NULL selects capn_default_allocator.
+ *
+ * stats holds the instrumentation counters, see capn_stats_get.
+ *
+ * strtab is the string intern table, see capn_intern_enable. interned is
+ * set once interning has been turned on and stays set after it is turned
+ * off, as strings written meanwhile may still be shared.
+ *
+ * lookup, create, create_local, user, and alloc can be set by the user. Other
+ * values should be zero initialized.
+ */
+
+/* struct capn_stats holds counters on how a message was built and read. The
+ * counters are only maintained when the library is built with CAPN_STATS
+ * (configure --enable-stats), otherwise they stay zero.
+ *
+ * segments and seg_bytes count the segments created through c->create and
+ * their capacity. far_ptrs and double_far_ptrs count the pointers of each
+ * kind written, tag_reuse the far pointers that used the tag new_object left
+ * in front of the data. copies and copy_bytes count the objects (and their
+ * size) that capn_setp had to deep copy. far_reads and double_far_reads count
+ * the far pointers resolved on read. intern_hits counts the strings
+ * capn_new_string found in the intern table and intern_bytes the segment
+ * space that saved. orphan_bytes counts the bytes of the objects capn_setp
+ * unlinked while orphan tracking was on, orphan_reused the bytes new objects
+ * took back from them.
+ *
+ * cap and len are not counters, capn_stats_get fills them in with the current
+ * total capacity and used length of the segments so cap - len is the slack.
  */
+struct capn_stats {
+	uint64_t segments, seg_bytes;
+	uint64_t far_ptrs, double_far_ptrs, tag_reuse;
+	uint64_t copies, copy_bytes;
+	uint64_t far_reads, double_far_reads;
+	uint64_t intern_hits, intern_bytes;
+	uint64_t orphan_bytes, orphan_reused;
+	uint64_t cap, len;
+};
+
 struct capn {
 	/* user settable */
 	struct capn_segment *(*lookup)(void* /*user*/, uint32_t /*id */);
@@ -82,8 +120,33 @@ struct capn {
 	struct capn_tree *segtree;
 	struct capn_segment *seglist, *lastseg;
 	struct capn_segment *copylist;
+	/* user settable */
+	const struct capn_allocator *alloc;
+	/* zero initialized, user should not modify */
+	struct capn_stats stats;
+	struct capn_intern *strtab;
+	struct capn_orphans *orphans;
+	unsigned int interned : 1;
+};
+
+/* struct capn_allocator is the memory allocator used by capn_init_alloc and
+ * friends for segments and by the library for any other bookkeeping.
+ *
+ * alloc and realloc behave as malloc and realloc, the memory returned need
+ * not be zeroed. free releases memory from alloc or realloc. user is passed
+ * to each function.
+ *
+ * capn_default_allocator uses malloc, realloc, and free.
+ */
+struct capn_allocator {
+	void *(*alloc)(void* /*user*/, size_t /*sz*/);
+	void *(*realloc)(void* /*user*/, void* /*p*/, size_t /*sz*/);
+	void (*free)(void* /*user*/, void* /*p*/);
+	void *user;
 };
 
+extern const struct capn_allocator capn_default_allocator;
+
 /* struct capn_tree is a rb tree header used internally for the segment id
  * lookup and copy tree */
 struct capn_tree {
@@ -193,6 +256,9 @@ int capn_setp(capn_ptr p, int off, capn_ptr tgt);
 capn_text capn_get_text(capn_ptr p, int off, capn_text def);
 capn_data capn_get_data(capn_ptr p, int off);
 int capn_set_text(capn_ptr p, int off, capn_text tgt);
+/* capn_cmp_text compares the bytes of two texts like memcmp, a text that
+ * is a prefix of the other sorts first */
+int capn_cmp_text(capn_text a, capn_text b);
 /* there is no set_data -- use capn_new_list8 + capn_setv8 instead
  * and set data.p = list.p */
 
@@ -246,6 +312,111 @@ capn_list16 capn_new_list16(struct capn_segment *seg, int sz);
 capn_list32 capn_new_list32(struct capn_segment *seg, int sz);
 capn_list64 capn_new_list64(struct capn_segment *seg, int sz);
 
+/* capn_intern_enable turns on string interning for the message c. From then
+ * on capn_new_string, and so capn_set_text and the generated setters, return
+ * the existing string when the same text was already added to c, so the
+ * pointers to it alias one list. hint is the expected number of distinct
+ * strings, or 0. Strings created while interning is on must not be modified
+ * in place. Returns 0 on success and -1 if the table can't be allocated.
+ *
+ * capn_intern_disable turns interning off and frees the table, strings
+ * already written stay shared. capn_free calls it.
+ */
+int capn_intern_enable(struct capn *c, int hint);
+void capn_intern_disable(struct capn *c);
+
+/* capn_orphans_enable turns on orphan tracking for the message c. From then
+ * on when capn_setp (or capn_set_text, capn_set_data and the generated
+ * setters) overwrites a pointer, the object it pointed to is recorded as
+ * dead, and new objects of up to 16 words in the same segment are placed in
+ * dead blocks (zeroed first) before the segment grows. Only the unlinked
+ * object itself is reclaimed, not the objects it points to. Tracking
+ * assumes each object is pointed to once: don't enable it when objects are
+ * shared, e.g. set in several places or copied in from the same source more
+ * than once. Text and data are never reclaimed once interning has been on
+ * for c, even after capn_intern_disable, as they may be shared. Returns 0
+ * on success and -1 if the table can't be allocated.
+ *
+ * capn_zero_orphans zeroes all dead objects recorded so far, so that they
+ * cost next to nothing once packed. They can still be reused.
+ *
+ * capn_orphans_disable turns tracking off and forgets the dead objects.
+ * capn_free calls it.
+ */
+int capn_orphans_enable(struct capn *c);
+void capn_orphans_disable(struct capn *c);
+void capn_zero_orphans(struct capn *c);
+
+/* struct capn_list_builder builds a list whose length is not known up front.
+ *
+ * capn_list_begin(1|_ptr) start a list as capn_new_list(1|_ptr) would, with
+ * room for hint elements (a default if hint is 0) but a length of 0.
+ *
+ * capn_list_grow appends n zeroed elements and returns the index of the
+ * first one, or -1 on error. They are set through b->p with the usual list
+ * functions. While the list is the last object in its segment it is
+ * extended in place, otherwise it is moved once to a new list twice the
+ * size. Objects pointed to from the list are not moved.
+ *
+ * capn_list_append(1|8|16|32|64|_ptr) append a single value.
+ *
+ * capn_list_finish gives back unused room if the list is still the last
+ * object in its segment and returns the list, which can then be set with
+ * capn_setp. Copies of b->p go stale when the list moves, so take them only
+ * once the list is finished.
+ */
+struct capn_list_builder {
+	capn_ptr p;
+	int cap;
+};
+
+int capn_list_begin(struct capn_list_builder *b, struct capn_segment *seg, int datasz, int ptrs, int hint);
+int capn_list_begin1(struct capn_list_builder *b, struct capn_segment *seg, int hint);
+int capn_list_begin_ptr(struct capn_list_builder *b, struct capn_segment *seg, int hint);
+int capn_list_grow(struct capn_list_builder *b, int n);
+int capn_list_append1(struct capn_list_builder *b, int v);
+int capn_list_append8(struct capn_list_builder *b, uint8_t v);
+int capn_list_append16(struct capn_list_builder *b, uint16_t v);
+int capn_list_append32(struct capn_list_builder *b, uint32_t v);
+int capn_list_append64(struct capn_list_builder *b, uint64_t v);
+int capn_list_append_ptr(struct capn_list_builder *b, capn_ptr tgt);
+capn_ptr capn_list_finish(struct capn_list_builder *b);
+
+/* capn_list_sort sorts the elements of a struct list in place, in the order
+ * given by cmp, which gets the two elements and arg. The sort is stable.
+ * Whole elements are moved and the offsets of their pointers are fixed up,
+ * so the objects they point to stay where they are. Pointers from elsewhere
+ * into the list are not fixed. Returns 0 on success, -1 if l is not a
+ * struct list or on allocation failure.
+ *
+ * capn_list_find does a binary search in a list sorted with capn_list_sort:
+ * key(elem, k) compares an element with the key k. It returns the index of
+ * the first element equal to k, or -1 if there is none.
+ */
+int capn_list_sort(capn_ptr l, int (*cmp)(capn_ptr, capn_ptr, void*), void *arg);
+int capn_list_find(capn_ptr l, int (*key)(capn_ptr, const void*), const void *k);
+
+/* capn_hash_build lays out an open addressing hash table for the struct
+ * list l in seg, so that elements can be looked up by key straight from the
+ * message. The table is a power of two of at least twice as many buckets as
+ * l has elements, each holding 1 + the index of an element or 0 if empty,
+ * with collisions going to the next bucket. hash(elem, arg) gives the hash
+ * of an element's key. A null list gives a table with a single empty
+ * bucket. Returns a null list if l is not a struct list or on failure.
+ *
+ * capn_hash_find looks up the key k with hash h in a table built for l,
+ * checking candidates with eq(elem, k). It returns the index of the element
+ * or -1 if there is none.
+ *
+ * capn_hash64 and capn_hash_text are the hashes the generated code uses for
+ * scalar and text keys. Tables are kept in messages, so these do not change
+ * between versions or platforms.
+ */
+capn_list32 capn_hash_build(struct capn_segment *seg, capn_ptr l, uint32_t (*hash)(capn_ptr, void*), void *arg);
+int capn_hash_find(capn_list32 t, capn_ptr l, uint32_t h, int (*eq)(capn_ptr, const void*), const void *k);
+uint32_t capn_hash64(uint64_t v);
+uint32_t capn_hash_text(capn_text t);
+
 /* capn_read|write* functions read/write struct values
  * off is the offset into the structure in bytes
  * Rarely should these be called directly, instead use the generated code.
@@ -269,12 +440,124 @@ CAPN_INLINE int capn_write64(capn_ptr p, int off, uint64_t val);
  * in serialized form (optionally packed). It will then setup the create
  * function ala capn_init_malloc so that further segments can be created.
  *
+ * capn_init_alloc and capn_init_(fp|mem)_alloc do the same, but allocate
+ * from the given allocator instead (NULL selects capn_default_allocator).
+ * The allocator must outlive c. A non-NULL allocator is passed to the create
+ * functions through c->user, so c->user must then be left alone. With NULL
+ * (and with capn_init_malloc) c->user is not used and is free for the user.
+ *
  * capn_free frees all the segment headers and data created by the create
  * function setup by capn_init_*
  */
 void capn_init_malloc(struct capn *c);
 int capn_init_fp(struct capn *c, FILE *f, int packed);
 int capn_init_mem(struct capn *c, const uint8_t *p, size_t sz, int packed);
+void capn_init_alloc(struct capn *c, const struct capn_allocator *a);
+int capn_init_fp_alloc(struct capn *c, FILE *f, int packed, const struct capn_allocator *a);
+int capn_init_mem_alloc(struct capn *c, const uint8_t *p, size_t sz, int packed, const struct capn_allocator *a);
+
+/* capn_frame_size reads the segment table at the start of p, which holds sz
+ * bytes of messages in the standard (unpacked) framing, and returns the
+ * size of the first message, 0 if p does not hold all of it yet, or -1 if
+ * the segment table is invalid. Segment data is not looked at.
+ *
+ * capn_init_frame inits c to read that message in place: segment data is
+ * not copied and nothing is allocated, the segment headers are set up in
+ * segs which has room for nsegs of them. It returns as capn_frame_size,
+ * or -1 if the message has more than nsegs segments. p must be 8 byte
+ * aligned and stay valid while c is used. New objects can not be
+ * allocated in c, and fields set through c are written to p, so it must
+ * not be set through when p is read only (e.g. mapped with PROT_READ).
+ * c and segs can be reused for the next message straight away, capn_free
+ * is not needed.
+ */
+int64_t capn_frame_size(const void *p, size_t sz);
+int64_t capn_init_frame(struct capn *c, struct capn_segment *segs, int nsegs, const void *p, size_t sz);
+
+/* capn_attach_(data|text) add a caller owned buffer to a message from
+ * capn_init_malloc or capn_init_alloc as a segment of its own, without
+ * copying it. The returned data/text can be set with capn_setp or
+ * capn_set_text and is reached through a far pointer. capn_write_fd writes
+ * it straight from the buffer, padded with zeros to a whole word.
+ *
+ * The buffer must stay valid and unmodified until c is freed or written,
+ * and its segment must not be used to allocate new objects. For text,
+ * str[len] must be the terminating '\0'. On error (another kind of message,
+ * a blob of 2^29 bytes or more, no memory) a null data/text is returned.
+ */
+capn_data capn_attach_data(struct capn *c, const void *p, size_t sz);
+capn_text capn_attach_text(struct capn *c, const char *str, size_t len);
+
+/* struct capn_template is a prototype message that new messages are cloned
+ * from by copying its segments, for messages that only differ in a few
+ * fields.
+ *
+ * capn_template_init sets up t from the prototype proto, which must not be
+ * changed or freed while t is in use.
+ *
+ * capn_clone_template inits c (as capn_init_alloc with a) with a copy of the
+ * prototype made with a single allocation and memcpy. Pointers stay valid
+ * since they are relative to their segment.
+ *
+ * capn_template_ptr translates p, a pointer into the prototype, to the same
+ * object in c, a message from capn_clone_template. Use capn_root(c) for the
+ * root and this to patch fields without walking down from it.
+ */
+struct capn_template {
+	struct capn *proto;
+	uint32_t segnum;
+	size_t size;
+};
+
+int capn_template_init(struct capn_template *t, struct capn *proto);
+int capn_clone_template(struct capn *c, const struct capn_template *t, const struct capn_allocator *a);
+capn_ptr capn_template_ptr(struct capn *c, capn_ptr p);
+
+/* capn_clone inits dst with a copy of the message src by copying its
+ * segments verbatim, without walking the objects in it. dst uses the
+ * allocator of src. With coalesce all segments share a single allocation
+ * (and new objects go to new segments), otherwise each segment is copied
+ * into an allocation of its own with room to grow. Returns 0 on success and
+ * -1 on error, dst is then empty.
+ */
+int capn_clone(struct capn *dst, const struct capn *src, int coalesce);
+
+/* struct capn_savepoint records how far a message being built has got, so
+ * that a partially built subtree can be abandoned without leaving it behind
+ * as garbage.
+ *
+ * capn_savepoint records the length of each segment of c and the segment
+ * count. It only allocates when c has more than CAPN_SAVEPOINT_SEGS
+ * segments, and returns -1 if that fails.
+ *
+ * capn_rollback rewinds c to sp: everything allocated since is zeroed and
+ * handed back, and segments created since are freed (as capn_free would).
+ * The copy tree is reset, so later copies of objects copied before sp are
+ * made again rather than shared. Pointers set since sp in objects that
+ * were already there are not undone, and must not point into the
+ * abandoned objects. sp stays valid, so it can be rolled back to again.
+ * Returns -1 if c has fewer segments than sp, i.e. it was already rolled
+ * back past sp.
+ *
+ * Savepoints are only supported for messages set up by capn_init_malloc,
+ * capn_init_alloc, capn_init_(fp|mem)(_alloc), capn_clone and
+ * capn_clone_template, as rollback frees segments the way capn_free does.
+ * For any other message (e.g. from capn_init_file or capn_init_shm, or
+ * with a user create function) capn_savepoint and capn_rollback return -1.
+ *
+ * capn_savepoint_release frees anything capn_savepoint allocated.
+ */
+#define CAPN_SAVEPOINT_SEGS 8
+
+struct capn_savepoint {
+	uint32_t segnum;
+	int len[CAPN_SAVEPOINT_SEGS];
+	int *more;
+};
+
+int capn_savepoint(struct capn *c, struct capn_savepoint *sp);
+int capn_rollback(struct capn *c, const struct capn_savepoint *sp);
+void capn_savepoint_release(struct capn *c, struct capn_savepoint *sp);
 
 /* capn_size() calculates the amount of memory required to serialise the given
  * Cap'n Proto structure in the unpacked format. It does NOT apply to packed
@@ -295,6 +578,264 @@ int64_t capn_write_mem(struct capn *c, uint8_t *p, size_t sz, int packed);
 void capn_free(struct capn *c);
 void capn_reset_copy(struct capn *c);
 
+/* capn_stats_get copies the counters of c into st and fills in the current
+ * segment capacity and length.
+ * capn_stats_reset zeros the counters.
+ */
+void capn_stats_get(struct capn *c, struct capn_stats *st);
+void capn_stats_reset(struct capn *c);
+
+/* struct capn_shm is a shared memory region that segments can be allocated
+ * in, so that a message built by one process can be read in place by
+ * another without going through a socket.
+ *
+ * capn_shm_create creates and maps a new region of size bytes. If name is
+ * NULL an anonymous region (memfd) is created that can be shared by fork or
+ * by passing the fd. Otherwise a named POSIX shm object is created.
+ *
+ * capn_shm_open|attach map an existing region by name or by fd. The region
+ * takes ownership of the fd.
+ *
+ * capn_shm_close unmaps the region and closes the fd.
+ *
+ * capn_init_shm inits the capn struct with a create function which allocates
+ * segments in the region.
+ *
+ * capn_shm_publish takes a reference on each segment of the message on behalf
+ * of one reader and returns the offset of a small descriptor in the region,
+ * or -1 on error. Publish once per reader.
+ *
+ * capn_init_shm_desc attaches the segments described by the descriptor
+ * without copying and releases the descriptor.
+ *
+ * capn_shm_free drops the references held by c and then frees it as per
+ * capn_free. Segment data is returned to the region once neither the
+ * builder nor any reader refers to it.
+ *
+ * Segments do not move, so the region does not grow. Allocation fails once
+ * the region is exhausted.
+ */
+struct capn_shm {
+	int fd;
+	size_t size;
+	char *base;
+};
+
+int capn_shm_create(struct capn_shm *m, const char *name, size_t size);
+int capn_shm_open(struct capn_shm *m, const char *name);
+int capn_shm_attach(struct capn_shm *m, int fd);
+void capn_shm_close(struct capn_shm *m);
+void capn_init_shm(struct capn *c, struct capn_shm *m);
+int64_t capn_shm_publish(struct capn *c);
+int capn_init_shm_desc(struct capn *c, struct capn_shm *m, int64_t desc);
+void capn_shm_free(struct capn *c);
+
+/* capn_init_file inits the capn struct with a create function which
+ * allocates segments in a sparse file through a shared mapping, growing
+ * the file as segments are created. This allows building messages larger
+ * than memory. fd must be open for reading and writing and is truncated.
+ * segsz is the size of the first segment (0 for the default); later
+ * segments double in size. A message can have up to 511 segments, so that
+ * it can be read by the reference implementation.
+ *
+ * capn_file_finish writes the segment table at the start of the file and
+ * trims the file so that it holds the message in the standard (unpacked)
+ * framing, as written by capn_write_fd. The first segment is moved in the
+ * file to follow the table, so c can only be freed with capn_file_free
+ * afterwards. It returns the size of the message or -1 on error. Data is
+ * not synced to disk, use fsync on the fd if required.
+ *
+ * capn_file_free unmaps the segments and frees c as per capn_free. The fd
+ * is left open.
+ */
+struct capn_file {
+	int fd;
+	size_t segsz;
+	uint64_t end;
+};
+
+int capn_init_file(struct capn *c, struct capn_file *f, int fd, size_t segsz);
+int64_t capn_file_finish(struct capn *c);
+void capn_file_free(struct capn *c);
+
+/* capn_forward_fd sends up to count messages (all if count <= 0) in the
+ * standard (unpacked) framing from the file open on in, starting at offset
+ * *off, to out, e.g. a socket. The framing on disk is the framing on the
+ * wire, so only the segment tables are read, to find where the messages
+ * end, and the messages are sent with a single sendfile on Linux (through
+ * a buffer elsewhere, or where sendfile does not support out). It stops at
+ * the end of the file, before a message that is not all there yet.
+ *
+ * It returns the number of messages sent and moves *off past them, or -1
+ * on error (an invalid segment table or a failed write), with *off where
+ * the data sent ends, possibly within a message. out should be blocking.
+ */
+int64_t capn_forward_fd(int out, int in, uint64_t *off, int64_t count);
+
+/* struct capn_scan describes a parallel scan over a log of messages in the
+ * standard (unpacked) framing, written back to back.
+ *
+ * The log is cut at message boundaries into ranges of about chunk bytes
+ * (0 for 4MB), using the offsets of index when it is set and otherwise a
+ * pass over the segment tables that does not read any segment data. index
+ * holds nindex ascending message offsets, e.g. one every few thousand
+ * messages kept next to the log by its writer; the scan starts at the
+ * first. The ranges are dealt out to threads threads (0 for one per
+ * online CPU, the calling thread is one of them). A thread that runs out
+ * steals half of the ranges another thread has not started yet.
+ *
+ * init(arg) is called once per thread before the scan and returns the
+ * state of that thread, or NULL on error. message(state, c, off, arg) is
+ * then called on that thread for each of its messages, with c reading the
+ * message at offset off in place (see capn_init_frame). Messages of a range
+ * come in order, but ranges run concurrently. c is reused for the next
+ * message, so nothing read through it may be kept. A non-zero return stops
+ * the scan. Once all threads are done, reduce(state, arg) is called for
+ * each state in turn on the calling thread, to merge it into arg and free
+ * it. init and reduce may be NULL.
+ *
+ * capn_scan_mem scans the sz bytes at p, which must be 8 byte aligned.
+ * capn_scan_fd maps the file open on fd read only and scans it, fields
+ * must not be set through c. Both return the number of messages passed to
+ * message, or -1 if the log is invalid or truncated, init fails, message
+ * stops the scan, or on lack of memory. reduce is still called then.
+ */
+struct capn_scan {
+	int threads;
+	size_t chunk;
+	const uint64_t *index;
+	size_t nindex;
+	void *(*init)(void* /*arg*/);
+	int (*message)(void* /*state*/, struct capn* /*c*/, uint64_t /*off*/, void* /*arg*/);
+	void (*reduce)(void* /*state*/, void* /*arg*/);
+	void *arg;
+};
+
+int64_t capn_scan_mem(const struct capn_scan *sc, const void *p, size_t sz);
+int64_t capn_scan_fd(const struct capn_scan *sc, int fd);
+
+/* struct capn_block_writer writes a log of messages in blocks, so that
+ * readers can skip the blocks that can not hold what they look for. Each
+ * block is a header message followed by the messages of the block, all in
+ * the standard (unpacked) framing. The header holds the number and size of
+ * the messages, the min and max of nkeys integer keys over the messages,
+ * and a bloom filter over ntexts text keys with bloom_bits bits per text
+ * (0 for 10, about 1% false positives).
+ *
+ * keys(root, keys, texts, arg) is called with the root struct of each
+ * message and fills in its keys, e.g. with generated getters. texts left
+ * null are not added to the filter. It returns 0, or -1 to fail the write.
+ *
+ * capn_block_write adds c to the current block, and writes the block out
+ * with write_fd to fd once it has block_size bytes of messages (0 for
+ * 1MB). capn_block_flush writes out the current block, if any. Both return
+ * 0 on success and -1 on error. The messages are kept in a buffer until
+ * then, from alloc (NULL selects capn_default_allocator).
+ * capn_block_writer_free frees the buffers, without a flush.
+ *
+ * capn_block_next reads the header of the next block of the log open on
+ * fd with pread, and returns 1 with the block in b, 0 at the end of the
+ * log or -1 on error. r->off is the offset of the next header, it starts
+ * at 0 and can be set back to the offset of an earlier header (b->off
+ * less the header size) to read again from there. The messages of a
+ * block are not read: they are the b->size bytes at offset b->off of the
+ * file (e.g. for capn_init_frame, or capn_scan_mem on a mapping). b points
+ * into r and is valid until the next call. capn_block_reader_free frees
+ * the header buffer.
+ *
+ * capn_block_overlaps returns 0 if the values of key in b are all outside
+ * [lo, hi], and capn_block_may_contain returns 0 if no message in b has t
+ * as text key text. Both return 1 otherwise, the latter with false
+ * positives.
+ */
+struct capn_block_writer {
+	/* user settable */
+	ssize_t (*write_fd)(int fd, const void *p, size_t count);
+	int fd;
+	size_t block_size;
+	int nkeys, ntexts, bloom_bits;
+	int (*keys)(capn_ptr /*root*/, int64_t* /*keys*/, capn_text* /*texts*/, void* /*arg*/);
+	void *arg;
+	const struct capn_allocator *alloc;
+	/* zero initialized, user should not modify */
+	uint8_t *buf;
+	size_t len, cap;
+	uint32_t messages;
+	int64_t *vals, *min, *max;
+	capn_text *texts;
+	uint32_t *hashes;
+	size_t nhashes, hashcap;
+};
+
+#define CAPN_BLOCK_SEGS 8
+
+struct capn_block_reader {
+	/* user settable */
+	int fd;
+	uint64_t off;
+	const struct capn_allocator *alloc;
+	/* zero initialized, user should not modify */
+	uint8_t *buf;
+	size_t cap;
+	struct capn c;
+	struct capn_segment segs[CAPN_BLOCK_SEGS];
+};
+
+struct capn_block {
+	uint64_t off, size;
+	uint32_t messages;
+	int ntexts, nhash;
+	capn_list64 min, max, bloom;
+};
+
+int capn_block_write(struct capn_block_writer *w, struct capn *c);
+int capn_block_flush(struct capn_block_writer *w);
+void capn_block_writer_free(struct capn_block_writer *w);
+int capn_block_next(struct capn_block_reader *r, struct capn_block *b);
+void capn_block_reader_free(struct capn_block_reader *r);
+int capn_block_overlaps(const struct capn_block *b, int key, int64_t lo, int64_t hi);
+int capn_block_may_contain(const struct capn_block *b, int text, capn_text t);
+
+/* struct capn_delta is one end of a delta coded stream of messages, for
+ * streams that send similar messages back to back (e.g. telemetry). Each
+ * frame carries the words of a message in the standard (unpacked) framing
+ * XORed with the words of the previous message of the stream, packed with
+ * the packed encoding. Words that did not change are zero and pack to next
+ * to nothing. Both ends keep the previous message as their reference.
+ *
+ * A frame is an 8 byte header followed by the packed words:
+ *
+ *   [words | keyframe << 31][packed bytes]
+ *
+ * Keyframes are not XORed, so a receiver can start from them. The first
+ * frame is a keyframe, and then every keyframe-th frame (never again if
+ * keyframe is 0).
+ *
+ * capn_delta_init sets up d, a is used for the reference buffers (NULL
+ * selects capn_default_allocator). capn_delta_free frees them.
+ *
+ * capn_delta_encode writes the frame for c to p and returns its size, or -1
+ * on error. sz must have room for the header and the packed words: 16 bytes
+ * plus 5/4 of capn_size(c) is always enough. If it does not fit, -1 is
+ * returned and d is unchanged.
+ *
+ * capn_delta_decode reads a frame from p and inits c with the message (as
+ * capn_init_mem_alloc, free it with capn_free). It returns the size of the
+ * frame, 0 if p does not hold the whole frame yet, or -1 on error. A frame
+ * that is not a keyframe can only be decoded after the frame before it.
+ */
+struct capn_delta {
+	const struct capn_allocator *alloc;
+	uint8_t *ref, *buf;
+	size_t len, cap;
+	unsigned keyframe, count;
+};
+
+void capn_delta_init(struct capn_delta *d, unsigned keyframe, const struct capn_allocator *a);
+void capn_delta_free(struct capn_delta *d);
+int64_t capn_delta_encode(struct capn_delta *d, struct capn *c, uint8_t *p, size_t sz);
+int64_t capn_delta_decode(struct capn_delta *d, struct capn *c, const uint8_t *p, size_t sz);
+
 /* Inline functions */
 
 
@@ -24,6 +24,46 @@
 # define intern /**/
 #endif
 
+/* CAPN_STAT adds n to a struct capn_stats counter of c, which may be NULL.
+ * It compiles to nothing unless CAPN_STATS is defined. */
+#ifdef CAPN_STATS
+# define CAPN_STAT(c, field, n) do { if (c) (c)->stats.field += (n); } while (0)
+#else
+# define CAPN_STAT(c, field, n) do {} while (0)
+#endif
+
+/* CAPN_PROBEn fires the USDT probe capnp_c:name with n arguments, for use
+ * with perf, bpftrace or systemtap. Probes compile to nothing unless
+ * CAPN_USDT is defined, and to a single nop in the hot path otherwise.
+ *
+ * segment_create(capn, segment id, cap bytes)
+ * far_ptr(capn, target segment id, landing pad reused)
+ * double_far_ptr(capn, target segment id)
+ * copy_start(capn, source data)
+ * copy_end(capn, return value)
+ * init_done(capn, segments, bytes, packed)
+ * write_done(capn, segments, bytes written, packed)
+ */
+#ifdef CAPN_USDT
+# include <sys/sdt.h>
+# define CAPN_PROBE1(name, a) DTRACE_PROBE1(capnp_c, name, a)
+# define CAPN_PROBE2(name, a, b) DTRACE_PROBE2(capnp_c, name, a, b)
+# define CAPN_PROBE3(name, a, b, c) DTRACE_PROBE3(capnp_c, name, a, b, c)
+# define CAPN_PROBE4(name, a, b, c, d) DTRACE_PROBE4(capnp_c, name, a, b, c, d)
+#else
+# define CAPN_PROBE1(name, a) do {} while (0)
+# define CAPN_PROBE2(name, a, b) do {} while (0)
+# define CAPN_PROBE3(name, a, b, c) do {} while (0)
+# define CAPN_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+/* capn_intern_prune and capn_orphans_prune drop strings and dead objects
+ * that are no longer part of the message (their segment id is at or beyond
+ * segnum, or they lie past the segment length) from the intern and orphan
+ * tables, for capn_rollback */
+intern void capn_intern_prune(struct capn *c);
+intern void capn_orphans_prune(struct capn *c);
+
 /* capn_stream encapsulates the needed fields for capn_(deflate|inflate) in a
  * similar manner to z_stream from zlib
  *
@@ -1,6 +1,11 @@
 #include "addressbook.capnp.h"
 /* AUTO GENERATED - DO NOT EDIT */
 static const capn_text capn_val0 = {0,"",0};
+static const uint8_t capn_buf[16] = {
+	117,110,116,97,103,103,101,100,
+	0,0,0,0,0,0,0,0
+};
+static const struct capn_segment capn_seg = {{0},0,0,0,(char*)&capn_buf[0],16,16,0};
 
 Person_ptr new_Person(struct capn_segment *s) {
 	Person_ptr p;
@@ -27,6 +32,7 @@ void read_Person(struct Person *s, Person_ptr p) {
 	default:
 		break;
 	}
+	s->_dirty[0] = 0;
 }
 void write_Person(const struct Person *s, Person_ptr p) {
 	capn_resolve(&p.p);
@@ -54,6 +60,78 @@ void set_Person(const struct Person *s, Person_list l, int i) {
 	p.p = capn_getp(l.p, i, 0);
 	write_Person(s, p);
 }
+void write_Person_dirty(struct Person *s, Person_ptr p) {
+	capn_resolve(&p.p);
+	if (s->_dirty[0] & (1u << 0)) {
+		capn_write32(p.p, 0, s->id);
+	}
+	if (s->_dirty[0] & (1u << 1)) {
+		capn_set_text(p.p, 0, s->name);
+	}
+	if (s->_dirty[0] & (1u << 2)) {
+		capn_set_text(p.p, 1, s->email);
+	}
+	if (s->_dirty[0] & (1u << 3)) {
+		capn_setp(p.p, 2, s->phones.p);
+	}
+	if (s->_dirty[0] & (1u << 4)) {
+		capn_write16(p.p, 4, s->employment_which);
+		switch (s->employment_which) {
+		case Person_employment_employer:
+		case Person_employment_school:
+			capn_set_text(p.p, 3, s->employment.school);
+			break;
+		default:
+			break;
+		}
+	}
+	s->_dirty[0] = 0;
+}
+void Person_mark_dirty(struct Person *s, enum Person_dirty f) {
+	s->_dirty[f/32] |= 1u << (f%32);
+}
+int begin_Person_list(struct capn_list_builder *b, struct capn_segment *s, int hint) {
+	return capn_list_begin(b, s, 8, 4, hint);
+}
+int append_Person(const struct Person *s, struct capn_list_builder *b) {
+	Person_list l;
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	l.p = b->p;
+	set_Person(s, l, i);
+	return 0;
+}
+Person_list finish_Person_list(struct capn_list_builder *b) {
+	Person_list l;
+	l.p = capn_list_finish(b);
+	return l;
+}
+
+static int Person_key_id(capn_ptr p, const void *k)
+{
+	uint32_t x, y = *(const uint32_t*) k;
+	x = capn_read32(p, 0);
+	return (x > y) - (x < y);
+}
+
+static int Person_cmp_id(capn_ptr a, capn_ptr b, void *arg)
+{
+	uint32_t y;
+	(void) arg;
+	y = capn_read32(b, 0);
+	return Person_key_id(a, &y);
+}
+
+int Person_list_sort_by_id(Person_list l)
+{
+	return capn_list_sort(l.p, Person_cmp_id, NULL);
+}
+
+int Person_list_find_by_id(Person_list l, uint32_t v)
+{
+	return capn_list_find(l.p, Person_key_id, &v);
+}
 
 uint32_t Person_get_id(Person_ptr p)
 {
@@ -62,6 +140,31 @@ uint32_t Person_get_id(Person_ptr p)
 	return id;
 }
 
+static int Person_key_name(capn_ptr p, const void *k)
+{
+	capn_text x, y = *(const capn_text*) k;
+	x = capn_get_text(p, 0, capn_val0);
+	return capn_cmp_text(x, y);
+}
+
+static int Person_cmp_name(capn_ptr a, capn_ptr b, void *arg)
+{
+	capn_text y;
+	(void) arg;
+	y = capn_get_text(b, 0, capn_val0);
+	return Person_key_name(a, &y);
+}
+
+int Person_list_sort_by_name(Person_list l)
+{
+	return capn_list_sort(l.p, Person_cmp_name, NULL);
+}
+
+int Person_list_find_by_name(Person_list l, capn_text v)
+{
+	return capn_list_find(l.p, Person_key_name, &v);
+}
+
 capn_text Person_get_name(Person_ptr p)
 {
 	capn_text name;
@@ -83,21 +186,45 @@ Person_PhoneNumber_list Person_get_phones(Person_ptr p)
 	return phones;
 }
 
+void Person_update_id(struct Person *s, uint32_t v)
+{
+	s->id = v;
+	s->_dirty[0] |= 1u << 0;
+}
+
 void Person_set_id(Person_ptr p, uint32_t id)
 {
 	capn_write32(p.p, 0, id);
 }
 
+void Person_update_name(struct Person *s, capn_text v)
+{
+	s->name = v;
+	s->_dirty[0] |= 1u << 1;
+}
+
 void Person_set_name(Person_ptr p, capn_text name)
 {
 	capn_set_text(p.p, 0, name);
 }
 
+void Person_update_email(struct Person *s, capn_text v)
+{
+	s->email = v;
+	s->_dirty[0] |= 1u << 2;
+}
+
 void Person_set_email(Person_ptr p, capn_text email)
 {
 	capn_set_text(p.p, 1, email);
 }
 
+void Person_update_phones(struct Person *s, Person_PhoneNumber_list v)
+{
+	s->phones = v;
+	s->_dirty[0] |= 1u << 3;
+}
+
 void Person_set_phones(Person_ptr p, Person_PhoneNumber_list phones)
 {
 	capn_setp(p.p, 2, phones.p);
@@ -117,6 +244,7 @@ void read_Person_PhoneNumber(struct Person_PhoneNumber *s, Person_PhoneNumber_pt
 	capn_resolve(&p.p);
 	s->number = capn_get_text(p.p, 0, capn_val0);
 	s->type = (enum Person_PhoneNumber_Type)(int) capn_read16(p.p, 0);
+	s->_dirty[0] = 0;
 }
 void write_Person_PhoneNumber(const struct Person_PhoneNumber *s, Person_PhoneNumber_ptr p) {
 	capn_resolve(&p.p);
@@ -133,6 +261,36 @@ void set_Person_PhoneNumber(const struct Person_PhoneNumber *s, Person_PhoneNumb
 	p.p = capn_getp(l.p, i, 0);
 	write_Person_PhoneNumber(s, p);
 }
+void write_Person_PhoneNumber_dirty(struct Person_PhoneNumber *s, Person_PhoneNumber_ptr p) {
+	capn_resolve(&p.p);
+	if (s->_dirty[0] & (1u << 0)) {
+		capn_set_text(p.p, 0, s->number);
+	}
+	if (s->_dirty[0] & (1u << 1)) {
+		capn_write16(p.p, 0, (uint16_t) (s->type));
+	}
+	s->_dirty[0] = 0;
+}
+void Person_PhoneNumber_mark_dirty(struct Person_PhoneNumber *s, enum Person_PhoneNumber_dirty f) {
+	s->_dirty[f/32] |= 1u << (f%32);
+}
+int begin_Person_PhoneNumber_list(struct capn_list_builder *b, struct capn_segment *s, int hint) {
+	return capn_list_begin(b, s, 8, 1, hint);
+}
+int append_Person_PhoneNumber(const struct Person_PhoneNumber *s, struct capn_list_builder *b) {
+	Person_PhoneNumber_list l;
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	l.p = b->p;
+	set_Person_PhoneNumber(s, l, i);
+	return 0;
+}
+Person_PhoneNumber_list finish_Person_PhoneNumber_list(struct capn_list_builder *b) {
+	Person_PhoneNumber_list l;
+	l.p = capn_list_finish(b);
+	return l;
+}
 
 capn_text Person_PhoneNumber_get_number(Person_PhoneNumber_ptr p)
 {
@@ -148,33 +306,53 @@ enum Person_PhoneNumber_Type Person_PhoneNumber_get_type(Person_PhoneNumber_ptr
 	return type;
 }
 
+void Person_PhoneNumber_update_number(struct Person_PhoneNumber *s, capn_text v)
+{
+	s->number = v;
+	s->_dirty[0] |= 1u << 0;
+}
+
 void Person_PhoneNumber_set_number(Person_PhoneNumber_ptr p, capn_text number)
 {
 	capn_set_text(p.p, 0, number);
 }
 
+void Person_PhoneNumber_update_type(struct Person_PhoneNumber *s, enum Person_PhoneNumber_Type v)
+{
+	s->type = v;
+	s->_dirty[0] |= 1u << 1;
+}
+
 void Person_PhoneNumber_set_type(Person_PhoneNumber_ptr p, enum Person_PhoneNumber_Type type)
 {
 	capn_write16(p.p, 0, (uint16_t) (type));
 }
+static capn_text capn_val1 = {8,(char*)&capn_buf[0],(struct capn_segment*)&capn_seg};
 
 AddressBook_ptr new_AddressBook(struct capn_segment *s) {
 	AddressBook_ptr p;
-	p.p = capn_new_struct(s, 0, 1);
+	p.p = capn_new_struct(s, 0, 4);
 	return p;
 }
 AddressBook_list new_AddressBook_list(struct capn_segment *s, int len) {
 	AddressBook_list p;
-	p.p = capn_new_list(s, len, 0, 1);
+	p.p = capn_new_list(s, len, 0, 4);
 	return p;
 }
 void read_AddressBook(struct AddressBook *s, AddressBook_ptr p) {
 	capn_resolve(&p.p);
 	s->people.p = capn_getp(p.p, 0, 0);
+	s->peopleByName.p = capn_getp(p.p, 1, 0);
+	s->tags.p = capn_getp(p.p, 2, 0);
+	s->tagsByLabel.p = capn_getp(p.p, 3, 0);
+	s->_dirty[0] = 0;
 }
 void write_AddressBook(const struct AddressBook *s, AddressBook_ptr p) {
 	capn_resolve(&p.p);
 	capn_setp(p.p, 0, s->people.p);
+	capn_setp(p.p, 1, s->peopleByName.p);
+	capn_setp(p.p, 2, s->tags.p);
+	capn_setp(p.p, 3, s->tagsByLabel.p);
 }
 void get_AddressBook(struct AddressBook *s, AddressBook_list l, int i) {
 	AddressBook_ptr p;
@@ -186,6 +364,42 @@ void set_AddressBook(const struct AddressBook *s, AddressBook_list l, int i) {
 	p.p = capn_getp(l.p, i, 0);
 	write_AddressBook(s, p);
 }
+void write_AddressBook_dirty(struct AddressBook *s, AddressBook_ptr p) {
+	capn_resolve(&p.p);
+	if (s->_dirty[0] & (1u << 0)) {
+		capn_setp(p.p, 0, s->people.p);
+	}
+	if (s->_dirty[0] & (1u << 1)) {
+		capn_setp(p.p, 1, s->peopleByName.p);
+	}
+	if (s->_dirty[0] & (1u << 2)) {
+		capn_setp(p.p, 2, s->tags.p);
+	}
+	if (s->_dirty[0] & (1u << 3)) {
+		capn_setp(p.p, 3, s->tagsByLabel.p);
+	}
+	s->_dirty[0] = 0;
+}
+void AddressBook_mark_dirty(struct AddressBook *s, enum AddressBook_dirty f) {
+	s->_dirty[f/32] |= 1u << (f%32);
+}
+int begin_AddressBook_list(struct capn_list_builder *b, struct capn_segment *s, int hint) {
+	return capn_list_begin(b, s, 0, 4, hint);
+}
+int append_AddressBook(const struct AddressBook *s, struct capn_list_builder *b) {
+	AddressBook_list l;
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	l.p = b->p;
+	set_AddressBook(s, l, i);
+	return 0;
+}
+AddressBook_list finish_AddressBook_list(struct capn_list_builder *b) {
+	AddressBook_list l;
+	l.p = capn_list_finish(b);
+	return l;
+}
 
 Person_list AddressBook_get_people(AddressBook_ptr p)
 {
@@ -194,7 +408,204 @@ Person_list AddressBook_get_people(AddressBook_ptr p)
 	return people;
 }
 
+static uint32_t AddressBook_hash_peopleByName(capn_ptr p, void *arg)
+{
+	capn_text x;
+	(void) arg;
+	x = capn_get_text(p, 0, capn_val0);
+	return capn_hash_text(x);
+}
+
+static int AddressBook_eq_peopleByName(capn_ptr p, const void *k)
+{
+	capn_text x, y = *(const capn_text*) k;
+	x = capn_get_text(p, 0, capn_val0);
+	return !capn_cmp_text(x, y);
+}
+
+int AddressBook_build_peopleByName(AddressBook_ptr p)
+{
+	capn_list32 t;
+	t = capn_hash_build(p.p.seg, capn_getp(p.p, 0, 1), AddressBook_hash_peopleByName, NULL);
+	if (t.p.type == CAPN_NULL)
+		return -1;
+	return capn_setp(p.p, 1, t.p);
+}
+
+int AddressBook_find_peopleByName(AddressBook_ptr p, capn_text v)
+{
+	capn_list32 t;
+	t.p = capn_getp(p.p, 1, 1);
+	return capn_hash_find(t, capn_getp(p.p, 0, 1), capn_hash_text(v), AddressBook_eq_peopleByName, &v);
+}
+
+capn_list32 AddressBook_get_peopleByName(AddressBook_ptr p)
+{
+	capn_list32 peopleByName;
+	peopleByName.p = capn_getp(p.p, 1, 0);
+	return peopleByName;
+}
+
+Tag_list AddressBook_get_tags(AddressBook_ptr p)
+{
+	Tag_list tags;
+	tags.p = capn_getp(p.p, 2, 0);
+	return tags;
+}
+
+static uint32_t AddressBook_hash_tagsByLabel(capn_ptr p, void *arg)
+{
+	capn_text x;
+	(void) arg;
+	x = capn_get_text(p, 0, capn_val1);
+	return capn_hash_text(x);
+}
+
+static int AddressBook_eq_tagsByLabel(capn_ptr p, const void *k)
+{
+	capn_text x, y = *(const capn_text*) k;
+	x = capn_get_text(p, 0, capn_val1);
+	return !capn_cmp_text(x, y);
+}
+
+int AddressBook_build_tagsByLabel(AddressBook_ptr p)
+{
+	capn_list32 t;
+	t = capn_hash_build(p.p.seg, capn_getp(p.p, 2, 1), AddressBook_hash_tagsByLabel, NULL);
+	if (t.p.type == CAPN_NULL)
+		return -1;
+	return capn_setp(p.p, 3, t.p);
+}
+
+int AddressBook_find_tagsByLabel(AddressBook_ptr p, capn_text v)
+{
+	capn_list32 t;
+	t.p = capn_getp(p.p, 3, 1);
+	return capn_hash_find(t, capn_getp(p.p, 2, 1), capn_hash_text(v), AddressBook_eq_tagsByLabel, &v);
+}
+
+capn_list32 AddressBook_get_tagsByLabel(AddressBook_ptr p)
+{
+	capn_list32 tagsByLabel;
+	tagsByLabel.p = capn_getp(p.p, 3, 0);
+	return tagsByLabel;
+}
+
+void AddressBook_update_people(struct AddressBook *s, Person_list v)
+{
+	s->people = v;
+	s->_dirty[0] |= 1u << 0;
+}
+
 void AddressBook_set_people(AddressBook_ptr p, Person_list people)
 {
 	capn_setp(p.p, 0, people.p);
 }
+
+void AddressBook_update_peopleByName(struct AddressBook *s, capn_list32 v)
+{
+	s->peopleByName = v;
+	s->_dirty[0] |= 1u << 1;
+}
+
+void AddressBook_set_peopleByName(AddressBook_ptr p, capn_list32 peopleByName)
+{
+	capn_setp(p.p, 1, peopleByName.p);
+}
+
+void AddressBook_update_tags(struct AddressBook *s, Tag_list v)
+{
+	s->tags = v;
+	s->_dirty[0] |= 1u << 2;
+}
+
+void AddressBook_set_tags(AddressBook_ptr p, Tag_list tags)
+{
+	capn_setp(p.p, 2, tags.p);
+}
+
+void AddressBook_update_tagsByLabel(struct AddressBook *s, capn_list32 v)
+{
+	s->tagsByLabel = v;
+	s->_dirty[0] |= 1u << 3;
+}
+
+void AddressBook_set_tagsByLabel(AddressBook_ptr p, capn_list32 tagsByLabel)
+{
+	capn_setp(p.p, 3, tagsByLabel.p);
+}
+
+Tag_ptr new_Tag(struct capn_segment *s) {
+	Tag_ptr p;
+	p.p = capn_new_struct(s, 0, 1);
+	return p;
+}
+Tag_list new_Tag_list(struct capn_segment *s, int len) {
+	Tag_list p;
+	p.p = capn_new_list(s, len, 0, 1);
+	return p;
+}
+void read_Tag(struct Tag *s, Tag_ptr p) {
+	capn_resolve(&p.p);
+	s->label = capn_get_text(p.p, 0, capn_val1);
+	s->_dirty[0] = 0;
+}
+void write_Tag(const struct Tag *s, Tag_ptr p) {
+	capn_resolve(&p.p);
+	capn_set_text(p.p, 0, (s->label.str != capn_val1.str) ? s->label : capn_val0);
+}
+void get_Tag(struct Tag *s, Tag_list l, int i) {
+	Tag_ptr p;
+	p.p = capn_getp(l.p, i, 0);
+	read_Tag(s, p);
+}
+void set_Tag(const struct Tag *s, Tag_list l, int i) {
+	Tag_ptr p;
+	p.p = capn_getp(l.p, i, 0);
+	write_Tag(s, p);
+}
+void write_Tag_dirty(struct Tag *s, Tag_ptr p) {
+	capn_resolve(&p.p);
+	if (s->_dirty[0] & (1u << 0)) {
+		capn_set_text(p.p, 0, (s->label.str != capn_val1.str) ? s->label : capn_val0);
+	}
+	s->_dirty[0] = 0;
+}
+void Tag_mark_dirty(struct Tag *s, enum Tag_dirty f) {
+	s->_dirty[f/32] |= 1u << (f%32);
+}
+int begin_Tag_list(struct capn_list_builder *b, struct capn_segment *s, int hint) {
+	return capn_list_begin(b, s, 0, 1, hint);
+}
+int append_Tag(const struct Tag *s, struct capn_list_builder *b) {
+	Tag_list l;
+	int i = capn_list_grow(b, 1);
+	if (i < 0)
+		return -1;
+	l.p = b->p;
+	set_Tag(s, l, i);
+	return 0;
+}
+Tag_list finish_Tag_list(struct capn_list_builder *b) {
+	Tag_list l;
+	l.p = capn_list_finish(b);
+	return l;
+}
+
+capn_text Tag_get_label(Tag_ptr p)
+{
+	capn_text label;
+	label = capn_get_text(p.p, 0, capn_val1);
+	return label;
+}
+
+void Tag_update_label(struct Tag *s, capn_text v)
+{
+	s->label = v;
+	s->_dirty[0] |= 1u << 0;
+}
+
+void Tag_set_label(Tag_ptr p, capn_text label)
+{
+	capn_set_text(p.p, 0, (label.str != capn_val1.str) ? label : capn_val0);
+}
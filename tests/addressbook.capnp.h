@@ -16,14 +16,17 @@ extern "C" {
 struct Person;
 struct Person_PhoneNumber;
 struct AddressBook;
+struct Tag;
 
 typedef struct {capn_ptr p;} Person_ptr;
 typedef struct {capn_ptr p;} Person_PhoneNumber_ptr;
 typedef struct {capn_ptr p;} AddressBook_ptr;
+typedef struct {capn_ptr p;} Tag_ptr;
 
 typedef struct {capn_ptr p;} Person_list;
 typedef struct {capn_ptr p;} Person_PhoneNumber_list;
 typedef struct {capn_ptr p;} AddressBook_list;
+typedef struct {capn_ptr p;} Tag_list;
 
 enum Person_PhoneNumber_Type {
 	Person_PhoneNumber_Type_mobile = 0,
@@ -47,6 +50,15 @@ struct Person {
 		capn_text employer;
 		capn_text school;
 	} employment;
+	uint32_t _dirty[1];
+};
+
+enum Person_dirty {
+	Person_dirty_id = 0,
+	Person_dirty_name = 1,
+	Person_dirty_email = 2,
+	Person_dirty_phones = 3,
+	Person_dirty_employment = 4
 };
 
 static const size_t Person_word_count = 1;
@@ -55,25 +67,52 @@ static const size_t Person_pointer_count = 4;
 
 static const size_t Person_struct_bytes_count = 40;
 
+
+void write_Person_dirty(struct Person *s, Person_ptr p);
+
+void Person_mark_dirty(struct Person *s, enum Person_dirty f);
+
+int Person_list_sort_by_id(Person_list l);
+
+int Person_list_find_by_id(Person_list l, uint32_t v);
+
 uint32_t Person_get_id(Person_ptr p);
 
+int Person_list_sort_by_name(Person_list l);
+
+int Person_list_find_by_name(Person_list l, capn_text v);
+
 capn_text Person_get_name(Person_ptr p);
 
 capn_text Person_get_email(Person_ptr p);
 
 Person_PhoneNumber_list Person_get_phones(Person_ptr p);
 
+void Person_update_id(struct Person *s, uint32_t v);
+
 void Person_set_id(Person_ptr p, uint32_t id);
 
+void Person_update_name(struct Person *s, capn_text v);
+
 void Person_set_name(Person_ptr p, capn_text name);
 
+void Person_update_email(struct Person *s, capn_text v);
+
 void Person_set_email(Person_ptr p, capn_text email);
 
+void Person_update_phones(struct Person *s, Person_PhoneNumber_list v);
+
 void Person_set_phones(Person_ptr p, Person_PhoneNumber_list phones);
 
 struct Person_PhoneNumber {
 	capn_text number;
 	enum Person_PhoneNumber_Type type;
+	uint32_t _dirty[1];
+};
+
+enum Person_PhoneNumber_dirty {
+	Person_PhoneNumber_dirty_number = 0,
+	Person_PhoneNumber_dirty_type = 1
 };
 
 static const size_t Person_PhoneNumber_word_count = 1;
@@ -82,51 +121,151 @@ static const size_t Person_PhoneNumber_pointer_count = 1;
 
 static const size_t Person_PhoneNumber_struct_bytes_count = 16;
 
+
+void write_Person_PhoneNumber_dirty(struct Person_PhoneNumber *s, Person_PhoneNumber_ptr p);
+
+void Person_PhoneNumber_mark_dirty(struct Person_PhoneNumber *s, enum Person_PhoneNumber_dirty f);
+
 capn_text Person_PhoneNumber_get_number(Person_PhoneNumber_ptr p);
 
 enum Person_PhoneNumber_Type Person_PhoneNumber_get_type(Person_PhoneNumber_ptr p);
 
+void Person_PhoneNumber_update_number(struct Person_PhoneNumber *s, capn_text v);
+
 void Person_PhoneNumber_set_number(Person_PhoneNumber_ptr p, capn_text number);
 
+void Person_PhoneNumber_update_type(struct Person_PhoneNumber *s, enum Person_PhoneNumber_Type v);
+
 void Person_PhoneNumber_set_type(Person_PhoneNumber_ptr p, enum Person_PhoneNumber_Type type);
 
 struct AddressBook {
 	Person_list people;
+	capn_list32 peopleByName;
+	Tag_list tags;
+	capn_list32 tagsByLabel;
+	uint32_t _dirty[1];
+};
+
+enum AddressBook_dirty {
+	AddressBook_dirty_people = 0,
+	AddressBook_dirty_peopleByName = 1,
+	AddressBook_dirty_tags = 2,
+	AddressBook_dirty_tagsByLabel = 3
 };
 
 static const size_t AddressBook_word_count = 0;
 
-static const size_t AddressBook_pointer_count = 1;
+static const size_t AddressBook_pointer_count = 4;
+
+static const size_t AddressBook_struct_bytes_count = 32;
 
-static const size_t AddressBook_struct_bytes_count = 8;
+
+void write_AddressBook_dirty(struct AddressBook *s, AddressBook_ptr p);
+
+void AddressBook_mark_dirty(struct AddressBook *s, enum AddressBook_dirty f);
 
 Person_list AddressBook_get_people(AddressBook_ptr p);
 
+int AddressBook_build_peopleByName(AddressBook_ptr p);
+
+int AddressBook_find_peopleByName(AddressBook_ptr p, capn_text v);
+
+capn_list32 AddressBook_get_peopleByName(AddressBook_ptr p);
+
+Tag_list AddressBook_get_tags(AddressBook_ptr p);
+
+int AddressBook_build_tagsByLabel(AddressBook_ptr p);
+
+int AddressBook_find_tagsByLabel(AddressBook_ptr p, capn_text v);
+
+capn_list32 AddressBook_get_tagsByLabel(AddressBook_ptr p);
+
+void AddressBook_update_people(struct AddressBook *s, Person_list v);
+
 void AddressBook_set_people(AddressBook_ptr p, Person_list people);
 
+void AddressBook_update_peopleByName(struct AddressBook *s, capn_list32 v);
+
+void AddressBook_set_peopleByName(AddressBook_ptr p, capn_list32 peopleByName);
+
+void AddressBook_update_tags(struct AddressBook *s, Tag_list v);
+
+void AddressBook_set_tags(AddressBook_ptr p, Tag_list tags);
+
+void AddressBook_update_tagsByLabel(struct AddressBook *s, capn_list32 v);
+
+void AddressBook_set_tagsByLabel(AddressBook_ptr p, capn_list32 tagsByLabel);
+
+struct Tag {
+	capn_text label;
+	uint32_t _dirty[1];
+};
+
+enum Tag_dirty {
+	Tag_dirty_label = 0
+};
+
+static const size_t Tag_word_count = 0;
+
+static const size_t Tag_pointer_count = 1;
+
+static const size_t Tag_struct_bytes_count = 8;
+
+
+void write_Tag_dirty(struct Tag *s, Tag_ptr p);
+
+void Tag_mark_dirty(struct Tag *s, enum Tag_dirty f);
+
+capn_text Tag_get_label(Tag_ptr p);
+
+void Tag_update_label(struct Tag *s, capn_text v);
+
+void Tag_set_label(Tag_ptr p, capn_text label);
+
 Person_ptr new_Person(struct capn_segment*);
 Person_PhoneNumber_ptr new_Person_PhoneNumber(struct capn_segment*);
 AddressBook_ptr new_AddressBook(struct capn_segment*);
+Tag_ptr new_Tag(struct capn_segment*);
 
 Person_list new_Person_list(struct capn_segment*, int len);
 Person_PhoneNumber_list new_Person_PhoneNumber_list(struct capn_segment*, int len);
 AddressBook_list new_AddressBook_list(struct capn_segment*, int len);
+Tag_list new_Tag_list(struct capn_segment*, int len);
 
 void read_Person(struct Person*, Person_ptr);
 void read_Person_PhoneNumber(struct Person_PhoneNumber*, Person_PhoneNumber_ptr);
 void read_AddressBook(struct AddressBook*, AddressBook_ptr);
+void read_Tag(struct Tag*, Tag_ptr);
 
 void write_Person(const struct Person*, Person_ptr);
 void write_Person_PhoneNumber(const struct Person_PhoneNumber*, Person_PhoneNumber_ptr);
 void write_AddressBook(const struct AddressBook*, AddressBook_ptr);
+void write_Tag(const struct Tag*, Tag_ptr);
 
 void get_Person(struct Person*, Person_list, int i);
 void get_Person_PhoneNumber(struct Person_PhoneNumber*, Person_PhoneNumber_list, int i);
 void get_AddressBook(struct AddressBook*, AddressBook_list, int i);
+void get_Tag(struct Tag*, Tag_list, int i);
 
 void set_Person(const struct Person*, Person_list, int i);
 void set_Person_PhoneNumber(const struct Person_PhoneNumber*, Person_PhoneNumber_list, int i);
 void set_AddressBook(const struct AddressBook*, AddressBook_list, int i);
+void set_Tag(const struct Tag*, Tag_list, int i);
+
+int begin_Person_list(struct capn_list_builder*, struct capn_segment*, int hint);
+int begin_Person_PhoneNumber_list(struct capn_list_builder*, struct capn_segment*, int hint);
+int begin_AddressBook_list(struct capn_list_builder*, struct capn_segment*, int hint);
+int begin_Tag_list(struct capn_list_builder*, struct capn_segment*, int hint);
+
+int append_Person(const struct Person*, struct capn_list_builder*);
+int append_Person_PhoneNumber(const struct Person_PhoneNumber*, struct capn_list_builder*);
+int append_AddressBook(const struct AddressBook*, struct capn_list_builder*);
+int append_Tag(const struct Tag*, struct capn_list_builder*);
+
+Person_list finish_Person_list(struct capn_list_builder*);
+Person_PhoneNumber_list finish_Person_PhoneNumber_list(struct capn_list_builder*);
+AddressBook_list finish_AddressBook_list(struct capn_list_builder*);
+Tag_list finish_Tag_list(struct capn_list_builder*);
 
 #ifdef __cplusplus
 }
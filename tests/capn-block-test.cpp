@@ -0,0 +1,165 @@
+/* capn-block-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+
+#include "capnp_c.h"
+
+/* messages are a struct with a time, a user id and a name */
+static void buildEvent(struct capn *c, int64_t time, int64_t user, const char *name) {
+  capn_init_malloc(c);
+  capn_ptr root = capn_root(c);
+  capn_ptr ptr = capn_new_struct(root.seg, 16, 1);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, (uint64_t) time));
+  EXPECT_EQ(0, capn_write64(ptr, 8, (uint64_t) user));
+  if (name) {
+    capn_text t = {(int) strlen(name), name, NULL};
+    EXPECT_EQ(0, capn_set_text(ptr, 0, t));
+  }
+}
+
+static int eventKeys(capn_ptr root, int64_t *keys, capn_text *texts, void *arg) {
+  capn_text def = {0, NULL, NULL};
+  keys[0] = (int64_t) capn_read64(root, 0);
+  keys[1] = (int64_t) capn_read64(root, 8);
+  texts[0] = capn_get_text(root, 0, def);
+  return 0;
+}
+
+static ssize_t writeFd(int fd, const void *p, size_t sz) {
+  return write(fd, p, sz);
+}
+
+static capn_text text(const char *s) {
+  capn_text t = {(int) strlen(s), s, NULL};
+  return t;
+}
+
+TEST(Block, ZoneMapsAndBloom) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  struct capn_block_writer w;
+  memset(&w, 0, sizeof(w));
+  w.write_fd = &writeFd;
+  w.fd = fileno(fp);
+  w.block_size = 4096;
+  w.nkeys = 2;
+  w.ntexts = 1;
+  w.keys = &eventKeys;
+
+  /* time goes up, users go round, every 3rd event has no name */
+  for (int i = 0; i < 1000; i++) {
+    struct capn c;
+    char name[32];
+    snprintf(name, sizeof(name), "user%d", i);
+    buildEvent(&c, 1000 + i, (i * 37) % 100 - 50, i % 3 ? name : NULL);
+    ASSERT_EQ(0, capn_block_write(&w, &c));
+    capn_free(&c);
+  }
+  ASSERT_EQ(0, capn_block_flush(&w));
+  EXPECT_EQ(0, capn_block_flush(&w));
+  capn_block_writer_free(&w);
+
+  struct capn_block_reader r;
+  struct capn_block b;
+  memset(&r, 0, sizeof(r));
+  r.fd = fileno(fp);
+
+  int blocks = 0, hits = 0, falsehits = 0;
+  uint32_t messages = 0;
+  int64_t prevmax = 0;
+  std::vector<uint64_t> data;
+  int ret;
+  while ((ret = capn_block_next(&r, &b)) == 1) {
+    blocks++;
+    messages += b.messages;
+    ASSERT_EQ(2, b.min.p.len);
+    EXPECT_EQ(1, b.ntexts);
+    EXPECT_GT((int64_t) capn_get64(b.min, 0), prevmax);
+    prevmax = (int64_t) capn_get64(b.max, 0);
+    EXPECT_LE(-50, (int64_t) capn_get64(b.min, 1));
+    EXPECT_GE(49, (int64_t) capn_get64(b.max, 1));
+
+    /* check the zone map and the filter against the messages */
+    data.resize(b.size / 8);
+    ASSERT_EQ((ssize_t) b.size, pread(fileno(fp), &data[0], b.size, b.off));
+    uint64_t off = 0;
+    uint32_t n = 0;
+    while (off < b.size) {
+      struct capn c;
+      struct capn_segment segs[4];
+      int64_t sz = capn_init_frame(&c, segs, 4, (char*) &data[0] + off, b.size - off);
+      ASSERT_LT(0, sz);
+      capn_ptr root = capn_getp(capn_root(&c), 0, 1);
+      int64_t time = (int64_t) capn_read64(root, 0);
+      EXPECT_TRUE(capn_block_overlaps(&b, 0, time, time));
+      capn_text def = {0, NULL, NULL};
+      capn_text name = capn_get_text(root, 0, def);
+      if (name.str) {
+        EXPECT_TRUE(capn_block_may_contain(&b, 0, name));
+      }
+      off += sz;
+      n++;
+    }
+    EXPECT_EQ(b.messages, n);
+
+    EXPECT_FALSE(capn_block_overlaps(&b, 0, 0, 999));
+    EXPECT_FALSE(capn_block_overlaps(&b, 1, 50, 100));
+    EXPECT_TRUE(capn_block_overlaps(&b, 2, 0, 0));
+    EXPECT_TRUE(capn_block_may_contain(&b, 1, text("x")));
+    hits += capn_block_overlaps(&b, 0, 1500, 1510);
+    for (int i = 0; i < 100; i++) {
+      char absent[32];
+      snprintf(absent, sizeof(absent), "nobody%d", i);
+      falsehits += capn_block_may_contain(&b, 0, text(absent));
+    }
+  }
+  EXPECT_EQ(0, ret);
+  EXPECT_EQ(1000u, messages);
+  EXPECT_LT(5, blocks);
+  /* a narrow time range hits one block, maybe two */
+  EXPECT_LE(1, hits);
+  EXPECT_GE(2, hits);
+  /* about 1% false positives */
+  EXPECT_GT(blocks * 100 / 20, falsehits);
+
+  /* a truncated log */
+  struct stat st;
+  ASSERT_EQ(0, fstat(fileno(fp), &st));
+  ASSERT_EQ(0, ftruncate(fileno(fp), st.st_size - 8));
+  r.off = 0;
+  while ((ret = capn_block_next(&r, &b)) == 1) {
+  }
+  EXPECT_EQ(-1, ret);
+
+  capn_block_reader_free(&r);
+  fclose(fp);
+}
+
+TEST(Block, NotABlockLog) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  struct capn c;
+  buildEvent(&c, 1, 2, "x");
+  ASSERT_LT(0, capn_write_fd(&c, &writeFd, fileno(fp), 0));
+  capn_free(&c);
+
+  struct capn_block_reader r;
+  struct capn_block b;
+  memset(&r, 0, sizeof(r));
+  r.fd = fileno(fp);
+  EXPECT_EQ(-1, capn_block_next(&r, &b));
+  capn_block_reader_free(&r);
+  fclose(fp);
+}
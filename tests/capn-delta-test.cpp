@@ -0,0 +1,130 @@
+/* capn-delta-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <vector>
+
+#include "capnp_c.h"
+
+/* buildSample builds a telemetry like message: a header and a list of 256
+ * readings of which only a few change from one sample to the next */
+static void buildSample(struct capn *c, int t) {
+  capn_init_malloc(c);
+  capn_ptr root = capn_root(c);
+  capn_ptr ptr = capn_new_struct(root.seg, 16, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, 1000 + t));
+  EXPECT_EQ(0, capn_write32(ptr, 8, 42));
+  EXPECT_EQ(0, capn_set_text(ptr, 0, (capn_text) {11, "sensor-rack", NULL}));
+
+  capn_list64 l = capn_new_list64(ptr.seg, 256);
+  for (int i = 0; i < 256; i++) {
+    uint64_t v = UINT64_C(0x0123456789abcdef) * (i + 1);
+    if (i % 64 == t % 64)
+      v += t;
+    EXPECT_EQ(0, capn_set64(l, i, v));
+  }
+  EXPECT_EQ(0, capn_setp(ptr, 1, l.p));
+}
+
+static std::vector<uint8_t> serialize(struct capn *c) {
+  std::vector<uint8_t> v(capn_size(c));
+  EXPECT_EQ((int64_t) v.size(), capn_write_mem(c, v.data(), v.size(), 0));
+  return v;
+}
+
+TEST(Delta, RoundTrip) {
+  struct capn_delta enc, dec;
+  capn_delta_init(&enc, 16, NULL);
+  capn_delta_init(&dec, 16, NULL);
+
+  std::vector<uint8_t> stream, frame(8192);
+  std::vector<std::vector<uint8_t> > sent;
+  size_t packed = 0;
+  for (int t = 0; t < 100; t++) {
+    struct capn c;
+    buildSample(&c, t);
+    sent.push_back(serialize(&c));
+    packed += capn_write_mem(&c, frame.data(), frame.size(), 1);
+    int64_t sz = capn_delta_encode(&enc, &c, frame.data(), frame.size());
+    ASSERT_GT(sz, 8);
+    /* keyframes are the first frame and every 16th after it */
+    EXPECT_EQ(t % 16 == 0, (frame[3] & 0x80) != 0);
+    stream.insert(stream.end(), frame.begin(), frame.begin() + sz);
+    capn_free(&c);
+  }
+  EXPECT_LT(stream.size() * 10, packed);
+
+  size_t off = 0;
+  for (int t = 0; t < 100; t++) {
+    struct capn c;
+    /* a partial frame asks for more */
+    EXPECT_EQ(0, capn_delta_decode(&dec, &c, stream.data() + off, 7));
+    int64_t sz = capn_delta_decode(&dec, &c, stream.data() + off, stream.size() - off);
+    ASSERT_GT(sz, 0);
+    off += sz;
+    EXPECT_TRUE(sent[t] == serialize(&c));
+    capn_ptr ptr = capn_getp(capn_root(&c), 0, 1);
+    EXPECT_EQ((uint64_t) (1000 + t), capn_read64(ptr, 0));
+    capn_free(&c);
+  }
+  EXPECT_EQ(stream.size(), off);
+
+  capn_delta_free(&enc);
+  capn_delta_free(&dec);
+}
+
+TEST(Delta, JoinAtKeyframe) {
+  struct capn_delta enc, dec;
+  capn_delta_init(&enc, 4, NULL);
+  capn_delta_init(&dec, 4, NULL);
+  std::vector<uint8_t> frame(8192);
+
+  for (int t = 0; t < 8; t++) {
+    struct capn c, r;
+    buildSample(&c, t);
+    int64_t sz = capn_delta_encode(&enc, &c, frame.data(), frame.size());
+    ASSERT_GT(sz, 0);
+    if (t < 4) {
+      /* the receiver missed the keyframe, deltas can't be decoded */
+      if (t > 0) {
+        EXPECT_EQ(-1, capn_delta_decode(&dec, &r, frame.data(), sz));
+      }
+    } else {
+      ASSERT_EQ(sz, capn_delta_decode(&dec, &r, frame.data(), sz));
+      EXPECT_TRUE(serialize(&c) == serialize(&r));
+      capn_free(&r);
+    }
+    capn_free(&c);
+  }
+
+  capn_delta_free(&enc);
+  capn_delta_free(&dec);
+}
+
+TEST(Delta, ShortOutput) {
+  struct capn_delta enc, dec;
+  capn_delta_init(&enc, 0, NULL);
+  capn_delta_init(&dec, 0, NULL);
+  std::vector<uint8_t> frame(8192);
+
+  for (int t = 0; t < 3; t++) {
+    struct capn c, r;
+    buildSample(&c, t);
+    /* a failed encode leaves the stream state as it was */
+    EXPECT_EQ(-1, capn_delta_encode(&enc, &c, frame.data(), 16));
+    int64_t sz = capn_delta_encode(&enc, &c, frame.data(), frame.size());
+    ASSERT_GT(sz, 0);
+    ASSERT_EQ(sz, capn_delta_decode(&dec, &r, frame.data(), sz));
+    EXPECT_TRUE(serialize(&c) == serialize(&r));
+    capn_free(&r);
+    capn_free(&c);
+  }
+
+  capn_delta_free(&enc);
+  capn_delta_free(&dec);
+}
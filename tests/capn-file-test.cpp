@@ -0,0 +1,217 @@
+/* capn-file-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "capnp_c.h"
+
+static void buildList(struct capn *c, int len) {
+  capn_ptr root = capn_root(c);
+  ASSERT_EQ(CAPN_PTR_LIST, root.type);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 1);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, len));
+
+  capn_list64 list = capn_new_list64(ptr.seg, len);
+  ASSERT_EQ(CAPN_LIST, list.p.type);
+  for (int i = 0; i < len; i++) {
+    EXPECT_EQ(0, capn_set64(list, i, UINT64_C(0x0101010101010101) * i));
+  }
+  EXPECT_EQ(0, capn_setp(ptr, 0, list.p));
+}
+
+static void checkList(struct capn *c, int len) {
+  capn_ptr ptr = capn_getp(capn_root(c), 0, 1);
+  ASSERT_EQ(CAPN_STRUCT, ptr.type);
+  EXPECT_EQ((uint64_t) len, capn_read64(ptr, 0));
+
+  capn_list64 list;
+  list.p = capn_getp(ptr, 0, 1);
+  ASSERT_EQ(len, list.p.len);
+  for (int i = 0; i < len; i++) {
+    EXPECT_EQ(UINT64_C(0x0101010101010101) * i, capn_get64(list, i));
+  }
+}
+
+TEST(File, OneSegment) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  struct capn c, rc;
+  struct capn_file f;
+  ASSERT_EQ(0, capn_init_file(&c, &f, fileno(fp), 0));
+  buildList(&c, 16);
+  EXPECT_EQ(1, c.segnum);
+
+  int64_t sz = capn_file_finish(&c);
+  /* one word of segment table followed by the used part of the segment */
+  EXPECT_EQ(8 + (int64_t) c.seglist->len, sz);
+  capn_file_free(&c);
+
+  struct stat st;
+  ASSERT_EQ(0, fstat(fileno(fp), &st));
+  EXPECT_EQ(sz, st.st_size);
+
+  ASSERT_EQ(0, fseek(fp, 0, SEEK_SET));
+  ASSERT_EQ(0, capn_init_fp(&rc, fp, 0));
+  checkList(&rc, 16);
+  capn_free(&rc);
+  fclose(fp);
+}
+
+TEST(File, ManySegments) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  struct capn c, rc;
+  struct capn_file f;
+  ASSERT_EQ(0, capn_init_file(&c, &f, fileno(fp), 4096));
+
+  /* each list is too large for the segments created so far */
+  capn_ptr root = capn_root(&c);
+  capn_ptr ptr = capn_new_struct(root.seg, 0, 4);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  for (int i = 0; i < 4; i++) {
+    capn_list8 list = capn_new_list8(ptr.seg, 8192 << i);
+    ASSERT_EQ(CAPN_LIST, list.p.type);
+    EXPECT_EQ(0, capn_set8(list, (8192 << i) - 1, (uint8_t) i + 1));
+    EXPECT_EQ(0, capn_setp(ptr, i, list.p));
+  }
+  EXPECT_LT(2, c.segnum);
+  uint32_t segnum = c.segnum;
+
+  int64_t sz = capn_file_finish(&c);
+  ASSERT_LT(0, sz);
+  capn_file_free(&c);
+
+  /* the table holds the real segment count */
+  uint32_t hdr;
+  ASSERT_EQ(4, pread(fileno(fp), &hdr, 4, 0));
+  EXPECT_EQ(segnum - 1, capn_flip32(hdr));
+
+  ASSERT_EQ(0, fseek(fp, 0, SEEK_SET));
+  ASSERT_EQ(0, capn_init_fp(&rc, fp, 0));
+  ptr = capn_getp(capn_root(&rc), 0, 1);
+  ASSERT_EQ(CAPN_STRUCT, ptr.type);
+  for (int i = 0; i < 4; i++) {
+    capn_list8 list;
+    list.p = capn_getp(ptr, i, 1);
+    ASSERT_EQ(8192 << i, list.p.len);
+    EXPECT_EQ(i + 1, capn_get8(list, (8192 << i) - 1));
+    EXPECT_EQ(0, capn_get8(list, 0));
+  }
+  capn_free(&rc);
+  fclose(fp);
+}
+
+static ssize_t writeFd(int fd, const void *p, size_t sz) {
+  return write(fd, p, sz);
+}
+
+static std::vector<char> readAll(int fd) {
+  std::vector<char> buf;
+  char tmp[4096];
+  ssize_t r;
+  while ((r = read(fd, tmp, sizeof(tmp))) > 0) {
+    buf.insert(buf.end(), tmp, tmp + r);
+  }
+  return buf;
+}
+
+TEST(File, Forward) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  /* messages of one and of several segments */
+  std::vector<uint64_t> offs;
+  for (int i = 0; i < 6; i++) {
+    struct capn c;
+    capn_init_malloc(&c);
+    buildList(&c, i % 2 ? 2000 : 4);
+    offs.push_back((uint64_t) lseek(fileno(fp), 0, SEEK_CUR));
+    ASSERT_LT(0, capn_write_fd(&c, &writeFd, fileno(fp), 0));
+    capn_free(&c);
+  }
+  uint64_t size = (uint64_t) lseek(fileno(fp), 0, SEEK_CUR);
+  offs.push_back(size);
+  std::vector<char> file(size);
+  ASSERT_EQ((ssize_t) size, pread(fileno(fp), &file[0], size, 0));
+
+  int sv[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  uint64_t off = 0;
+  EXPECT_EQ(2, capn_forward_fd(sv[0], fileno(fp), &off, 2));
+  EXPECT_EQ(offs[2], off);
+  EXPECT_EQ(4, capn_forward_fd(sv[0], fileno(fp), &off, 0));
+  EXPECT_EQ(size, off);
+  EXPECT_EQ(0, capn_forward_fd(sv[0], fileno(fp), &off, 0));
+
+  /* a message being appended is left for later */
+  struct capn c;
+  capn_init_malloc(&c);
+  buildList(&c, 3);
+  ASSERT_LT(0, capn_write_fd(&c, &writeFd, fileno(fp), 0));
+  capn_free(&c);
+  uint64_t full = (uint64_t) lseek(fileno(fp), 0, SEEK_CUR);
+  ASSERT_EQ(0, ftruncate(fileno(fp), full - 8));
+  EXPECT_EQ(0, capn_forward_fd(sv[0], fileno(fp), &off, 0));
+  EXPECT_EQ(size, off);
+  close(sv[0]);
+
+  std::vector<char> got = readAll(sv[1]);
+  close(sv[1]);
+  EXPECT_EQ(file, got);
+
+  /* the messages read back as sent */
+  FILE *rf = fmemopen(&got[0], got.size(), "rb");
+  ASSERT_NE((FILE*) NULL, rf);
+  for (int i = 0; i < 6; i++) {
+    struct capn rc;
+    ASSERT_EQ(0, capn_init_fp(&rc, rf, 0));
+    checkList(&rc, i % 2 ? 2000 : 4);
+    capn_free(&rc);
+  }
+  fclose(rf);
+
+  /* not a message */
+  uint32_t bad[2] = {5000, 0};
+  ASSERT_EQ(8, pwrite(fileno(fp), bad, 8, 0));
+  off = 0;
+  EXPECT_EQ(-1, capn_forward_fd(sv[0], fileno(fp), &off, 0));
+  fclose(fp);
+}
+
+TEST(File, ForwardMaxSegments) {
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+
+  /* 1024 segments, the first holds an empty root pointer */
+  std::vector<uint32_t> frame(2 * 513 + 2, 0);
+  frame[0] = capn_flip32(1023);
+  frame[1] = capn_flip32(1);
+  ASSERT_EQ(4112, (int) (frame.size() * 4));
+  EXPECT_EQ(4112, capn_frame_size(&frame[0], frame.size() * 4));
+  ASSERT_EQ(1u, fwrite(&frame[0], frame.size() * 4, 1, fp));
+  fflush(fp);
+
+  int sv[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+  uint64_t off = 0;
+  EXPECT_EQ(1, capn_forward_fd(sv[0], fileno(fp), &off, 0));
+  EXPECT_EQ(4112u, off);
+  close(sv[0]);
+
+  std::vector<char> got = readAll(sv[1]);
+  close(sv[1]);
+  ASSERT_EQ(4112u, got.size());
+  EXPECT_EQ(0, memcmp(&frame[0], &got[0], got.size()));
+  fclose(fp);
+}
@@ -0,0 +1,401 @@
+/* capn-filter-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "capn-filter.h"
+}
+
+/* The schema the filters are compiled against, as capn-schema would load
+ * it from:
+ *
+ *   enum Color { red @0; green @1; blue @2; }
+ *
+ *   struct Part {
+ *     w @0 :UInt32;
+ *     v @1 :Int16 = 7;
+ *     label @2 :Text;
+ *   }
+ *
+ *   struct Item {
+ *     id @0 :Int32;
+ *     count @1 :UInt16 = 5;
+ *     flag @2 :Bool;
+ *     color @3 :Color;
+ *     score @4 :Float64 = 1.5;
+ *     name @5 :Text;
+ *     tags @6 :List(Text);
+ *     parts @7 :List(Part);
+ *     main @8 :Part;
+ *     union {
+ *       num @9 :UInt32;
+ *       ratio @10 :Float32;
+ *     }
+ *   }
+ *
+ * Item has 3 data words laid out as id (bytes 0-3), count (4-5), flag (bit
+ * 48), the union discriminant (8-9), color (10-11), num or ratio (12-15)
+ * and score (16-23), and 4 pointers. */
+class Schema {
+public:
+  Schema() {
+    static const char *colors[] = {"red", "green", "blue"};
+    uint16_t none = Field_noDiscriminant;
+
+    memset(&color, 0, sizeof(color));
+    color.name = "Color";
+    color.which = Node__enum;
+    color.enumerants = 3;
+    color.enumerant_names = colors;
+
+    memset(&part, 0, sizeof(part));
+    memset(partFields, 0, sizeof(partFields));
+    part.name = "Part";
+    part.which = Node__struct;
+    part.datasz = 1;
+    part.ptrs = 1;
+    part.nfields = 3;
+    part.fields = partFields;
+    field(&partFields[0], "w", Type_uint32, 0, 0, none);
+    field(&partFields[1], "v", Type_int16, 2, 7, none);
+    field(&partFields[2], "label", Type_text, 0, 0, none);
+
+    memset(&textType, 0, sizeof(textType));
+    textType.which = Type_text;
+    memset(&partType, 0, sizeof(partType));
+    partType.which = Type__struct;
+    partType.node = &part;
+
+    memset(&item, 0, sizeof(item));
+    memset(itemFields, 0, sizeof(itemFields));
+    item.name = "Item";
+    item.which = Node__struct;
+    item.datasz = 3;
+    item.ptrs = 4;
+    item.discriminant_count = 2;
+    item.discriminant_offset = 4;
+    item.nfields = 11;
+    item.fields = itemFields;
+    field(&itemFields[0], "id", Type_int32, 0, 0, none);
+    field(&itemFields[1], "count", Type_uint16, 2, 5, none);
+    field(&itemFields[2], "flag", Type__bool, 48, 0, none);
+    field(&itemFields[3], "color", Type__enum, 5, 0, none)->type.node = &color;
+    field(&itemFields[4], "score", Type_float64, 2, capn_from_f64(1.5), none);
+    field(&itemFields[5], "name", Type_text, 0, 0, none);
+    field(&itemFields[6], "tags", Type__list, 1, 0, none)->type.elem = &textType;
+    field(&itemFields[7], "parts", Type__list, 2, 0, none)->type.elem = &partType;
+    field(&itemFields[8], "main", Type__struct, 3, 0, none)->type.node = &part;
+    field(&itemFields[9], "num", Type_uint32, 3, 0, 0);
+    field(&itemFields[10], "ratio", Type_float32, 3, 0, 1);
+  }
+
+  struct schema_node color, part, item;
+  struct schema_field partFields[3], itemFields[11];
+  struct schema_type textType, partType;
+
+private:
+  static struct schema_field *field(struct schema_field *f, const char *name,
+      enum Type_which which, uint32_t offset, uint64_t def, uint16_t disc) {
+    f->name = name;
+    f->type.which = which;
+    f->offset = offset;
+    f->def = def;
+    f->discriminant = disc;
+    return f;
+  }
+};
+
+class Message {
+public:
+  Message(int datasz = 24) {
+    capn_init_malloc(&c);
+    capn_ptr root = capn_root(&c);
+    item = capn_new_struct(root.seg, datasz, 4);
+    EXPECT_EQ(0, capn_setp(root, 0, item));
+  }
+  ~Message() {capn_free(&c);}
+
+  void setText(capn_ptr p, int off, const char *s) {
+    capn_text t = {(int) strlen(s), s, NULL};
+    EXPECT_EQ(0, capn_set_text(p, off, t));
+  }
+
+  /* sets parts to a list of n structs with datasz bytes of data each */
+  capn_ptr setParts(int n, int datasz) {
+    capn_ptr parts = capn_new_list(item.seg, n, datasz, 1);
+    EXPECT_EQ(0, capn_setp(item, 2, parts));
+    return parts;
+  }
+
+  struct capn c;
+  capn_ptr item;
+};
+
+static int match(Schema *s, Message *m, const char *expr) {
+  char err[128];
+  struct filter *f = filter_compile(&s->item, expr, err, sizeof(err));
+  EXPECT_TRUE(f != NULL) << expr << ": " << err;
+  if (!f)
+    return -1;
+  int ret = filter_match(f, m->item);
+  filter_free(f);
+  return ret;
+}
+
+static std::string compileError(Schema *s, const char *expr) {
+  char err[128];
+  struct filter *f = filter_compile(&s->item, expr, err, sizeof(err));
+  EXPECT_TRUE(f == NULL) << expr;
+  filter_free(f);
+  return err;
+}
+
+static std::string dump(Schema *s, const char *expr) {
+  char err[128];
+  struct filter *f = filter_compile(&s->item, expr, err, sizeof(err));
+  EXPECT_TRUE(f != NULL) << expr << ": " << err;
+  if (!f)
+    return "";
+
+  char *buf = NULL;
+  size_t sz = 0;
+  FILE *out = open_memstream(&buf, &sz);
+  filter_dump(f, out);
+  fclose(out);
+  filter_free(f);
+  std::string ret(buf, sz);
+  free(buf);
+  return ret;
+}
+
+TEST(Filter, ParseErrors) {
+  Schema s;
+  char err[128];
+
+  EXPECT_EQ("no field nope in Item", compileError(&s, "nope == 1"));
+  EXPECT_EQ("no field x in Part", compileError(&s, "main.x == 1"));
+  EXPECT_EQ("expected a comparison at '1'", compileError(&s, "id 1"));
+  EXPECT_EQ("expected a value at ''", compileError(&s, "id =="));
+  EXPECT_EQ("expected a value at '-1'", compileError(&s, "count == -1"));
+  EXPECT_EQ("expected a string at '1'", compileError(&s, "name == 1"));
+  EXPECT_EQ("unterminated string", compileError(&s, "name == \"abc"));
+  EXPECT_EQ("^= only applies to text and data", compileError(&s, "id ^= 1"));
+  EXPECT_EQ("id is not a list", compileError(&s, "id[] == 1"));
+  EXPECT_EQ("main is a struct, compare one of its fields", compileError(&s, "main == 1"));
+  EXPECT_EQ("only scalars, text and data can be compared", compileError(&s, "tags == 1"));
+  EXPECT_EQ("no enumerant purple in Color", compileError(&s, "color == purple"));
+  EXPECT_EQ("expected a field name at '== 1'", compileError(&s, "== 1"));
+  EXPECT_EQ("expected ) at ''", compileError(&s, "(id == 1"));
+  EXPECT_EQ("unexpected ')'", compileError(&s, "id == 1)"));
+  EXPECT_EQ("expected a field name at ''", compileError(&s, "id == 1 &&"));
+
+  EXPECT_TRUE(filter_compile(&s.color, "red == 1", err, sizeof(err)) == NULL);
+  EXPECT_STREQ("the root is not a struct", err);
+}
+
+TEST(Filter, Precedence) {
+  Schema s;
+  Message m;
+  capn_write32(m.item, 0, 1);
+  capn_write16(m.item, 4, 2 ^ 5);
+
+  /* && binds tighter than ||, ! tighter than both */
+  EXPECT_EQ(1, match(&s, &m, "id == 1 || id == 2 && count == 3"));
+  EXPECT_EQ(0, match(&s, &m, "(id == 1 || id == 2) && count == 3"));
+  EXPECT_EQ(0, match(&s, &m, "id == 2 && count == 2 || count == 3"));
+  EXPECT_EQ(1, match(&s, &m, "count == 3 || id == 1 && count == 2"));
+  EXPECT_EQ(0, match(&s, &m, "!id == 1 && count == 2"));
+  EXPECT_EQ(1, match(&s, &m, "!(id == 1 && count == 3)"));
+  EXPECT_EQ(1, match(&s, &m, "!!id == 1"));
+  EXPECT_EQ(0, match(&s, &m, "!(id == 2 || count == 2)"));
+
+  /* a || b && c: a true jumps past b && c, b false jumps to the end */
+  EXPECT_EQ("   0  test  id == 1\n"
+            "            int32 byte 0 ==\n"
+            "   1  jnz   5\n"
+            "   2  test  id == 2\n"
+            "            int32 byte 0 ==\n"
+            "   3  jz    5\n"
+            "   4  test  count == 3\n"
+            "            uint16 byte 4 ==\n",
+            dump(&s, "id == 1 || id == 2 && count == 3"));
+
+  /* a && b || c: a false jumps to the || which then tries c */
+  EXPECT_EQ("   0  test  id == 1\n"
+            "            int32 byte 0 ==\n"
+            "   1  jz    3\n"
+            "   2  test  count == 2\n"
+            "            uint16 byte 4 ==\n"
+            "   3  jnz   6\n"
+            "   4  test  count == 3\n"
+            "            uint16 byte 4 ==\n"
+            "   5  not\n",
+            dump(&s, "id == 1 && count == 2 || !count == 3"));
+  EXPECT_EQ(1, match(&s, &m, "id == 1 && count == 2 || !count == 3"));
+  EXPECT_EQ(0, match(&s, &m, "id == 2 && count == 2 || !count == 2"));
+}
+
+TEST(Filter, Union) {
+  Schema s;
+  Message m;
+
+  EXPECT_EQ("   0  test  num == 9\n"
+            "            union 8 == 0\n"
+            "            uint32 byte 12 ==\n",
+            dump(&s, "num == 9"));
+
+  capn_write16(m.item, 8, 0);
+  capn_write32(m.item, 12, 9);
+  EXPECT_EQ(1, match(&s, &m, "num == 9"));
+  EXPECT_EQ(0, match(&s, &m, "ratio != 0"));
+  EXPECT_EQ(0, match(&s, &m, "ratio == 0"));
+
+  /* the same slot read as the other member */
+  capn_write16(m.item, 8, 1);
+  capn_write32(m.item, 12, capn_from_f32(0.75f));
+  EXPECT_EQ(0, match(&s, &m, "num != 9"));
+  EXPECT_EQ(1, match(&s, &m, "ratio > 0.5"));
+  EXPECT_EQ(1, match(&s, &m, "ratio == 0.75 && !num == 0"));
+}
+
+TEST(Filter, ScalarLists) {
+  Schema s;
+  Message m;
+  capn_ptr parts = m.setParts(3, 8);
+  for (int i = 0; i < 3; i++) {
+    capn_ptr p = capn_getp(parts, i, 0);
+    capn_write32(p, 0, 10 * (i + 1));
+    capn_write16(p, 4, (uint16_t) (-i ^ 7));
+  }
+
+  EXPECT_EQ("   0  test  parts[].w == 20\n"
+            "            ptr 2\n"
+            "            any 0\n"
+            "            uint32 byte 0 ==\n",
+            dump(&s, "parts[].w == 20"));
+  EXPECT_EQ(1, match(&s, &m, "parts[].w == 20"));
+  EXPECT_EQ(1, match(&s, &m, "parts[].w > 25"));
+  EXPECT_EQ(0, match(&s, &m, "parts[].w == 25"));
+  EXPECT_EQ(1, match(&s, &m, "parts[].v == -2"));
+  EXPECT_EQ(0, match(&s, &m, "parts[].v < -2"));
+  EXPECT_EQ(0, match(&s, &m, "parts[].v == 7"));
+
+  /* parts written by an older schema without data read as defaults */
+  Message old;
+  old.setParts(2, 0);
+  EXPECT_EQ(1, match(&s, &old, "parts[].v == 7"));
+  EXPECT_EQ(1, match(&s, &old, "parts[].w == 0"));
+  EXPECT_EQ(0, match(&s, &old, "parts[].w != 0"));
+
+  /* an empty or missing list never matches */
+  Message none;
+  EXPECT_EQ(0, match(&s, &none, "parts[].v == 7"));
+  none.setParts(0, 8);
+  EXPECT_EQ(0, match(&s, &none, "parts[].v == 7"));
+}
+
+TEST(Filter, BlobLists) {
+  Schema s;
+  Message m;
+  capn_ptr tags = capn_new_ptr_list(m.item.seg, 3);
+  m.setText(tags, 0, "alpha");
+  m.setText(tags, 1, "beta");
+  m.setText(tags, 2, "gamma");
+  EXPECT_EQ(0, capn_setp(m.item, 1, tags));
+
+  EXPECT_EQ("   0  test  tags[] == \"beta\"\n"
+            "            ptr 1\n"
+            "            any 0\n"
+            "            text elem 0 ==\n",
+            dump(&s, "tags[] == \"beta\""));
+  EXPECT_EQ(1, match(&s, &m, "tags[] == \"beta\""));
+  EXPECT_EQ(0, match(&s, &m, "tags[] == \"bet\""));
+  EXPECT_EQ(1, match(&s, &m, "tags[] ^= \"gam\""));
+  EXPECT_EQ(1, match(&s, &m, "tags[] $= \"pha\""));
+  EXPECT_EQ(1, match(&s, &m, "tags[] *= \"mm\""));
+  EXPECT_EQ(0, match(&s, &m, "tags[] *= \"x\""));
+  EXPECT_EQ(1, match(&s, &m, "tags[] < \"alphabet\""));
+
+  /* a text field of the elements of a struct list */
+  capn_ptr parts = m.setParts(2, 8);
+  m.setText(capn_getp(parts, 1, 0), 0, "a \"quoted\" \\label");
+  EXPECT_EQ(1, match(&s, &m, "parts[].label == \"a \\\"quoted\\\" \\\\label\""));
+  EXPECT_EQ(1, match(&s, &m, "parts[].label == \"\""));
+  EXPECT_EQ(0, match(&s, &m, "parts[].label ^= \"b\""));
+
+  /* null text is empty */
+  EXPECT_EQ(1, match(&s, &m, "name == \"\""));
+  EXPECT_EQ(1, match(&s, &m, "name ^= \"\""));
+  EXPECT_EQ(0, match(&s, &m, "name > \"\""));
+  m.setText(m.item, 0, "hello");
+  EXPECT_EQ(1, match(&s, &m, "name > \"\" && name == \"hello\""));
+}
+
+TEST(Filter, Defaults) {
+  Schema s;
+  Message m;
+
+  /* the stored bits are xored with the default */
+  EXPECT_EQ(1, match(&s, &m, "count == 5"));
+  EXPECT_EQ(1, match(&s, &m, "score == 1.5"));
+  EXPECT_EQ(1, match(&s, &m, "main.v == 7 && main.w == 0"));
+  capn_write16(m.item, 4, 5 ^ 9);
+  capn_write64(m.item, 16, capn_from_f64(1.5) ^ capn_from_f64(-2.25));
+  EXPECT_EQ(1, match(&s, &m, "count == 9"));
+  EXPECT_EQ(1, match(&s, &m, "score == -2.25"));
+
+  /* bools and enums */
+  EXPECT_EQ(1, match(&s, &m, "flag == false && color == red"));
+  capn_write1(m.item, 48, 1);
+  capn_write16(m.item, 10, 2);
+  EXPECT_EQ(1, match(&s, &m, "flag == true && color == blue"));
+  EXPECT_EQ(1, match(&s, &m, "color > green && color == 2"));
+
+  /* a root written by an older schema with one data word */
+  Message old(8);
+  capn_write32(old.item, 0, 42);
+  capn_write16(old.item, 4, 5 ^ 3);
+  EXPECT_EQ(1, match(&s, &old, "id == 42 && count == 3"));
+  EXPECT_EQ(1, match(&s, &old, "score == 1.5"));
+  EXPECT_EQ(1, match(&s, &old, "color == red && num == 0"));
+
+  /* no root at all */
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr nullp = capn_getp(capn_root(&c), 0, 1);
+  char err[128];
+  struct filter *f = filter_compile(&s.item, "count == 5 && score == 1.5 && name == \"\"", err, sizeof(err));
+  ASSERT_TRUE(f != NULL);
+  EXPECT_EQ(1, filter_match(f, nullp));
+  filter_free(f);
+  capn_free(&c);
+}
+
+TEST(Filter, NaN) {
+  Schema s;
+  Message m;
+  capn_write64(m.item, 16, capn_from_f64(NAN) ^ capn_from_f64(1.5));
+
+  /* NaN is not equal to, less than or greater than anything */
+  EXPECT_EQ(0, match(&s, &m, "score == 0"));
+  EXPECT_EQ(1, match(&s, &m, "score != 0"));
+  EXPECT_EQ(0, match(&s, &m, "score < 1e308"));
+  EXPECT_EQ(0, match(&s, &m, "score >= -1e308"));
+  EXPECT_EQ(0, match(&s, &m, "score == nan"));
+  EXPECT_EQ(1, match(&s, &m, "score != nan"));
+
+  /* nor is a NaN literal */
+  capn_write64(m.item, 16, 0);
+  EXPECT_EQ(1, match(&s, &m, "score == 1.5"));
+  EXPECT_EQ(0, match(&s, &m, "score <= nan"));
+  EXPECT_EQ(1, match(&s, &m, "score != nan"));
+}
@@ -0,0 +1,213 @@
+/* capn-scan-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "capnp_c.h"
+
+/* appendMessage writes a message whose root struct holds v and a list of
+ * len words to log, and returns its offset */
+static uint64_t appendMessage(std::vector<uint64_t> *log, uint64_t v, int len) {
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr root = capn_root(&c);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 1);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, v));
+  capn_list64 list = capn_new_list64(ptr.seg, len);
+  for (int i = 0; i < len; i++) {
+    EXPECT_EQ(0, capn_set64(list, i, v));
+  }
+  EXPECT_EQ(0, capn_setp(ptr, 0, list.p));
+
+  uint64_t off = log->size() * 8;
+  int sz = capn_size(&c);
+  log->resize(log->size() + sz/8);
+  EXPECT_EQ(sz, capn_write_mem(&c, (uint8_t*) &(*log)[off/8], sz, 0));
+  capn_free(&c);
+  return off;
+}
+
+struct totals {
+  int64_t messages, sum, states;
+  uint64_t lastoff;
+  int stopat;
+};
+
+static void *initTotals(void *arg) {
+  return calloc(1, sizeof(struct totals));
+}
+
+static int addMessage(void *state, struct capn *c, uint64_t off, void *arg) {
+  struct totals *t = (struct totals*) state;
+  capn_ptr ptr = capn_getp(capn_root(c), 0, 1);
+  uint64_t v = capn_read64(ptr, 0);
+  capn_list64 list;
+  list.p = capn_getp(ptr, 0, 1);
+  if (list.p.len && capn_get64(list, list.p.len - 1) != v)
+    return -1;
+  t->messages++;
+  t->sum += v;
+  t->lastoff = off;
+  return (int) v == ((struct totals*) arg)->stopat;
+}
+
+static void reduceTotals(void *state, void *arg) {
+  struct totals *t = (struct totals*) state, *all = (struct totals*) arg;
+  all->messages += t->messages;
+  all->sum += t->sum;
+  all->states++;
+  free(t);
+}
+
+TEST(Frame, InitInPlace) {
+  std::vector<uint64_t> log;
+  /* the list is too large for the first segment */
+  appendMessage(&log, 7, 1024);
+  size_t sz = log.size() * 8;
+
+  struct capn_segment segs[4];
+  struct capn c;
+  EXPECT_EQ((int64_t) sz, capn_frame_size(&log[0], sz));
+  EXPECT_EQ(0, capn_frame_size(&log[0], sz - 8));
+  EXPECT_EQ(0, capn_frame_size(&log[0], 2));
+  ASSERT_EQ((int64_t) sz, capn_init_frame(&c, segs, 4, &log[0], sz));
+  ASSERT_EQ(2, c.segnum);
+  EXPECT_EQ((char*) &log[0] + 16, c.seglist->data);
+  EXPECT_EQ(c.seglist->data + c.seglist->len, c.lastseg->data);
+
+  struct totals t, arg;
+  memset(&t, 0, sizeof(t));
+  memset(&arg, 0, sizeof(arg));
+  arg.stopat = -1;
+  EXPECT_EQ(0, addMessage(&t, &c, 0, &arg));
+  EXPECT_EQ(7, t.sum);
+
+  EXPECT_EQ(-1, capn_init_frame(&c, segs, 1, &log[0], sz));
+  EXPECT_EQ(0, capn_init_frame(&c, segs, 4, &log[0], sz - 8));
+
+  log[0] = 2000;
+  EXPECT_EQ(-1, capn_frame_size(&log[0], sz));
+}
+
+TEST(Scan, Parallel) {
+  std::vector<uint64_t> log;
+  int64_t sum = 0;
+  for (int i = 0; i < 1000; i++) {
+    appendMessage(&log, i, i % 7 == 0 ? 600 : i % 5);
+    sum += i;
+  }
+
+  struct capn_scan sc;
+  struct totals all;
+  memset(&sc, 0, sizeof(sc));
+  memset(&all, 0, sizeof(all));
+  all.stopat = -1;
+  sc.threads = 4;
+  sc.chunk = 1024;
+  sc.init = &initTotals;
+  sc.message = &addMessage;
+  sc.reduce = &reduceTotals;
+  sc.arg = &all;
+  EXPECT_EQ(1000, capn_scan_mem(&sc, &log[0], log.size() * 8));
+  EXPECT_EQ(1000, all.messages);
+  EXPECT_EQ(sum, all.sum);
+  EXPECT_EQ(4, all.states);
+
+  /* through a file mapping, one thread per CPU */
+  FILE *fp = tmpfile();
+  ASSERT_NE((FILE*) NULL, fp);
+  ASSERT_EQ(log.size(), fwrite(&log[0], 8, log.size(), fp));
+  fflush(fp);
+  memset(&all, 0, sizeof(all));
+  all.stopat = -1;
+  sc.threads = 0;
+  EXPECT_EQ(1000, capn_scan_fd(&sc, fileno(fp)));
+  EXPECT_EQ(sum, all.sum);
+  fclose(fp);
+}
+
+TEST(Scan, Index) {
+  std::vector<uint64_t> log, index;
+  int64_t sum = 0;
+  for (int i = 0; i < 100; i++) {
+    uint64_t off = appendMessage(&log, i, i % 3);
+    if (i % 10 == 0)
+      index.push_back(off);
+    if (i >= 10)
+      sum += i;
+  }
+
+  /* start from the second entry, with one range per entry */
+  struct capn_scan sc;
+  struct totals all;
+  memset(&sc, 0, sizeof(sc));
+  memset(&all, 0, sizeof(all));
+  all.stopat = -1;
+  sc.threads = 3;
+  sc.chunk = 1;
+  sc.index = &index[1];
+  sc.nindex = index.size() - 1;
+  sc.init = &initTotals;
+  sc.message = &addMessage;
+  sc.reduce = &reduceTotals;
+  sc.arg = &all;
+  EXPECT_EQ(90, capn_scan_mem(&sc, &log[0], log.size() * 8));
+  EXPECT_EQ(sum, all.sum);
+
+  /* an offset that is not on a message boundary */
+  index[5] += 8;
+  memset(&all, 0, sizeof(all));
+  all.stopat = -1;
+  EXPECT_EQ(-1, capn_scan_mem(&sc, &log[0], log.size() * 8));
+  index[5] -= 8;
+
+  /* out of order */
+  std::swap(index[3], index[4]);
+  EXPECT_EQ(-1, capn_scan_mem(&sc, &log[0], log.size() * 8));
+}
+
+TEST(Scan, Errors) {
+  std::vector<uint64_t> log;
+  for (int i = 0; i < 200; i++) {
+    appendMessage(&log, i, 2);
+  }
+
+  struct capn_scan sc;
+  struct totals all;
+  memset(&sc, 0, sizeof(sc));
+  memset(&all, 0, sizeof(all));
+  sc.threads = 2;
+  sc.chunk = 512;
+  sc.init = &initTotals;
+  sc.message = &addMessage;
+  sc.reduce = &reduceTotals;
+  sc.arg = &all;
+
+  /* message stops the scan, reduce still sees every state */
+  all.stopat = 150;
+  EXPECT_EQ(-1, capn_scan_mem(&sc, &log[0], log.size() * 8));
+  EXPECT_EQ(2, all.states);
+  EXPECT_GT(200, all.messages);
+
+  /* truncated log */
+  memset(&all, 0, sizeof(all));
+  all.stopat = -1;
+  EXPECT_EQ(-1, capn_scan_mem(&sc, &log[0], log.size() * 8 - 8));
+
+  /* misaligned */
+  EXPECT_EQ(-1, capn_scan_mem(&sc, (char*) &log[0] + 4, 64));
+
+  /* empty log */
+  memset(&all, 0, sizeof(all));
+  EXPECT_EQ(0, capn_scan_mem(&sc, &log[0], 0));
+  EXPECT_EQ(1, all.states);
+}
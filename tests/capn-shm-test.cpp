@@ -0,0 +1,156 @@
+/* capn-shm-test.cpp
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstring>
+
+#include "capnp_c.h"
+
+class ShmRegion {
+public:
+  ShmRegion() {EXPECT_EQ(0, capn_shm_create(&shm, NULL, 1 << 20));}
+  ~ShmRegion() {capn_shm_close(&shm);}
+  struct capn_shm shm;
+};
+
+static capn_ptr buildMessage(struct capn *c, int listlen) {
+  capn_ptr root = capn_root(c);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 2);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, UINT64_C(0x1011121314151617)));
+
+  capn_text text = {5, "hello", NULL};
+  EXPECT_EQ(0, capn_set_text(ptr, 0, text));
+
+  capn_list64 list = capn_new_list64(ptr.seg, listlen);
+  for (int i = 0; i < listlen; i++) {
+    EXPECT_EQ(0, capn_set64(list, i, i));
+  }
+  EXPECT_EQ(0, capn_setp(ptr, 1, list.p));
+  return ptr;
+}
+
+static void checkMessage(struct capn *c, int listlen) {
+  capn_ptr ptr = capn_getp(capn_root(c), 0, 1);
+  ASSERT_EQ(CAPN_STRUCT, ptr.type);
+  EXPECT_EQ(UINT64_C(0x1011121314151617), capn_read64(ptr, 0));
+
+  capn_text def = {0, "", NULL};
+  capn_text text = capn_get_text(ptr, 0, def);
+  EXPECT_EQ(5, text.len);
+  EXPECT_STREQ("hello", text.str);
+
+  capn_list64 list;
+  list.p = capn_getp(ptr, 1, 1);
+  ASSERT_EQ(listlen, list.p.len);
+  for (int i = 0; i < listlen; i++) {
+    EXPECT_EQ((uint64_t) i, capn_get64(list, i));
+  }
+}
+
+TEST(Shm, PublishAttach) {
+  ShmRegion r;
+  struct capn builder, reader;
+
+  capn_init_shm(&builder, &r.shm);
+  buildMessage(&builder, 4);
+  ASSERT_EQ(1, builder.segnum);
+
+  int64_t desc = capn_shm_publish(&builder);
+  ASSERT_GT(desc, 0);
+
+  ASSERT_EQ(0, capn_init_shm_desc(&reader, &r.shm, desc));
+  EXPECT_EQ(1, reader.segnum);
+  /* zero copy: the reader sees the builder's segment data */
+  EXPECT_EQ(builder.seglist->data, reader.seglist->data);
+  EXPECT_EQ(builder.seglist->len, reader.seglist->len);
+
+  /* the reader keeps the data alive after the builder is done */
+  capn_shm_free(&builder);
+  checkMessage(&reader, 4);
+  capn_shm_free(&reader);
+}
+
+TEST(Shm, MultipleSegments) {
+  ShmRegion r;
+  struct capn builder, reader;
+
+  capn_init_shm(&builder, &r.shm);
+  buildMessage(&builder, 1024);
+  EXPECT_LT(1, builder.segnum);
+
+  int64_t desc = capn_shm_publish(&builder);
+  ASSERT_GT(desc, 0);
+  ASSERT_EQ(0, capn_init_shm_desc(&reader, &r.shm, desc));
+  EXPECT_EQ(builder.segnum, reader.segnum);
+  checkMessage(&reader, 1024);
+
+  capn_shm_free(&reader);
+  capn_shm_free(&builder);
+}
+
+TEST(Shm, Reclaim) {
+  ShmRegion r;
+  struct capn builder, reader;
+  char *data;
+
+  capn_init_shm(&builder, &r.shm);
+  buildMessage(&builder, 4);
+  data = builder.seglist->data;
+  int64_t desc = capn_shm_publish(&builder);
+  ASSERT_EQ(0, capn_init_shm_desc(&reader, &r.shm, desc));
+  capn_shm_free(&builder);
+
+  /* still referenced by the reader */
+  capn_init_shm(&builder, &r.shm);
+  capn_root(&builder);
+  EXPECT_NE(data, builder.seglist->data);
+  capn_shm_free(&builder);
+
+  capn_shm_free(&reader);
+
+  /* now free, so the block is reused and zeroed */
+  capn_init_shm(&builder, &r.shm);
+  capn_root(&builder);
+  EXPECT_EQ(data, builder.seglist->data);
+  EXPECT_EQ(0, capn_getp(capn_root(&builder), 0, 1).type);
+  capn_shm_free(&builder);
+}
+
+TEST(Shm, Exhausted) {
+  struct capn_shm shm;
+  struct capn c;
+  ASSERT_EQ(0, capn_shm_create(&shm, NULL, 16384));
+
+  capn_init_shm(&c, &shm);
+  capn_ptr root = capn_root(&c);
+  ASSERT_EQ(CAPN_PTR_LIST, root.type);
+  capn_list64 list = capn_new_list64(root.seg, 4096);
+  EXPECT_EQ(CAPN_NULL, list.p.type);
+  capn_shm_free(&c);
+
+  capn_shm_close(&shm);
+}
+
+TEST(Shm, BadDescriptor) {
+  ShmRegion r;
+  struct capn c;
+  EXPECT_EQ(-1, capn_init_shm_desc(&c, &r.shm, -1));
+  EXPECT_EQ(-1, capn_init_shm_desc(&c, &r.shm, 0));
+  EXPECT_EQ(-1, capn_init_shm_desc(&c, &r.shm, r.shm.size));
+
+  /* a real descriptor, off by a few bytes */
+  struct capn builder;
+  capn_init_shm(&builder, &r.shm);
+  buildMessage(&builder, 4);
+  int64_t desc = capn_shm_publish(&builder);
+  ASSERT_LT(0, desc);
+  EXPECT_EQ(-1, capn_init_shm_desc(&c, &r.shm, desc + 4));
+  ASSERT_EQ(0, capn_init_shm_desc(&c, &r.shm, desc));
+  capn_shm_free(&c);
+  capn_shm_free(&builder);
+}
@@ -336,3 +336,46 @@ TEST(Stream, WriteThreeSegmentsPacked) {
   capn_free(&ctx1);
   capn_free(&ctx2);
 }
+
+TEST(Stream, DeflateSmallOutput) {
+  AlignedData<64> in, out;
+  uint8_t packed[1024];
+  size_t whole;
+
+  for (int i = 0; i < 64 * 8; i++)
+    in.bytes[i] = (i % 40 < 32) ? 1 + i % 251 : 0;
+
+  struct capn_stream z;
+  memset(&z, 0, sizeof(z));
+  z.next_in = in.bytes;
+  z.avail_in = sizeof(in.bytes);
+  z.next_out = packed;
+  z.avail_out = sizeof(packed);
+  ASSERT_EQ(0, capn_deflate(&z));
+  whole = sizeof(packed) - z.avail_out;
+
+  /* resume through an output buffer that fills up mid raw run */
+  uint8_t chunked[1024];
+  size_t done = 0;
+  int ret;
+  memset(&z, 0, sizeof(z));
+  z.next_in = in.bytes;
+  z.avail_in = sizeof(in.bytes);
+  do {
+    z.next_out = chunked + done;
+    z.avail_out = 13;
+    ret = capn_deflate(&z);
+    ASSERT_TRUE(ret == 0 || ret == CAPN_NEED_MORE);
+    done += 13 - z.avail_out;
+  } while (ret == CAPN_NEED_MORE);
+  ASSERT_EQ(whole, done);
+  EXPECT_EQ(0, memcmp(packed, chunked, whole));
+
+  memset(&z, 0, sizeof(z));
+  z.next_in = chunked;
+  z.avail_in = done;
+  z.next_out = out.bytes;
+  z.avail_out = sizeof(out.bytes);
+  ASSERT_EQ(0, capn_inflate(&z));
+  EXPECT_EQ(0, memcmp(in.bytes, out.bytes, sizeof(in.bytes)));
+}
@@ -7,10 +7,12 @@
  */
 
 #include <gtest/gtest.h>
+#include <vector>
 #include <cstdint>
 
 static int g_AddTag = 1;
 #define ADD_TAG g_AddTag
+#define CAPN_STATS
 
 #include "capn.c"
 #include "capn-malloc.c"
@@ -447,8 +449,891 @@ TEST(WireFormat, CopyStruct) {
   checkStruct(&ctx2.capn);
 }
 
+struct CountingAllocator {
+  struct capn_allocator a;
+  int allocs, frees;
+};
+
+static void *CountAlloc(void *u, size_t sz) {
+  ((CountingAllocator*) u)->allocs++;
+  return malloc(sz);
+}
+
+static void *CountRealloc(void *u, void *p, size_t sz) {
+  if (!p) ((CountingAllocator*) u)->allocs++;
+  return realloc(p, sz);
+}
+
+static void CountFree(void *u, void *p) {
+  ((CountingAllocator*) u)->frees++;
+  free(p);
+}
+
+static void initCounting(CountingAllocator *ca) {
+  ca->a.alloc = &CountAlloc;
+  ca->a.realloc = &CountRealloc;
+  ca->a.free = &CountFree;
+  ca->a.user = ca;
+  ca->allocs = ca->frees = 0;
+}
+
+TEST(Allocator, BuildAndFree) {
+  CountingAllocator ca;
+  initCounting(&ca);
+
+  struct capn c;
+  capn_init_alloc(&c, &ca.a);
+  capn_ptr root = capn_root(&c);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 2);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  /* larger than a single 4096 byte segment */
+  capn_list64 list = capn_new_list64(ptr.seg, 1024);
+  ASSERT_EQ(CAPN_LIST, list.p.type);
+  EXPECT_EQ(0, capn_setp(ptr, 0, list.p));
+  EXPECT_LT(1, c.segnum);
+  EXPECT_EQ((int) c.segnum, ca.allocs);
+
+  uint8_t buf[16384];
+  int sz = capn_write_mem(&c, buf, sizeof(buf), 0);
+  ASSERT_LT(0, sz);
+  capn_free(&c);
+  EXPECT_EQ(ca.allocs, ca.frees);
+
+  initCounting(&ca);
+  ASSERT_EQ(0, capn_init_mem_alloc(&c, buf, sz, 0, &ca.a));
+  EXPECT_EQ(1, ca.allocs);
+  ptr = capn_getp(capn_root(&c), 0, 1);
+  ASSERT_EQ(CAPN_STRUCT, ptr.type);
+  list.p = capn_getp(ptr, 0, 1);
+  EXPECT_EQ(1024, list.p.len);
+  capn_free(&c);
+  EXPECT_EQ(1, ca.frees);
+}
+
+TEST(Allocator, UserFreeWithMalloc) {
+  /* without an allocator c->user is not looked at */
+  int cookie = 0;
+  struct capn c;
+  capn_init_malloc(&c);
+  c.user = &cookie;
+  capn_ptr root = capn_root(&c);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 1);
+  EXPECT_EQ(0, capn_setp(root, 0, ptr));
+  capn_list64 list = capn_new_list64(ptr.seg, 1024);
+  ASSERT_EQ(CAPN_LIST, list.p.type);
+  EXPECT_EQ(0, capn_setp(ptr, 0, list.p));
+  EXPECT_LT(1, c.segnum);
+  EXPECT_EQ(0, cookie);
+
+  struct capn dst;
+  ASSERT_EQ(0, capn_clone(&dst, &c, 0));
+  EXPECT_EQ(c.segnum, dst.segnum);
+  capn_free(&dst);
+  capn_free(&c);
+}
+
+TEST(Stats, Counters) {
+  Session ctx;
+  ctx.capn.create = &CreateSmallSegment;
+  struct capn_stats st;
+
+  setupStruct(&ctx.capn);
+  capn_stats_get(&ctx.capn, &st);
+  EXPECT_EQ(16u, st.segments);
+  EXPECT_LT(0u, st.far_ptrs);
+  EXPECT_EQ(st.far_ptrs, st.tag_reuse);
+  EXPECT_EQ(0u, st.double_far_ptrs);
+  EXPECT_EQ(0u, st.copies);
+  EXPECT_EQ(st.cap, st.len);
+
+  capn_stats_reset(&ctx.capn);
+  checkStruct(&ctx.capn);
+  capn_stats_get(&ctx.capn, &st);
+  EXPECT_EQ(0u, st.segments);
+  EXPECT_LT(0u, st.far_reads);
+  EXPECT_EQ(0u, st.double_far_reads);
+}
+
+TEST(Stats, DoubleFar) {
+  Session ctx;
+  ctx.capn.create = &CreateSmallSegment;
+  struct capn_stats st;
+
+  g_AddTag = 0;
+  setupStruct(&ctx.capn);
+  g_AddTag = 1;
+
+  checkStruct(&ctx.capn);
+  capn_stats_get(&ctx.capn, &st);
+  EXPECT_LT(0u, st.double_far_ptrs);
+  EXPECT_EQ(0u, st.tag_reuse);
+  EXPECT_LT(0u, st.double_far_reads);
+}
+
+TEST(Stats, Copies) {
+  Session ctx1, ctx2;
+  struct capn_stats st;
+  setupStruct(&ctx1.capn);
+
+  capn_ptr root = capn_root(&ctx2.capn);
+  EXPECT_EQ(0, capn_setp(root, 0, capn_getp(capn_root(&ctx1.capn), 0, 1)));
+
+  capn_stats_get(&ctx2.capn, &st);
+  EXPECT_EQ(1u, st.segments);
+  EXPECT_LT(1u, st.copies);
+  EXPECT_LT(st.copies, st.copy_bytes);
+  EXPECT_LT(st.len, st.cap);
+  EXPECT_EQ(st.cap, st.seg_bytes);
+}
+
+static int buildTexts(struct capn *c, capn_ptr *list, int n) {
+  char buf[32];
+  capn_ptr root = capn_root(c);
+  *list = capn_new_ptr_list(root.seg, n);
+  EXPECT_EQ(0, capn_setp(root, 0, *list));
+  for (int i = 0; i < n; i++) {
+    capn_text t = {0, buf, NULL};
+    t.len = snprintf(buf, sizeof(buf), "host-%d.example.com", i % 40);
+    EXPECT_EQ(0, capn_set_text(*list, i, t));
+  }
+  return capn_size(c);
+}
+
+TEST(Intern, SharedStrings) {
+  CountingAllocator ca;
+  initCounting(&ca);
+  struct capn c;
+  capn_ptr list;
+  capn_text def = {0, NULL, NULL};
+
+  capn_init_malloc(&c);
+  int plain = buildTexts(&c, &list, 200);
+  capn_free(&c);
+
+  capn_init_alloc(&c, &ca.a);
+  ASSERT_EQ(0, capn_intern_enable(&c, 0));
+  int interned = buildTexts(&c, &list, 200);
+  EXPECT_LT(interned, plain);
+  struct capn_stats st;
+  capn_stats_get(&c, &st);
+  EXPECT_EQ(160u, st.intern_hits);
+  EXPECT_EQ(160u * 24, st.intern_bytes);
+
+  for (int i = 0; i < 200; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "host-%d.example.com", i % 40);
+    capn_text t = capn_get_text(list, i, def);
+    EXPECT_STREQ(buf, t.str);
+    if (i >= 40) {
+      EXPECT_EQ(capn_get_text(list, i % 40, def).str, t.str);
+    }
+  }
+
+  /* the aliased pointers survive a round trip */
+  uint8_t buf[16384];
+  int64_t sz = capn_write_mem(&c, buf, sizeof(buf), 0);
+  ASSERT_EQ(interned, sz);
+  capn_free(&c);
+  EXPECT_EQ(ca.allocs, ca.frees);
+
+  ASSERT_EQ(0, capn_init_mem(&c, buf, sz, 0));
+  list = capn_getp(capn_root(&c), 0, 1);
+  EXPECT_EQ(200, list.len);
+  EXPECT_STREQ("host-39.example.com", capn_get_text(list, 199, def).str);
+  EXPECT_EQ(capn_get_text(list, 0, def).str, capn_get_text(list, 120, def).str);
+  capn_free(&c);
+}
+
+TEST(Intern, Disable) {
+  struct capn c;
+  capn_text def = {0, NULL, NULL};
+  capn_init_malloc(&c);
+  ASSERT_EQ(0, capn_intern_enable(&c, 8));
+  capn_ptr list = capn_new_ptr_list(capn_root(&c).seg, 3);
+  capn_text t = {3, "abc", NULL};
+  EXPECT_EQ(0, capn_set_text(list, 0, t));
+  EXPECT_EQ(0, capn_set_text(list, 1, t));
+  capn_intern_disable(&c);
+  EXPECT_EQ(0, capn_set_text(list, 2, t));
+  EXPECT_EQ(capn_get_text(list, 0, def).str, capn_get_text(list, 1, def).str);
+  EXPECT_NE(capn_get_text(list, 0, def).str, capn_get_text(list, 2, def).str);
+  capn_free(&c);
+}
+
+static std::vector<uint8_t> writeToFile(struct capn *c, int packed) {
+  FILE *fp = tmpfile();
+  EXPECT_TRUE(fp != NULL);
+  int sz = capn_write_fd(c, &write, fileno(fp), packed);
+  EXPECT_LT(0, sz);
+  std::vector<uint8_t> buf(sz);
+  rewind(fp);
+  EXPECT_EQ((size_t) sz, fread(buf.data(), 1, sz, fp));
+  fclose(fp);
+  return buf;
+}
+
+TEST(Attach, DataAndText) {
+  std::vector<uint8_t> blob(100003);
+  for (size_t i = 0; i < blob.size(); i++)
+    blob[i] = (uint8_t) (i * 7 + i / 1000);
+  static const char name[] = "attached text";
+
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr root = capn_root(&c);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  capn_write64(ptr, 0, 42);
+
+  capn_data d = capn_attach_data(&c, blob.data(), blob.size());
+  ASSERT_EQ(CAPN_LIST, d.p.type);
+  EXPECT_EQ((const char*) blob.data(), d.p.data);
+  capn_text t = capn_attach_text(&c, name, strlen(name));
+  ASSERT_TRUE(t.seg != NULL);
+  EXPECT_EQ(0, capn_setp(ptr, 0, d.p));
+  EXPECT_EQ(0, capn_set_text(ptr, 1, t));
+  EXPECT_EQ(3u, c.segnum);
+
+  /* the blob is referenced, not copied */
+  capn_data got = capn_get_data(ptr, 0);
+  EXPECT_EQ((const char*) blob.data(), got.p.data);
+
+  int sz = capn_size(&c);
+  std::vector<uint8_t> mem(sz);
+  ASSERT_EQ(sz, capn_write_mem(&c, mem.data(), sz, 0));
+  EXPECT_EQ(0, sz % 8);
+
+  std::vector<uint8_t> unpacked = writeToFile(&c, 0);
+  std::vector<uint8_t> packed = writeToFile(&c, 1);
+  EXPECT_TRUE(mem == unpacked);
+  std::vector<uint8_t> packed_mem(2 * sz);
+  int64_t psz = capn_write_mem(&c, packed_mem.data(), packed_mem.size(), 1);
+  ASSERT_EQ((int64_t) packed.size(), psz);
+  EXPECT_EQ(0, memcmp(packed.data(), packed_mem.data(), psz));
+  capn_free(&c);
+
+  for (int p = 0; p < 2; p++) {
+    std::vector<uint8_t> &in = p ? packed : unpacked;
+    struct capn c2;
+    capn_text def = {0, NULL, NULL};
+    ASSERT_EQ(0, capn_init_mem(&c2, in.data(), in.size(), p));
+    capn_ptr r = capn_getp(capn_root(&c2), 0, 1);
+    EXPECT_EQ(42u, capn_read64(r, 0));
+    got = capn_get_data(r, 0);
+    ASSERT_EQ((int) blob.size(), got.p.len);
+    EXPECT_EQ(0, memcmp(blob.data(), got.p.data, blob.size()));
+    EXPECT_STREQ(name, capn_get_text(r, 1, def).str);
+    capn_free(&c2);
+  }
+}
+
+TEST(Attach, Errors) {
+  struct capn c;
+  char buf[8] = "abcdefg";
+  capn_init_malloc(&c);
+  /* text must be terminated */
+  EXPECT_TRUE(capn_attach_text(&c, buf, 3).seg == NULL);
+  EXPECT_EQ(CAPN_NULL, capn_attach_data(&c, buf, 1u << 29).p.type);
+  capn_free(&c);
+}
+
+TEST(Template, CloneAndPatch) {
+  Session proto;
+  proto.capn.create = &CreateSmallSegment;
+  setupStruct(&proto.capn);
+  ASSERT_EQ(16u, proto.capn.segnum);
+
+  struct capn_template t;
+  ASSERT_EQ(0, capn_template_init(&t, &proto.capn));
+  capn_ptr protoRoot = capn_getp(capn_root(&proto.capn), 0, 1);
+  capn_ptr protoSub = capn_getp(protoRoot, 0, 1);
+
+  CountingAllocator ca;
+  initCounting(&ca);
+  for (int i = 0; i < 3; i++) {
+    struct capn c;
+    ASSERT_EQ(0, capn_clone_template(&c, &t, &ca.a));
+    EXPECT_EQ(16u, c.segnum);
+    checkStruct(&c);
+
+    capn_ptr root = capn_template_ptr(&c, protoRoot);
+    EXPECT_EQ(CAPN_STRUCT, root.type);
+    EXPECT_EQ(capn_getp(capn_root(&c), 0, 1).data, root.data);
+    EXPECT_EQ(0, capn_write64(root, 0, i));
+    capn_ptr sub = capn_template_ptr(&c, protoSub);
+    EXPECT_EQ(capn_getp(root, 0, 1).data, sub.data);
+    EXPECT_EQ(0, capn_write32(sub, 0, 100 + i));
+
+    /* the clone can keep growing */
+    EXPECT_EQ(0, capn_setp(root, 5, capn_new_string(root.seg, "more", 4)));
+    EXPECT_EQ(17u, c.segnum);
+
+    uint8_t buf[4096];
+    int64_t sz = capn_write_mem(&c, buf, sizeof(buf), 0);
+    ASSERT_LT(0, sz);
+    capn_free(&c);
+
+    ASSERT_EQ(0, capn_init_mem(&c, buf, sz, 0));
+    root = capn_getp(capn_root(&c), 0, 1);
+    EXPECT_EQ((uint64_t) i, capn_read64(root, 0));
+    EXPECT_EQ((uint32_t) (100 + i), capn_read32(capn_getp(root, 0, 1), 0));
+    capn_free(&c);
+  }
+  EXPECT_EQ(6, ca.allocs);
+  EXPECT_EQ(ca.allocs, ca.frees);
+
+  /* the prototype is untouched */
+  checkStruct(&proto.capn);
+}
+
+TEST(Clone, Segments) {
+  Session src;
+  src.capn.create = &CreateSmallSegment;
+  setupStruct(&src.capn);
+  ASSERT_EQ(16u, src.capn.segnum);
+
+  for (int coalesce = 0; coalesce < 2; coalesce++) {
+    struct capn c;
+    ASSERT_EQ(0, capn_clone(&c, &src.capn, coalesce));
+    EXPECT_EQ(16u, c.segnum);
+    checkStruct(&c);
+
+    capn_ptr root = capn_getp(capn_root(&c), 0, 1);
+    EXPECT_EQ(0, capn_write64(root, 0, 1));
+    EXPECT_EQ(0, capn_setp(root, 5, capn_new_string(root.seg, "more", 4)));
+    /* only the separately allocated segments have room to grow */
+    EXPECT_EQ(coalesce ? 17u : 16u, c.segnum);
+    capn_free(&c);
+  }
+
+  checkStruct(&src.capn);
+}
+
+TEST(Clone, Allocator) {
+  CountingAllocator ca;
+  initCounting(&ca);
+  struct capn src, c;
+  capn_init_alloc(&src, &ca.a);
+  setupStruct(&src);
+  int srcAllocs = ca.allocs;
+
+  ASSERT_EQ(0, capn_clone(&c, &src, 1));
+  EXPECT_EQ(srcAllocs + 1, ca.allocs);
+  EXPECT_EQ(src.segnum, c.segnum);
+  checkStruct(&c);
+  capn_free(&c);
+  capn_free(&src);
+  EXPECT_EQ(ca.allocs, ca.frees);
+
+  struct capn empty;
+  capn_init_malloc(&empty);
+  EXPECT_EQ(-1, capn_clone(&c, &empty, 0));
+  EXPECT_EQ(0u, c.segnum);
+}
+
+TEST(ListBuilder, InPlace) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  struct capn_list_builder b;
+  ASSERT_EQ(0, capn_list_begin(&b, root.seg, 4, 0, 2));
+  char *data = b.p.data;
+
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(0, capn_list_append32(&b, i * 3));
+  }
+  /* nothing else was allocated, so the list never moved */
+  EXPECT_EQ(data, b.p.data);
+  EXPECT_EQ(1u, s.capn.segnum);
+
+  capn_list32 l;
+  l.p = capn_list_finish(&b);
+  EXPECT_EQ(1000, l.p.len);
+  EXPECT_EQ(8 + 4000, root.seg->len);
+  ASSERT_EQ(0, capn_setp(root, 0, l.p));
+
+  std::vector<uint8_t> mem(capn_size(&s.capn));
+  ASSERT_EQ((int64_t) mem.size(), capn_write_mem(&s.capn, mem.data(), mem.size(), 0));
+  struct capn c2;
+  ASSERT_EQ(0, capn_init_mem(&c2, mem.data(), mem.size(), 0));
+  l.p = capn_getp(capn_root(&c2), 0, 1);
+  ASSERT_EQ(1000, capn_len(l));
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ((uint32_t) (i * 3), capn_get32(l, i));
+  }
+  capn_free(&c2);
+}
+
+TEST(ListBuilder, Relocate) {
+  Session s;
+  s.capn.create = &CreateSmallSegment;
+  capn_ptr root = capn_root(&s.capn);
+  struct capn_list_builder b;
+  ASSERT_EQ(0, capn_list_begin(&b, root.seg, 16, 1, 1));
+
+  for (int i = 0; i < 20; i++) {
+    char name[16];
+    int n = sprintf(name, "element %d", i);
+    int j = capn_list_grow(&b, 1);
+    ASSERT_EQ(i, j);
+    capn_ptr e = capn_getp(b.p, j, 0);
+    EXPECT_EQ(0, capn_write64(e, 0, i));
+    EXPECT_EQ(0, capn_write64(e, 8, ~(uint64_t) i));
+    /* the string lands after the list, so the next append moves it */
+    EXPECT_EQ(0, capn_setp(e, 0, capn_new_string(e.seg, name, n)));
+  }
+
+  capn_ptr l = capn_list_finish(&b);
+  ASSERT_EQ(20, l.len);
+  ASSERT_EQ(0, capn_setp(root, 0, l));
+
+  std::vector<uint8_t> mem(capn_size(&s.capn));
+  ASSERT_EQ((int64_t) mem.size(), capn_write_mem(&s.capn, mem.data(), mem.size(), 0));
+  struct capn c2;
+  ASSERT_EQ(0, capn_init_mem(&c2, mem.data(), mem.size(), 0));
+  l = capn_getp(capn_root(&c2), 0, 1);
+  ASSERT_EQ(CAPN_LIST, l.type);
+  ASSERT_EQ(20, l.len);
+  for (int i = 0; i < 20; i++) {
+    char name[16];
+    capn_text def = {0, NULL, NULL};
+    sprintf(name, "element %d", i);
+    capn_ptr e = capn_getp(l, i, 0);
+    EXPECT_EQ((uint64_t) i, capn_read64(e, 0));
+    EXPECT_EQ(~(uint64_t) i, capn_read64(e, 8));
+    EXPECT_STREQ(name, capn_get_text(e, 0, def).str);
+  }
+  capn_free(&c2);
+}
+
+TEST(ListBuilder, BitAndPointerLists) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr outer = capn_new_struct(root.seg, 0, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, outer));
+
+  struct capn_list_builder bits, ptrs;
+  ASSERT_EQ(0, capn_list_begin1(&bits, root.seg, 0));
+  for (int i = 0; i < 200; i++) {
+    ASSERT_EQ(0, capn_list_append1(&bits, i % 3 == 0));
+  }
+  ASSERT_EQ(0, capn_list_begin_ptr(&ptrs, root.seg, 0));
+  for (int i = 0; i < 50; i++) {
+    char name[16];
+    int n = sprintf(name, "%d", i);
+    ASSERT_EQ(0, capn_list_append_ptr(&ptrs, capn_new_string(root.seg, name, n)));
+  }
+  EXPECT_EQ(0, capn_setp(outer, 0, capn_list_finish(&bits)));
+  EXPECT_EQ(0, capn_setp(outer, 1, capn_list_finish(&ptrs)));
+
+  /* an empty list finishes to a valid empty list */
+  struct capn_list_builder empty;
+  ASSERT_EQ(0, capn_list_begin(&empty, root.seg, 8, 0, 0));
+  capn_ptr e = capn_list_finish(&empty);
+  EXPECT_EQ(CAPN_LIST, e.type);
+  EXPECT_EQ(0, e.len);
+
+  std::vector<uint8_t> mem(2 * capn_size(&s.capn));
+  int64_t sz = capn_write_mem(&s.capn, mem.data(), mem.size(), 1);
+  ASSERT_GT(sz, 0);
+  struct capn c2;
+  ASSERT_EQ(0, capn_init_mem(&c2, mem.data(), sz, 1));
+  capn_ptr r = capn_getp(capn_root(&c2), 0, 1);
+  capn_list1 l1;
+  l1.p = capn_getp(r, 0, 1);
+  ASSERT_EQ(200, capn_len(l1));
+  for (int i = 0; i < 200; i++) {
+    EXPECT_EQ(i % 3 == 0, capn_get1(l1, i));
+  }
+  capn_ptr lp = capn_getp(r, 1, 1);
+  ASSERT_EQ(50, lp.len);
+  for (int i = 0; i < 50; i++) {
+    char name[16];
+    capn_ptr t = capn_getp(lp, i, 1);
+    sprintf(name, "%d", i);
+    EXPECT_STREQ(name, t.data);
+  }
+  capn_free(&c2);
+}
+
+TEST(ListBuilder, Errors) {
+  struct capn_list_builder b;
+  EXPECT_EQ(-1, capn_list_begin(&b, NULL, 8, 0, 4));
+  EXPECT_EQ(-1, capn_list_grow(&b, 1));
+  EXPECT_EQ(CAPN_NULL, capn_list_finish(&b).type);
+}
+
+static int CompareKey(capn_ptr a, capn_ptr b, void *arg) {
+  uint64_t x = capn_read64(a, 0), y = capn_read64(b, 0);
+  (void) arg;
+  return (x > y) - (x < y);
+}
+
+static int FindKey(capn_ptr e, const void *k) {
+  uint64_t x = capn_read64(e, 0), y = *(const uint64_t*) k;
+  return (x > y) - (x < y);
+}
+
+TEST(ListSort, MovesPointers) {
+  Session s;
+  s.capn.create = &CreateSmallSegment;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr l = capn_new_list(root.seg, 100, 16, 2);
+  ASSERT_EQ(CAPN_LIST, l.type);
+  ASSERT_EQ(0, capn_setp(root, 0, l));
+
+  for (int i = 0; i < 100; i++) {
+    char name[16];
+    int n = sprintf(name, "key %d", (i * 37) % 100);
+    capn_ptr e = capn_getp(l, i, 0);
+    EXPECT_EQ(0, capn_write64(e, 0, (i * 37) % 100));
+    EXPECT_EQ(0, capn_write64(e, 8, i));
+    /* the small segments fill up, so later strings are behind far pointers */
+    EXPECT_EQ(0, capn_setp(e, 0, capn_new_string(e.seg, name, n)));
+  }
+
+  ASSERT_EQ(0, capn_list_sort(l, CompareKey, NULL));
+
+  std::vector<uint8_t> mem(capn_size(&s.capn));
+  ASSERT_EQ((int64_t) mem.size(), capn_write_mem(&s.capn, mem.data(), mem.size(), 0));
+  struct capn c2;
+  ASSERT_EQ(0, capn_init_mem(&c2, mem.data(), mem.size(), 0));
+  capn_ptr l2 = capn_getp(capn_root(&c2), 0, 1);
+  ASSERT_EQ(100, l2.len);
+  for (int i = 0; i < 100; i++) {
+    char name[16];
+    capn_text def = {0, NULL, NULL};
+    sprintf(name, "key %d", i);
+    capn_ptr e = capn_getp(l2, i, 0);
+    EXPECT_EQ((uint64_t) i, capn_read64(e, 0));
+    EXPECT_EQ((uint64_t) ((i * 73) % 100), capn_read64(e, 8));
+    EXPECT_STREQ(name, capn_get_text(e, 0, def).str);
+    EXPECT_EQ(CAPN_NULL, capn_getp(e, 1, 1).type);
+  }
+
+  for (uint64_t k = 0; k < 100; k++) {
+    EXPECT_EQ((int) k, capn_list_find(l2, FindKey, &k));
+  }
+  uint64_t missing = 100;
+  EXPECT_EQ(-1, capn_list_find(l2, FindKey, &missing));
+  capn_free(&c2);
+}
+
+TEST(ListSort, StableAndErrors) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr l = capn_new_list(root.seg, 50, 16, 0);
+
+  for (int i = 0; i < 50; i++) {
+    capn_ptr e = capn_getp(l, i, 0);
+    EXPECT_EQ(0, capn_write64(e, 0, 4 - i % 5));
+    EXPECT_EQ(0, capn_write64(e, 8, i));
+  }
+  ASSERT_EQ(0, capn_list_sort(l, CompareKey, NULL));
+  for (int i = 0; i < 50; i++) {
+    capn_ptr e = capn_getp(l, i, 0);
+    EXPECT_EQ((uint64_t) (i / 10), capn_read64(e, 0));
+    EXPECT_EQ((uint64_t) (4 - i / 10 + 5 * (i % 10)), capn_read64(e, 8));
+  }
+
+  /* the first of equal keys is found */
+  uint64_t k = 3;
+  EXPECT_EQ(30, capn_list_find(l, FindKey, &k));
+
+  capn_ptr st = capn_new_struct(root.seg, 8, 0);
+  EXPECT_EQ(-1, capn_list_sort(st, CompareKey, NULL));
+  EXPECT_EQ(-1, capn_list_find(st, FindKey, &k));
+  capn_list1 bits = capn_new_list1(root.seg, 8);
+  EXPECT_EQ(-1, capn_list_sort(bits.p, CompareKey, NULL));
+  capn_ptr empty = {CAPN_NULL};
+  EXPECT_EQ(-1, capn_list_find(empty, FindKey, &k));
+}
+
+TEST(Text, Compare) {
+  capn_text a = {3, "abc", NULL}, b = {4, "abcd", NULL}, c = {3, "abd", NULL}, e = {0, NULL, NULL};
+  EXPECT_EQ(0, capn_cmp_text(a, a));
+  EXPECT_GT(0, capn_cmp_text(a, b));
+  EXPECT_LT(0, capn_cmp_text(b, a));
+  EXPECT_GT(0, capn_cmp_text(b, c));
+  EXPECT_GT(0, capn_cmp_text(e, a));
+  EXPECT_EQ(0, capn_cmp_text(e, e));
+}
+
+static uint32_t HashKey(capn_ptr e, void *arg) {
+  (void) arg;
+  return capn_hash64(capn_read64(e, 0));
+}
+
+static int EqualKey(capn_ptr e, const void *k) {
+  return capn_read64(e, 0) == *(const uint64_t*) k;
+}
+
+/* every key lands in bucket 0, so lookups probe past the others */
+static uint32_t CollideKey(capn_ptr e, void *arg) {
+  (void) e;
+  (void) arg;
+  return 0;
+}
+
+TEST(HashIndex, BuildFind) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr l = capn_new_list(root.seg, 300, 8, 0);
+  for (int i = 0; i < 300; i++) {
+    EXPECT_EQ(0, capn_write64(capn_getp(l, i, 0), 0, (uint64_t) i * 1000003));
+  }
+
+  capn_list32 t = capn_hash_build(root.seg, l, HashKey, NULL);
+  ASSERT_EQ(CAPN_LIST, t.p.type);
+  EXPECT_EQ(1024, t.p.len);
+  for (uint64_t i = 0; i < 300; i++) {
+    uint64_t k = i * 1000003;
+    EXPECT_EQ((int) i, capn_hash_find(t, l, capn_hash64(k), EqualKey, &k));
+  }
+  uint64_t k = 7;
+  EXPECT_EQ(-1, capn_hash_find(t, l, capn_hash64(k), EqualKey, &k));
+
+  capn_list32 c = capn_hash_build(root.seg, l, CollideKey, NULL);
+  ASSERT_EQ(CAPN_LIST, c.p.type);
+  k = 299 * 1000003;
+  EXPECT_EQ(299, capn_hash_find(c, l, 0, EqualKey, &k));
+  k = 7;
+  EXPECT_EQ(-1, capn_hash_find(c, l, 0, EqualKey, &k));
+}
+
+TEST(HashIndex, EmptyAndErrors) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr null = {CAPN_NULL};
+  uint64_t k = 0;
+
+  capn_list32 t = capn_hash_build(root.seg, null, HashKey, NULL);
+  ASSERT_EQ(CAPN_LIST, t.p.type);
+  EXPECT_EQ(1, t.p.len);
+  EXPECT_EQ(-1, capn_hash_find(t, null, 0, EqualKey, &k));
+
+  capn_ptr st = capn_new_struct(root.seg, 8, 0);
+  EXPECT_EQ(CAPN_NULL, capn_hash_build(root.seg, st, HashKey, NULL).p.type);
+
+  /* a table whose size is not a power of two is not one of ours */
+  capn_ptr l = capn_new_list(root.seg, 1, 8, 0);
+  capn_list32 bad = capn_new_list32(root.seg, 3);
+  EXPECT_EQ(0, capn_set32(bad, 0, 1));
+  EXPECT_EQ(-1, capn_hash_find(bad, l, 0, EqualKey, &k));
+
+  /* the hashes are part of the format */
+  capn_text abc = {3, "abc", NULL};
+  EXPECT_EQ(0x1a47e90bu, capn_hash_text(abc));
+  EXPECT_EQ(capn_hash64(42), capn_hash64(42));
+  EXPECT_NE(capn_hash64(42), capn_hash64(43));
+}
+
+TEST(Savepoint, Rollback) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  EXPECT_EQ(0, capn_write64(ptr, 0, 7));
+  ASSERT_EQ(0, capn_intern_enable(&s.capn, 0));
+  EXPECT_EQ(0, capn_set_text(ptr, 0, (capn_text) {3, "old", NULL}));
+
+  std::vector<uint8_t> before(capn_size(&s.capn));
+  ASSERT_EQ((int64_t) before.size(), capn_write_mem(&s.capn, before.data(), before.size(), 0));
+
+  struct capn_savepoint sp;
+  ASSERT_EQ(0, capn_savepoint(&s.capn, &sp));
+  for (int attempt = 0; attempt < 3; attempt++) {
+    /* build a subtree big enough to spill into new segments */
+    capn_ptr sub = capn_new_struct(root.seg, 8, 1);
+    capn_ptr list = capn_new_list(sub.seg, 2000, 16, 0);
+    ASSERT_EQ(CAPN_LIST, list.type);
+    EXPECT_EQ(0, capn_setp(sub, 0, list));
+    capn_ptr str = capn_new_string(root.seg, "speculative", -1);
+    ASSERT_EQ(CAPN_LIST, str.type);
+    EXPECT_GT(s.capn.segnum, 1u);
+
+    ASSERT_EQ(0, capn_rollback(&s.capn, &sp));
+    EXPECT_EQ(1u, s.capn.segnum);
+    EXPECT_EQ(s.capn.seglist, s.capn.lastseg);
+    EXPECT_TRUE(s.capn.seglist->next == NULL);
+
+    std::vector<uint8_t> after(capn_size(&s.capn));
+    ASSERT_EQ((int64_t) after.size(), capn_write_mem(&s.capn, after.data(), after.size(), 0));
+    EXPECT_TRUE(before == after);
+  }
+  capn_savepoint_release(&s.capn, &sp);
+
+  /* the released string is no longer interned, the older one still is */
+  capn_ptr str = capn_new_string(root.seg, "speculative", -1);
+  capn_text def = {0, NULL, NULL};
+  EXPECT_EQ(0, capn_set_text(ptr, 1, (capn_text) {3, "old", NULL}));
+  EXPECT_EQ(capn_get_text(ptr, 0, def).str, capn_get_text(ptr, 1, def).str);
+  EXPECT_STREQ("speculative", str.data);
+
+  /* new segments get ids that follow on */
+  capn_ptr big = capn_new_list(root.seg, 10000, 8, 0);
+  ASSERT_EQ(CAPN_LIST, big.type);
+  EXPECT_EQ(1u, big.seg->id);
+  EXPECT_EQ(big.seg, lookup_segment(&s.capn, NULL, 1));
+  EXPECT_EQ(7u, capn_read64(capn_getp(capn_root(&s.capn), 0, 1), 0));
+}
+
+TEST(Savepoint, ManySegments) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  /* each list needs a segment of its own */
+  for (int i = 0; i < 20; i++) {
+    capn_new_list(root.seg, 1000, 8, 0);
+  }
+  ASSERT_EQ(21u, s.capn.segnum);
+
+  struct capn_savepoint sp;
+  ASSERT_EQ(0, capn_savepoint(&s.capn, &sp));
+  for (int i = 0; i < 30; i++) {
+    capn_new_list(root.seg, 1000, 8, 0);
+  }
+  EXPECT_EQ(51u, s.capn.segnum);
+  ASSERT_EQ(0, capn_rollback(&s.capn, &sp));
+  capn_savepoint_release(&s.capn, &sp);
+  EXPECT_EQ(21u, s.capn.segnum);
+  for (uint32_t i = 0; i < 21; i++) {
+    struct capn_segment *seg = lookup_segment(&s.capn, NULL, i);
+    ASSERT_TRUE(seg != NULL);
+    EXPECT_EQ(i, seg->id);
+  }
+  EXPECT_TRUE(lookup_segment(&s.capn, NULL, 21) == NULL);
+}
+
+TEST(Savepoint, OnlyMalloc) {
+  /* rollback cannot free segments from another create function */
+  Session s;
+  s.capn.create = &CreateSmallSegment;
+  struct capn_savepoint sp;
+  EXPECT_EQ(-1, capn_savepoint(&s.capn, &sp));
+  sp.segnum = 0;
+  sp.more = NULL;
+  EXPECT_EQ(-1, capn_rollback(&s.capn, &sp));
+
+  CountingAllocator ca;
+  initCounting(&ca);
+  struct capn c;
+  capn_init_alloc(&c, &ca.a);
+  capn_root(&c);
+  EXPECT_EQ(0, capn_savepoint(&c, &sp));
+  capn_new_list(c.seglist, 1000, 8, 0);
+  EXPECT_EQ(2u, c.segnum);
+  EXPECT_EQ(0, capn_rollback(&c, &sp));
+  EXPECT_EQ(1u, c.segnum);
+  capn_free(&c);
+  EXPECT_EQ(ca.allocs, ca.frees);
+}
+
+TEST(Orphans, ReuseOverwritten) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr ptr = capn_new_struct(root.seg, 8, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  ASSERT_EQ(0, capn_orphans_enable(&s.capn));
+
+  char text[64];
+  int len = 0;
+  EXPECT_EQ(0, capn_set_text(ptr, 0, (capn_text) {9, "value ---", NULL}));
+  for (int i = 0; i < 1000; i++) {
+    int n = sprintf(text, "value %03d", i);
+    EXPECT_EQ(0, capn_set_text(ptr, 0, (capn_text) {n, text, NULL}));
+    if (i == 0)
+      len = root.seg->len;
+  }
+  /* the new string is made before the old one is unlinked, so from then
+   * on two blocks take turns */
+  EXPECT_EQ(len, root.seg->len);
+
+  struct capn_stats st;
+  capn_stats_get(&s.capn, &st);
+  EXPECT_EQ(1000u * 16, st.orphan_bytes);
+  EXPECT_EQ(999u * 16, st.orphan_reused);
+
+  /* a smaller object takes part of a bigger dead one */
+  capn_ptr big = capn_new_struct(root.seg, 64, 0);
+  EXPECT_EQ(0, capn_write64(big, 56, 99));
+  EXPECT_EQ(0, capn_setp(ptr, 1, big));
+  len = root.seg->len;
+  EXPECT_EQ(0, capn_setp(ptr, 1, capn_new_struct(root.seg, 0, 0)));
+  /* the 2 word string block left over above is too small for these */
+  capn_ptr small = capn_new_struct(root.seg, 24, 0);
+  EXPECT_EQ(big.data, small.data);
+  EXPECT_EQ(0u, capn_read64(small, 16));
+  capn_ptr rest = capn_new_list(root.seg, 5, 8, 0);
+  EXPECT_EQ(big.data + 24, rest.data);
+  EXPECT_EQ(len, root.seg->len);
+  EXPECT_EQ(0, capn_setp(ptr, 1, rest));
+
+  capn_text def = {0, NULL, NULL};
+  EXPECT_STREQ("value 999", capn_get_text(ptr, 0, def).str);
+  EXPECT_EQ(5, capn_getp(ptr, 1, 1).len);
+}
+
+TEST(Orphans, ZeroAndSkip) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr ptr = capn_new_struct(root.seg, 0, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  ASSERT_EQ(0, capn_orphans_enable(&s.capn));
+  capn_ptr nullp = {CAPN_NULL};
+
+  capn_list64 l = capn_new_list64(root.seg, 100);
+  for (int i = 0; i < 100; i++) {
+    capn_set64(l, i, 0x0123456789abcdefull);
+  }
+  EXPECT_EQ(0, capn_setp(ptr, 0, l.p));
+  /* setting the same object again does not orphan it */
+  EXPECT_EQ(0, capn_setp(ptr, 0, l.p));
+  EXPECT_EQ(0x0123456789abcdefull, capn_get64(l, 99));
+
+  /* attached blobs are never reused or zeroed */
+  static const char blob[] = "attached!";
+  capn_data d = capn_attach_data(&s.capn, blob, sizeof(blob));
+  EXPECT_EQ(0, capn_setp(ptr, 1, d.p));
+  EXPECT_EQ(0, capn_setp(ptr, 1, nullp));
+
+  std::vector<uint8_t> before(2 * capn_size(&s.capn));
+  int64_t psz = capn_write_mem(&s.capn, before.data(), before.size(), 1);
+
+  EXPECT_EQ(0, capn_setp(ptr, 0, nullp));
+  capn_zero_orphans(&s.capn);
+  EXPECT_EQ(0u, capn_get64(l, 0));
+  EXPECT_EQ(0u, capn_get64(l, 99));
+  EXPECT_STREQ("attached!", blob);
+
+  std::vector<uint8_t> after(2 * capn_size(&s.capn));
+  int64_t zsz = capn_write_mem(&s.capn, after.data(), after.size(), 1);
+  EXPECT_LT(zsz, psz - 700);
+}
+
+TEST(Orphans, InternedAfterDisable) {
+  Session s;
+  capn_ptr root = capn_root(&s.capn);
+  capn_ptr ptr = capn_new_struct(root.seg, 0, 2);
+  ASSERT_EQ(0, capn_setp(root, 0, ptr));
+  capn_text def = {0, NULL, NULL};
+
+  ASSERT_EQ(0, capn_intern_enable(&s.capn, 0));
+  EXPECT_EQ(0, capn_set_text(ptr, 0, (capn_text) {5, "hello", NULL}));
+  EXPECT_EQ(0, capn_set_text(ptr, 1, (capn_text) {5, "hello", NULL}));
+  EXPECT_EQ(capn_get_text(ptr, 0, def).str, capn_get_text(ptr, 1, def).str);
+  capn_intern_disable(&s.capn);
+
+  /* the string is still shared, so it must not be reused */
+  ASSERT_EQ(0, capn_orphans_enable(&s.capn));
+  capn_ptr nullp = {CAPN_NULL};
+  EXPECT_EQ(0, capn_setp(ptr, 0, nullp));
+  capn_list64 l = capn_new_list64(root.seg, 1);
+  capn_set64(l, 0, ~0ull);
+  EXPECT_STREQ("hello", capn_get_text(ptr, 1, def).str);
+  capn_zero_orphans(&s.capn);
+  EXPECT_STREQ("hello", capn_get_text(ptr, 1, def).str);
+}
+
 int main(int argc, char *argv[]) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }
-
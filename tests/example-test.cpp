@@ -163,3 +163,229 @@ TEST(Examples, PersonWithAccessors) {
 
   capn_free(&c);
 }
+
+// Demonstrate building a list of people whose length isn't known up front
+// with the functions generated for $C.listbuilder.
+TEST(Examples, AppendPeople) {
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr cr = capn_root(&c);
+  struct capn_segment *cs = cr.seg;
+
+  struct capn_list_builder b;
+  ASSERT_EQ(0, begin_Person_list(&b, cs, 0));
+  for (int i = 0; i < 100; i++) {
+    char name[32];
+    sprintf(name, "Person %d", i);
+    struct Person p = {
+      .id = (uint32_t) i,
+      .name = chars_to_text(name),
+    };
+    ASSERT_EQ(0, append_Person(&p, &b));
+  }
+
+  struct AddressBook ab;
+  memset(&ab, 0, sizeof(ab));
+  ab.people = finish_Person_list(&b);
+  AddressBook_ptr abp = new_AddressBook(cs);
+  write_AddressBook(&ab, abp);
+  ASSERT_EQ(0, capn_setp(cr, 0, abp.p));
+
+  struct AddressBook rab;
+  abp.p = capn_getp(capn_root(&c), 0, 1);
+  read_AddressBook(&rab, abp);
+  ASSERT_EQ(100, capn_len(rab.people));
+  for (int i = 0; i < 100; i++) {
+    char name[32];
+    struct Person rp;
+    sprintf(name, "Person %d", i);
+    get_Person(&rp, rab.people, i);
+    EXPECT_EQ((uint32_t) i, rp.id);
+    EXPECT_CAPN_TEXT_EQ(name, rp.name);
+  }
+
+  capn_free(&c);
+}
+
+// Demonstrate updating a message in place with the functions generated for
+// $C.dirtymask: only the members changed since read_Person are written back.
+TEST(Examples, DirtyWrite) {
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr cr = capn_root(&c);
+  struct capn_segment *cs = cr.seg;
+
+  struct Person p = {
+    .id = 17,
+    .name = chars_to_text("Firstname Lastname"),
+    .email = chars_to_text("username@domain.com"),
+  };
+  Person_ptr pp = new_Person(cs);
+  write_Person(&p, pp);
+  ASSERT_EQ(0, capn_setp(cr, 0, pp.p));
+
+  struct Person rp;
+  pp.p = capn_getp(capn_root(&c), 0, 1);
+  read_Person(&rp, pp);
+
+  // Nothing is dirty after a read, so no text is copied again.
+  int len = cs->len;
+  write_Person_dirty(&rp, pp);
+  EXPECT_EQ(len, cs->len);
+
+  // Changing the id only touches the data section.
+  Person_update_id(&rp, 42);
+  write_Person_dirty(&rp, pp);
+  EXPECT_EQ(len, cs->len);
+  EXPECT_EQ(42u, Person_get_id(pp));
+
+  // A new email is written, the name is left alone.
+  Person_update_email(&rp, chars_to_text("other@domain.com"));
+  write_Person_dirty(&rp, pp);
+  EXPECT_LT(len, cs->len);
+  len = cs->len;
+
+  // Assignments behind the mask's back need Person_mark_dirty.
+  rp.employment_which = Person_employment_school;
+  rp.employment.school = chars_to_text("of life");
+  write_Person_dirty(&rp, pp);
+  EXPECT_EQ(len, cs->len);
+  Person_mark_dirty(&rp, Person_dirty_employment);
+  write_Person_dirty(&rp, pp);
+
+  struct Person check;
+  read_Person(&check, pp);
+  EXPECT_EQ(42u, check.id);
+  EXPECT_CAPN_TEXT_EQ("Firstname Lastname", check.name);
+  EXPECT_CAPN_TEXT_EQ("other@domain.com", check.email);
+  EXPECT_EQ(Person_employment_school, check.employment_which);
+  EXPECT_CAPN_TEXT_EQ("of life", check.employment.school);
+
+  capn_free(&c);
+}
+
+// Demonstrate a lookup table: a list sorted once by a $C.sortkey field, then
+// searched without decoding the elements.
+TEST(Examples, SortedTable) {
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr cr = capn_root(&c);
+  struct capn_segment *cs = cr.seg;
+
+  Person_list people = new_Person_list(cs, 50);
+  for (int i = 0; i < 50; i++) {
+    char name[32];
+    sprintf(name, "Person %02d", (i * 7) % 50);
+    struct Person p = {
+      .id = (uint32_t) (1000 - i),
+      .name = chars_to_text(name),
+    };
+    set_Person(&p, people, i);
+  }
+
+  ASSERT_EQ(0, Person_list_sort_by_name(people));
+  int i = Person_list_find_by_name(people, chars_to_text("Person 21"));
+  ASSERT_EQ(21, i);
+  struct Person rp;
+  get_Person(&rp, people, i);
+  EXPECT_CAPN_TEXT_EQ("Person 21", rp.name);
+  EXPECT_EQ(1000u - 3, rp.id);
+  EXPECT_EQ(-1, Person_list_find_by_name(people, chars_to_text("Person 50")));
+
+  ASSERT_EQ(0, Person_list_sort_by_id(people));
+  for (i = 0; i < 50; i++) {
+    get_Person(&rp, people, i);
+    EXPECT_EQ((uint32_t) (951 + i), rp.id);
+  }
+  EXPECT_EQ(49, Person_list_find_by_id(people, 1000));
+  EXPECT_EQ(-1, Person_list_find_by_id(people, 7));
+
+  capn_free(&c);
+}
+
+// Demonstrate a keyed lookup table: the $C.hashindex field peopleByName is
+// filled in once by the writer, and readers look names up straight from the
+// serialized message without decoding the list.
+TEST(Examples, HashIndex) {
+  uint8_t buf[16384];
+  ssize_t sz;
+
+  {
+    struct capn c;
+    capn_init_malloc(&c);
+    capn_ptr cr = capn_root(&c);
+    struct capn_segment *cs = cr.seg;
+
+    struct AddressBook ab;
+    memset(&ab, 0, sizeof(ab));
+    ab.people = new_Person_list(cs, 100);
+    for (int i = 0; i < 100; i++) {
+      char name[32];
+      sprintf(name, "Person %d", i);
+      struct Person p = {
+        .id = (uint32_t) i,
+        .name = chars_to_text(name),
+      };
+      set_Person(&p, ab.people, i);
+    }
+    AddressBook_ptr abp = new_AddressBook(cs);
+    write_AddressBook(&ab, abp);
+    ASSERT_EQ(0, AddressBook_build_peopleByName(abp));
+    ASSERT_EQ(0, capn_setp(cr, 0, abp.p));
+
+    sz = capn_write_mem(&c, buf, sizeof(buf), 0 /* packed */);
+    ASSERT_LT(0, sz);
+    capn_free(&c);
+  }
+
+  struct capn rc;
+  ASSERT_EQ(0, capn_init_mem(&rc, buf, sz, 0 /* packed */));
+  AddressBook_ptr abp;
+  abp.p = capn_getp(capn_root(&rc), 0, 1);
+  capn_list32 index = AddressBook_get_peopleByName(abp);
+  EXPECT_EQ(256, capn_len(index));
+
+  for (int i = 0; i < 100; i++) {
+    char name[32];
+    sprintf(name, "Person %d", i);
+    int j = AddressBook_find_peopleByName(abp, chars_to_text(name));
+    ASSERT_LE(0, j);
+    Person_ptr pp;
+    pp.p = capn_getp(AddressBook_get_people(abp).p, j, 0);
+    EXPECT_EQ((uint32_t) i, Person_get_id(pp));
+  }
+  EXPECT_EQ(-1, AddressBook_find_peopleByName(abp, chars_to_text("Nobody")));
+
+  capn_free(&rc);
+}
+
+// A key left unset is hashed and compared as its default value.
+TEST(Examples, HashIndexDefaultKey) {
+  struct capn c;
+  capn_init_malloc(&c);
+  capn_ptr cr = capn_root(&c);
+  struct capn_segment *cs = cr.seg;
+
+  struct AddressBook ab;
+  memset(&ab, 0, sizeof(ab));
+  ab.tags = new_Tag_list(cs, 3);
+  const char *labels[] = {"work", NULL, "home"};
+  for (int i = 0; i < 3; i++) {
+    struct Tag t;
+    memset(&t, 0, sizeof(t));
+    if (labels[i]) {
+      t.label = chars_to_text(labels[i]);
+    }
+    set_Tag(&t, ab.tags, i);
+  }
+  AddressBook_ptr abp = new_AddressBook(cs);
+  write_AddressBook(&ab, abp);
+  ASSERT_EQ(0, AddressBook_build_tagsByLabel(abp));
+
+  EXPECT_EQ(0, AddressBook_find_tagsByLabel(abp, chars_to_text("work")));
+  EXPECT_EQ(1, AddressBook_find_tagsByLabel(abp, chars_to_text("untagged")));
+  EXPECT_EQ(2, AddressBook_find_tagsByLabel(abp, chars_to_text("home")));
+  EXPECT_EQ(-1, AddressBook_find_tagsByLabel(abp, chars_to_text("")));
+
+  capn_free(&c);
+}
@@ -0,0 +1,772 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-filter.c
+ *
+ * The bytecode works on a single accumulator: OP_TEST sets it to the
+ * result of a test, OP_NOT flips it and OP_JZ/OP_JNZ jump when it is
+ * false/true, which is all that short circuit && and || need.
+ *
+ * Tests resolve their field path at compile time to a chain of steps
+ * (follow a pointer, check a union discriminant, loop over a list) and a
+ * leaf that says where the value is and how to compare it. When a list loop
+ * is the last step, the leaf is read straight from the list data with the
+ * element stride and the bounds checks done once for the whole list.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capn-filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#define MAX_STEPS 32
+
+enum op_kind {
+	OP_TEST,
+	OP_NOT,
+	OP_JZ,
+	OP_JNZ
+};
+
+struct filter_op {
+	enum op_kind op;
+	int arg;
+};
+
+enum step_kind {
+	STEP_PTR,
+	STEP_UNION,
+	STEP_ANY
+};
+
+struct filter_step {
+	enum step_kind kind;
+	uint32_t off;
+	uint16_t disc;
+};
+
+enum leaf_kind {
+	LEAF_INT,
+	LEAF_UINT,
+	LEAF_FLOAT,
+	LEAF_BLOB
+};
+
+enum cmp_kind {
+	CMP_EQ,
+	CMP_NE,
+	CMP_LT,
+	CMP_LE,
+	CMP_GT,
+	CMP_GE,
+	CMP_PREFIX,
+	CMP_SUFFIX,
+	CMP_CONTAINS
+};
+
+static const char *cmp_names[] = {"==", "!=", "<", "<=", ">", ">=", "^=", "$=", "*="};
+
+/* struct filter_test is one comparison.
+ *
+ * For scalars the value is ((bytes at off >> shift) & mask) ^ def where
+ * bytes is size bytes wide, size 0 being an element of a bit list. For
+ * blobs off is the pointer index. elem is set if the leaf is the element of
+ * a list of scalars or blobs rather than a field of a struct.
+ */
+struct filter_test {
+	struct filter_step steps[MAX_STEPS];
+	int nsteps;
+	enum leaf_kind kind;
+	enum cmp_kind cmp;
+	int elem, text;
+	uint32_t off;
+	int size, shift;
+	uint64_t mask, def;
+	union {
+		int64_t i;
+		uint64_t u;
+		double f;
+	} lit;
+	char *str;
+	int len;
+	char *src;
+};
+
+struct filter {
+	struct filter_op *ops;
+	int nops, opcap;
+	struct filter_test *tests;
+	int ntests, testcap;
+};
+
+struct parser {
+	const char *p;
+	struct filter *f;
+	struct schema_node *root;
+	char *err;
+	size_t errsz;
+};
+
+/* evaluation */
+
+static uint64_t load(const char *d, int size) {
+	switch (size) {
+	case 1:
+		return *(const uint8_t*) d;
+	case 2:
+		return capn_flip16(*(const uint16_t*) d);
+	case 4:
+		return capn_flip32(*(const uint32_t*) d);
+	default:
+		return capn_flip64(*(const uint64_t*) d);
+	}
+}
+
+static int check(enum cmp_kind cmp, int c) {
+	switch (cmp) {
+	case CMP_EQ:
+		return c == 0;
+	case CMP_NE:
+		return c != 0;
+	case CMP_LT:
+		return c < 0;
+	case CMP_LE:
+		return c <= 0;
+	case CMP_GT:
+		return c > 0;
+	case CMP_GE:
+		return c >= 0;
+	default:
+		return 0;
+	}
+}
+
+static int test_scalar(const struct filter_test *t, uint64_t v) {
+	switch (t->kind) {
+	case LEAF_INT: {
+		int64_t x;
+		switch (t->size) {
+		case 1: x = (int8_t) v; break;
+		case 2: x = (int16_t) v; break;
+		case 4: x = (int32_t) v; break;
+		default: x = (int64_t) v; break;
+		}
+		return check(t->cmp, (x > t->lit.i) - (x < t->lit.i));
+	}
+	case LEAF_UINT:
+		return check(t->cmp, (v > t->lit.u) - (v < t->lit.u));
+	case LEAF_FLOAT: {
+		double x = t->size == 4 ? capn_to_f32((uint32_t) v) : capn_to_f64(v);
+		/* NaN is only ever not equal */
+		if (x != x || t->lit.f != t->lit.f)
+			return t->cmp == CMP_NE;
+		return check(t->cmp, (x > t->lit.f) - (x < t->lit.f));
+	}
+	default:
+		return 0;
+	}
+}
+
+static int test_blob(const struct filter_test *t, capn_ptr p) {
+	const char *s = NULL;
+	int len = 0, i, c;
+
+	if (p.type == CAPN_LIST && p.datasz == 1) {
+		s = p.data;
+		len = p.len;
+		/* text carries a NUL terminator */
+		if (t->text && len && !s[len-1])
+			len--;
+	}
+
+	switch (t->cmp) {
+	case CMP_PREFIX:
+		return len >= t->len && !memcmp(s, t->str, t->len);
+	case CMP_SUFFIX:
+		return len >= t->len && !memcmp(s + len - t->len, t->str, t->len);
+	case CMP_CONTAINS:
+		for (i = 0; i + t->len <= len; i++) {
+			if (!memcmp(s + i, t->str, t->len))
+				return 1;
+		}
+		return 0;
+	default:
+		c = len < t->len ? len : t->len;
+		c = c ? memcmp(s, t->str, c) : 0;
+		if (!c)
+			c = (len > t->len) - (len < t->len);
+		return check(t->cmp, c);
+	}
+}
+
+/* test_field runs the leaf of t on the struct p */
+static int test_field(const struct filter_test *t, capn_ptr p) {
+	if (t->kind == LEAF_BLOB)
+		return test_blob(t, capn_getp(p, t->off, 1));
+
+	if (p.type != CAPN_STRUCT || t->off + t->size > p.datasz)
+		return test_scalar(t, t->def);
+	return test_scalar(t, ((load(p.data + t->off, t->size) >> t->shift) & t->mask) ^ t->def);
+}
+
+/* test_list runs the leaf of t on every element of the list p, or on the
+ * field of every struct in it, until one matches */
+static int test_list(const struct filter_test *t, capn_ptr p) {
+	int i;
+
+	if (t->kind == LEAF_BLOB) {
+		for (i = 0; i < p.len; i++) {
+			capn_ptr e = capn_getp(p, i, 1);
+			if (t->elem ? test_blob(t, e) : test_field(t, e))
+				return 1;
+		}
+		return 0;
+	}
+
+	if (p.type == CAPN_BIT_LIST) {
+		capn_list1 l;
+		l.p = p;
+		for (i = 0; i < p.len; i++) {
+			if (test_scalar(t, (uint64_t) capn_get1(l, i)))
+				return 1;
+		}
+		return 0;
+	}
+
+	if (p.type == CAPN_LIST) {
+		size_t stride = p.datasz + 8 * (size_t) p.ptrs;
+		const char *d = p.data + t->off;
+
+		/* a value past the data of the elements is the default */
+		if (t->off + t->size > p.datasz)
+			return p.len > 0 && test_scalar(t, t->def);
+
+		for (i = 0; i < p.len; i++, d += stride) {
+			if (test_scalar(t, ((load(d, t->size) >> t->shift) & t->mask) ^ t->def))
+				return 1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < p.len; i++) {
+		if (test_field(t, capn_getp(p, i, 1)))
+			return 1;
+	}
+	return 0;
+}
+
+static int run_test(const struct filter_test *t, int k, capn_ptr p) {
+	int i;
+
+	for (; k < t->nsteps; k++) {
+		const struct filter_step *s = &t->steps[k];
+
+		switch (s->kind) {
+		case STEP_PTR:
+			p = capn_getp(p, s->off, 1);
+			break;
+		case STEP_UNION:
+			if (capn_read16(p, s->off) != s->disc)
+				return 0;
+			break;
+		case STEP_ANY:
+			if (k + 1 == t->nsteps)
+				return test_list(t, p);
+			for (i = 0; i < p.len; i++) {
+				if (run_test(t, k + 1, capn_getp(p, i, 1)))
+					return 1;
+			}
+			return 0;
+		}
+	}
+
+	return test_field(t, p);
+}
+
+int filter_match(const struct filter *f, capn_ptr p) {
+	int acc = 0, pc;
+
+	capn_resolve(&p);
+	for (pc = 0; pc < f->nops; pc++) {
+		const struct filter_op *op = &f->ops[pc];
+
+		switch (op->op) {
+		case OP_TEST:
+			acc = run_test(&f->tests[op->arg], 0, p);
+			break;
+		case OP_NOT:
+			acc = !acc;
+			break;
+		case OP_JZ:
+			if (!acc)
+				pc = op->arg - 1;
+			break;
+		case OP_JNZ:
+			if (acc)
+				pc = op->arg - 1;
+			break;
+		}
+	}
+
+	return acc;
+}
+
+/* compilation */
+
+static int fail(struct parser *ps, const char *fmt, ...) {
+	va_list ap;
+
+	/* keep the first error */
+	if (ps->errsz && !ps->err[0]) {
+		va_start(ap, fmt);
+		vsnprintf(ps->err, ps->errsz, fmt, ap);
+		va_end(ap);
+	}
+	return -1;
+}
+
+static void skip_ws(struct parser *ps) {
+	while (isspace((unsigned char) *ps->p))
+		ps->p++;
+}
+
+static int emit(struct parser *ps, enum op_kind op, int arg) {
+	struct filter *f = ps->f;
+
+	if (f->nops == f->opcap) {
+		int cap = f->opcap ? 2 * f->opcap : 16;
+		struct filter_op *n = (struct filter_op*) realloc(f->ops, cap * sizeof(*n));
+		if (!n)
+			return fail(ps, "out of memory");
+		f->ops = n;
+		f->opcap = cap;
+	}
+
+	f->ops[f->nops].op = op;
+	f->ops[f->nops].arg = arg;
+	return f->nops++;
+}
+
+static struct schema_field *find_field(struct schema_node *n, const char *name, size_t len) {
+	int i;
+
+	for (i = 0; i < n->nfields; i++) {
+		if (strlen(n->fields[i].name) == len && !memcmp(n->fields[i].name, name, len))
+			return &n->fields[i];
+	}
+	return NULL;
+}
+
+static int add_step(struct parser *ps, struct filter_test *t, enum step_kind kind, uint32_t off, uint16_t disc) {
+	if (t->nsteps == MAX_STEPS)
+		return fail(ps, "path is too deep");
+	t->steps[t->nsteps].kind = kind;
+	t->steps[t->nsteps].off = off;
+	t->steps[t->nsteps].disc = disc;
+	t->nsteps++;
+	return 0;
+}
+
+/* set_leaf says where a value of type st is: the field at slot offset off
+ * of a struct, or an element of a list if t->elem is set */
+static int set_leaf(struct parser *ps, struct filter_test *t, const struct schema_type *st, uint32_t off, uint64_t def) {
+	t->mask = ~UINT64_C(0);
+	t->def = def;
+
+	switch (st->which) {
+	case Type__bool:
+		t->kind = LEAF_UINT;
+		t->size = t->elem ? 0 : 1;
+		t->off = off / 8;
+		t->shift = off % 8;
+		t->mask = 1;
+		return 0;
+	case Type_int8:
+	case Type_int16:
+	case Type_int32:
+	case Type_int64:
+		t->kind = LEAF_INT;
+		break;
+	case Type_uint8:
+	case Type_uint16:
+	case Type_uint32:
+	case Type_uint64:
+	case Type__enum:
+		t->kind = LEAF_UINT;
+		break;
+	case Type_float32:
+	case Type_float64:
+		t->kind = LEAF_FLOAT;
+		break;
+	case Type_text:
+	case Type_data:
+		t->kind = LEAF_BLOB;
+		t->text = st->which == Type_text;
+		t->off = off;
+		return 0;
+	default:
+		return fail(ps, "only scalars, text and data can be compared");
+	}
+
+	switch (st->which) {
+	case Type_int8:
+	case Type_uint8:
+		t->size = 1;
+		break;
+	case Type_int16:
+	case Type_uint16:
+	case Type__enum:
+		t->size = 2;
+		break;
+	case Type_int32:
+	case Type_uint32:
+	case Type_float32:
+		t->size = 4;
+		break;
+	default:
+		t->size = 8;
+		break;
+	}
+	t->off = off * t->size;
+	return 0;
+}
+
+/* parse_path resolves a field path to the steps and the leaf of t, and
+ * returns the type of the leaf in *pst */
+static int parse_path(struct parser *ps, struct filter_test *t, const struct schema_type **pst) {
+	struct schema_node *n = ps->root;
+
+	for (;;) {
+		const char *name = ps->p;
+		struct schema_field *f;
+		size_t len;
+		int any = 0;
+
+		while (isalnum((unsigned char) *ps->p) || *ps->p == '_')
+			ps->p++;
+		len = ps->p - name;
+		if (!len)
+			return fail(ps, "expected a field name at '%.16s'", name);
+		if (ps->p[0] == '[' && ps->p[1] == ']') {
+			any = 1;
+			ps->p += 2;
+		}
+
+		f = find_field(n, name, len);
+		if (!f)
+			return fail(ps, "no field %.*s in %s", (int) len, name, n->name);
+		if (any && (f->group || f->type.which != Type__list))
+			return fail(ps, "%.*s is not a list", (int) len, name);
+
+		if (f->discriminant != Field_noDiscriminant) {
+			if (add_step(ps, t, STEP_UNION, 2 * n->discriminant_offset, f->discriminant))
+				return -1;
+		}
+
+		if (f->group) {
+			n = f->group;
+		} else if (f->type.which == Type__struct) {
+			if (add_step(ps, t, STEP_PTR, f->offset, 0))
+				return -1;
+			n = f->type.node;
+		} else if (any) {
+			if (add_step(ps, t, STEP_PTR, f->offset, 0) || add_step(ps, t, STEP_ANY, 0, 0))
+				return -1;
+			if (f->type.elem->which != Type__struct) {
+				/* the elements of a list of scalars or blobs */
+				t->elem = 1;
+				*pst = f->type.elem;
+				return set_leaf(ps, t, f->type.elem, 0, 0);
+			}
+			n = f->type.elem->node;
+		} else {
+			*pst = &f->type;
+			return set_leaf(ps, t, &f->type, f->offset, f->def);
+		}
+
+		if (*ps->p != '.')
+			return fail(ps, "%.*s is a struct, compare one of its fields", (int) len, name);
+		ps->p++;
+	}
+}
+
+static int parse_cmp(struct parser *ps, struct filter_test *t) {
+	/* two character operators first */
+	static const enum cmp_kind order[] = {
+		CMP_EQ, CMP_NE, CMP_LE, CMP_GE, CMP_PREFIX, CMP_SUFFIX, CMP_CONTAINS, CMP_LT, CMP_GT
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(order)/sizeof(order[0]); i++) {
+		const char *op = cmp_names[order[i]];
+		size_t len = strlen(op);
+
+		if (!strncmp(ps->p, op, len)) {
+			ps->p += len;
+			t->cmp = order[i];
+			if (t->cmp >= CMP_PREFIX && t->kind != LEAF_BLOB)
+				return fail(ps, "%s only applies to text and data", op);
+			return 0;
+		}
+	}
+	return fail(ps, "expected a comparison at '%.16s'", ps->p);
+}
+
+static int parse_string(struct parser *ps, struct filter_test *t) {
+	const char *s = ++ps->p;
+	int n = 0;
+
+	t->str = (char*) malloc(strlen(s) + 1);
+	if (!t->str)
+		return fail(ps, "out of memory");
+
+	for (; *s != '"'; s++) {
+		if (!*s)
+			return fail(ps, "unterminated string");
+		if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+			s++;
+		t->str[n++] = *s;
+	}
+	t->len = n;
+	ps->p = s + 1;
+	return 0;
+}
+
+static int parse_literal(struct parser *ps, struct filter_test *t, const struct schema_type *st) {
+	const char *s = ps->p;
+	char *end = NULL;
+	int i;
+
+	if (t->kind == LEAF_BLOB) {
+		if (*s != '"')
+			return fail(ps, "expected a string at '%.16s'", s);
+		return parse_string(ps, t);
+	}
+
+	if (st->which == Type__bool && (!strncmp(s, "true", 4) || !strncmp(s, "false", 5))) {
+		t->lit.u = *s == 't';
+		ps->p += *s == 't' ? 4 : 5;
+		return 0;
+	}
+
+	if (st->which == Type__enum && (isalpha((unsigned char) *s) || *s == '_')) {
+		size_t len = 0;
+		while (isalnum((unsigned char) s[len]) || s[len] == '_')
+			len++;
+		for (i = 0; i < st->node->enumerants; i++) {
+			const char *e = st->node->enumerant_names[i];
+			if (strlen(e) == len && !memcmp(e, s, len)) {
+				t->lit.u = i;
+				ps->p += len;
+				return 0;
+			}
+		}
+		return fail(ps, "no enumerant %.*s in %s", (int) len, s, st->node->name);
+	}
+
+	switch (t->kind) {
+	case LEAF_INT:
+		t->lit.i = strtoll(s, &end, 0);
+		break;
+	case LEAF_UINT:
+		if (*s != '-')
+			t->lit.u = strtoull(s, &end, 0);
+		break;
+	default:
+		t->lit.f = strtod(s, &end);
+		break;
+	}
+	if (!end || end == s)
+		return fail(ps, "expected a value at '%.16s'", s);
+	ps->p = end;
+	return 0;
+}
+
+static int parse_test(struct parser *ps) {
+	struct filter *f = ps->f;
+	const struct schema_type *st = NULL;
+	const char *start = ps->p;
+	struct filter_test *t;
+
+	if (f->ntests == f->testcap) {
+		int cap = f->testcap ? 2 * f->testcap : 8;
+		struct filter_test *n = (struct filter_test*) realloc(f->tests, cap * sizeof(*n));
+		if (!n)
+			return fail(ps, "out of memory");
+		f->tests = n;
+		f->testcap = cap;
+	}
+	t = &f->tests[f->ntests++];
+	memset(t, 0, sizeof(*t));
+
+	if (parse_path(ps, t, &st))
+		return -1;
+	skip_ws(ps);
+	if (parse_cmp(ps, t))
+		return -1;
+	skip_ws(ps);
+	if (parse_literal(ps, t, st))
+		return -1;
+
+	t->src = (char*) malloc(ps->p - start + 1);
+	if (!t->src)
+		return fail(ps, "out of memory");
+	memcpy(t->src, start, ps->p - start);
+	t->src[ps->p - start] = '\0';
+
+	return emit(ps, OP_TEST, f->ntests - 1) < 0 ? -1 : 0;
+}
+
+static int parse_or(struct parser *ps);
+
+static int parse_not(struct parser *ps) {
+	skip_ws(ps);
+
+	if (*ps->p == '!') {
+		ps->p++;
+		if (parse_not(ps))
+			return -1;
+		return emit(ps, OP_NOT, 0) < 0 ? -1 : 0;
+	}
+
+	if (*ps->p == '(') {
+		ps->p++;
+		if (parse_or(ps))
+			return -1;
+		skip_ws(ps);
+		if (*ps->p != ')')
+			return fail(ps, "expected ) at '%.16s'", ps->p);
+		ps->p++;
+		return 0;
+	}
+
+	return parse_test(ps);
+}
+
+/* a && b is a, JZ end, b: the accumulator already holds the result if a is
+ * false */
+static int parse_and(struct parser *ps) {
+	int j;
+
+	if (parse_not(ps))
+		return -1;
+	skip_ws(ps);
+	if (strncmp(ps->p, "&&", 2))
+		return 0;
+	ps->p += 2;
+
+	j = emit(ps, OP_JZ, 0);
+	if (j < 0 || parse_and(ps))
+		return -1;
+	ps->f->ops[j].arg = ps->f->nops;
+	return 0;
+}
+
+static int parse_or(struct parser *ps) {
+	int j;
+
+	if (parse_and(ps))
+		return -1;
+	skip_ws(ps);
+	if (strncmp(ps->p, "||", 2))
+		return 0;
+	ps->p += 2;
+
+	j = emit(ps, OP_JNZ, 0);
+	if (j < 0 || parse_or(ps))
+		return -1;
+	ps->f->ops[j].arg = ps->f->nops;
+	return 0;
+}
+
+struct filter *filter_compile(struct schema_node *root, const char *expr, char *err, size_t errsz) {
+	struct parser ps;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = expr;
+	ps.root = root;
+	ps.err = err;
+	ps.errsz = errsz;
+	if (errsz)
+		err[0] = '\0';
+
+	if (!root || root->which != Node__struct) {
+		fail(&ps, "the root is not a struct");
+		return NULL;
+	}
+
+	ps.f = (struct filter*) calloc(1, sizeof(*ps.f));
+	if (!ps.f) {
+		fail(&ps, "out of memory");
+		return NULL;
+	}
+
+	if (parse_or(&ps))
+		goto err;
+	skip_ws(&ps);
+	if (*ps.p) {
+		fail(&ps, "unexpected '%.16s'", ps.p);
+		goto err;
+	}
+	return ps.f;
+
+err:
+	filter_free(ps.f);
+	return NULL;
+}
+
+void filter_free(struct filter *f) {
+	int i;
+
+	if (!f)
+		return;
+	for (i = 0; i < f->ntests; i++) {
+		free(f->tests[i].str);
+		free(f->tests[i].src);
+	}
+	free(f->tests);
+	free(f->ops);
+	free(f);
+}
+
+void filter_dump(const struct filter *f, FILE *out) {
+	static const char *steps[] = {"ptr", "union", "any"};
+	int i, j;
+
+	for (i = 0; i < f->nops; i++) {
+		const struct filter_op *op = &f->ops[i];
+		const struct filter_test *t;
+
+		switch (op->op) {
+		case OP_NOT:
+			fprintf(out, "%4d  not\n", i);
+			break;
+		case OP_JZ:
+		case OP_JNZ:
+			fprintf(out, "%4d  %-5s %d\n", i, op->op == OP_JZ ? "jz" : "jnz", op->arg);
+			break;
+		case OP_TEST:
+			t = &f->tests[op->arg];
+			fprintf(out, "%4d  test  %s\n", i, t->src);
+			for (j = 0; j < t->nsteps; j++) {
+				fprintf(out, "            %s %u", steps[t->steps[j].kind], t->steps[j].off);
+				if (t->steps[j].kind == STEP_UNION)
+					fprintf(out, " == %u", t->steps[j].disc);
+				fprintf(out, "\n");
+			}
+			if (t->kind == LEAF_BLOB) {
+				fprintf(out, "            %s %s %u %s\n", t->text ? "text" : "data",
+						t->elem ? "elem" : "ptr", t->off, cmp_names[t->cmp]);
+			} else {
+				fprintf(out, "            %s%d %s %u", t->kind == LEAF_INT ? "int" : t->kind == LEAF_UINT ? "uint" : "float",
+						t->mask == 1 ? 1 : 8 * t->size, t->elem ? "elem" : "byte", t->off);
+				if (t->mask == 1)
+					fprintf(out, " bit %d", t->shift);
+				fprintf(out, " %s\n", cmp_names[t->cmp]);
+			}
+			break;
+		}
+	}
+}
@@ -0,0 +1,46 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-filter.h
+ *
+ * Predicates over the fields of a message, compiled against a schema to a
+ * small bytecode and evaluated on the message data without decoding it.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef CAPN_FILTER_H
+#define CAPN_FILTER_H
+
+#include "capn-schema.h"
+
+/* A filter expression is made of tests joined with &&, || and !, with
+ * parentheses for grouping:
+ *
+ *   id >= 100 && id < 200 && email $= "@example.com"
+ *   phones[].type == mobile || !(employment.school == "")
+ *
+ * A test compares a field path with a literal. Paths name fields from the
+ * root struct down through struct fields and groups, separated by dots.
+ * list[] stands for any element of a list: the test holds if it holds for
+ * one of the elements. The operators are == != < <= > >= for all fields,
+ * and ^= (starts with), $= (ends with) and *= (contains) for text and data.
+ * Literals are integers, floats, "quoted strings" with \" and \\ escapes,
+ * enumerant names and true/false.
+ *
+ * A test on a union member that is not set is false. Null pointers read as
+ * default values (empty for text and data), as they do in generated code.
+ */
+struct filter;
+
+/* filter_compile compiles expr for messages whose root is the struct root.
+ * Returns NULL on error, with a message in err. */
+struct filter *filter_compile(struct schema_node *root, const char *expr, char *err, size_t errsz);
+void filter_free(struct filter *f);
+
+/* filter_match returns 1 if the root struct p matches f, 0 otherwise */
+int filter_match(const struct filter *f, capn_ptr p);
+
+/* filter_dump writes the bytecode of f to out */
+void filter_dump(const struct filter *f, FILE *out);
+
+#endif /* CAPN_FILTER_H */
@@ -0,0 +1,401 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-gen.c
+ *
+ * Synthetic message generator. Builds random but valid messages for a
+ * struct in a compiled schema and writes them out as a stream of framed
+ * messages, for use as benchmark or profiling input when real data is not
+ * available.
+ *
+ * usage: capn-gen -s schema.bin -r Root [options] [file]
+ *
+ *   -n count        number of messages (default 1000)
+ *   -l mean[:max]   list lengths, geometric (default 4:64)
+ *   -t mean[:max]   text and data sizes in bytes, geometric (default 16:256)
+ *   -f prob         probability that a field is set (default 0.8)
+ *   -u ratio        union member k is picked with weight ratio^k, 1 picks
+ *                   uniformly (default 1)
+ *   -d depth        maximum struct nesting, deeper structs are left null
+ *                   (default 8)
+ *   -b bits         maximum significant bits of integer values (default 16)
+ *   -x seed         random seed (default 1)
+ *   -p              write packed messages
+ *
+ * Without a file the messages are written to stdout.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capn-schema.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+struct dist {
+	double mean;
+	int max;
+};
+
+struct gen {
+	struct dist list, text;
+	double presence, union_ratio;
+	int max_depth, bits;
+	uint64_t rng;
+};
+
+static uint64_t rnd(struct gen *g) {
+	/* xorshift64* */
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * UINT64_C(2685821657736338717);
+}
+
+static double rnd_unit(struct gen *g) {
+	return (rnd(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int geometric(struct gen *g, const struct dist *d) {
+	double q = d->mean / (d->mean + 1);
+	int n = 0;
+	while (n < d->max && rnd_unit(g) < q)
+		n++;
+	return n;
+}
+
+static uint64_t rnd_int(struct gen *g, int width) {
+	int bits = width < g->bits ? width : g->bits;
+	if (bits <= 0)
+		return 0;
+	return bits >= 64 ? rnd(g) : rnd(g) & ((UINT64_C(1) << bits) - 1);
+}
+
+static int present(struct gen *g) {
+	return rnd_unit(g) < g->presence;
+}
+
+static void gen_struct(struct gen *g, capn_ptr p, const struct schema_node *n, int depth);
+
+static capn_ptr gen_text(struct gen *g, struct capn_segment *seg, int is_text) {
+	int i, len = geometric(g, &g->text);
+	capn_list8 l;
+
+	if (is_text) {
+		char *s = (char*) malloc(len + 1);
+		capn_ptr r;
+		for (i = 0; i < len; i++)
+			s[i] = 'a' + rnd(g) % 26;
+		s[len] = '\0';
+		r = capn_new_string(seg, s, len);
+		free(s);
+		return r;
+	}
+
+	l = capn_new_list8(seg, len);
+	for (i = 0; i < len; i++)
+		capn_set8(l, i, (uint8_t) rnd(g));
+	return l.p;
+}
+
+static int elem_bytes(enum Type_which w) {
+	switch (w) {
+	case Type_int8:
+	case Type_uint8:
+		return 1;
+	case Type_int16:
+	case Type_uint16:
+	case Type__enum:
+		return 2;
+	case Type_int32:
+	case Type_uint32:
+	case Type_float32:
+		return 4;
+	case Type_int64:
+	case Type_uint64:
+	case Type_float64:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+static uint64_t gen_value(struct gen *g, const struct schema_type *t) {
+	union { float f; uint32_t u; } f32;
+	union { double f; uint64_t u; } f64;
+
+	switch (t->which) {
+	case Type_float32:
+		f32.f = (float) rnd_int(g, 24);
+		return f32.u;
+	case Type_float64:
+		f64.f = (double) rnd_int(g, 53);
+		return f64.u;
+	case Type__enum:
+		return t->node->enumerants ? rnd(g) % t->node->enumerants : 0;
+	default:
+		return rnd_int(g, 8 * elem_bytes(t->which));
+	}
+}
+
+static capn_ptr gen_ptr(struct gen *g, struct capn_segment *seg, const struct schema_type *t, int depth);
+
+static capn_ptr gen_list(struct gen *g, struct capn_segment *seg, const struct schema_type *elem, int depth) {
+	capn_ptr r = {CAPN_NULL};
+	int i, len = geometric(g, &g->list);
+
+	switch (elem->which) {
+	case Type__void:
+		r = capn_new_list(seg, len, 0, 0);
+		break;
+
+	case Type__bool: {
+		capn_list1 l = capn_new_list1(seg, len);
+		for (i = 0; i < len; i++)
+			capn_set1(l, i, rnd(g) & 1);
+		r = l.p;
+		break;
+	}
+
+	case Type__struct: {
+		const struct schema_node *n = elem->node;
+		if (depth >= g->max_depth)
+			break;
+		r = capn_new_list(seg, len, 8*n->datasz, n->ptrs);
+		for (i = 0; i < len; i++)
+			gen_struct(g, capn_getp(r, i, 0), n, depth + 1);
+		break;
+	}
+
+	case Type_text:
+	case Type_data:
+	case Type__list:
+		r = capn_new_ptr_list(seg, len);
+		for (i = 0; i < len; i++)
+			capn_setp(r, i, gen_ptr(g, seg, elem, depth + 1));
+		break;
+
+	case Type__interface:
+	case Type_anyPointer:
+		r = capn_new_ptr_list(seg, len);
+		break;
+
+	default: {
+		int sz = elem_bytes(elem->which);
+		capn_list8 l8;
+		capn_list16 l16;
+		capn_list32 l32;
+		capn_list64 l64;
+
+		r = capn_new_list(seg, len, sz, 0);
+		l8.p = l16.p = l32.p = l64.p = r;
+		for (i = 0; i < len; i++) {
+			uint64_t v = gen_value(g, elem);
+			switch (sz) {
+			case 1: capn_set8(l8, i, (uint8_t) v); break;
+			case 2: capn_set16(l16, i, (uint16_t) v); break;
+			case 4: capn_set32(l32, i, (uint32_t) v); break;
+			case 8: capn_set64(l64, i, v); break;
+			}
+		}
+		break;
+	}
+	}
+
+	return r;
+}
+
+static capn_ptr gen_ptr(struct gen *g, struct capn_segment *seg, const struct schema_type *t, int depth) {
+	capn_ptr r = {CAPN_NULL};
+
+	switch (t->which) {
+	case Type_text:
+		return gen_text(g, seg, 1);
+	case Type_data:
+		return gen_text(g, seg, 0);
+	case Type__list:
+		return gen_list(g, seg, t->elem, depth);
+	case Type__struct:
+		if (depth < g->max_depth) {
+			r = capn_new_struct(seg, 8*t->node->datasz, t->node->ptrs);
+			gen_struct(g, r, t->node, depth + 1);
+		}
+		return r;
+	default:
+		/* interfaces and AnyPointer are left null */
+		return r;
+	}
+}
+
+static void gen_field(struct gen *g, capn_ptr p, const struct schema_field *f, int depth) {
+	const struct schema_type *t = &f->type;
+
+	if (f->group) {
+		gen_struct(g, p, f->group, depth);
+		return;
+	}
+
+	if (!present(g))
+		return;
+
+	if (t->which == Type__void) {
+		return;
+	} else if (t->which == Type__bool) {
+		capn_write1(p, f->offset, rnd(g) & 1);
+	} else if (schema_is_pointer(t)) {
+		capn_ptr v = gen_ptr(g, p.seg, t, depth);
+		if (v.type != CAPN_NULL)
+			capn_setp(p, f->offset, v);
+	} else {
+		uint64_t v = gen_value(g, t);
+		switch (elem_bytes(t->which)) {
+		case 1: capn_write8(p, f->offset, (uint8_t) v); break;
+		case 2: capn_write16(p, 2*f->offset, (uint16_t) v); break;
+		case 4: capn_write32(p, 4*f->offset, (uint32_t) v); break;
+		case 8: capn_write64(p, 8*f->offset, v); break;
+		}
+	}
+}
+
+/* pick_union returns the discriminant of the union member to set */
+static int pick_union(struct gen *g, const struct schema_node *n) {
+	double w = 1, total = 0, x;
+	int k;
+
+	for (k = 0; k < n->discriminant_count; k++, w *= g->union_ratio)
+		total += w;
+
+	x = rnd_unit(g) * total;
+	for (k = 0, w = 1; k < n->discriminant_count - 1; k++, w *= g->union_ratio) {
+		if (x < w)
+			break;
+		x -= w;
+	}
+	return k;
+}
+
+static void gen_struct(struct gen *g, capn_ptr p, const struct schema_node *n, int depth) {
+	int i, which = -1;
+
+	if (n->discriminant_count) {
+		which = pick_union(g, n);
+		capn_write16(p, 2*n->discriminant_offset, (uint16_t) which);
+	}
+
+	for (i = 0; i < n->nfields; i++) {
+		const struct schema_field *f = &n->fields[i];
+		if (f->discriminant != Field_noDiscriminant && f->discriminant != which)
+			continue;
+		gen_field(g, p, f, depth);
+	}
+}
+
+static ssize_t write_fd(int fd, const void *p, size_t sz) {
+	return write(fd, p, sz);
+}
+
+static int parse_dist(struct dist *d, const char *arg) {
+	const char *colon = strchr(arg, ':');
+	d->mean = atof(arg);
+	if (colon)
+		d->max = atoi(colon + 1);
+	return d->mean < 0 || d->max < 0;
+}
+
+static int usage(const char *prog) {
+	fprintf(stderr, "usage: %s -s schema.bin -r Root [-n count] [-l mean[:max]] [-t mean[:max]]\n"
+			"\t[-f prob] [-u ratio] [-d depth] [-b bits] [-x seed] [-p] [file]\n", prog);
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	const char *schemaf = NULL, *rootname = NULL, *outf = NULL;
+	struct schema_node *root;
+	struct schema schema;
+	struct gen g;
+	int i, n = 1000, packed = 0, fd = 1;
+	FILE *f;
+
+	memset(&g, 0, sizeof(g));
+	g.list.mean = 4;
+	g.list.max = 64;
+	g.text.mean = 16;
+	g.text.max = 256;
+	g.presence = 0.8;
+	g.union_ratio = 1;
+	g.max_depth = 8;
+	g.bits = 16;
+	g.rng = 1;
+
+	for (i = 1; i < argc; i++) {
+		const char *a = argv[i];
+		if (!strcmp(a, "-p")) {
+			packed = 1;
+		} else if (a[0] == '-' && a[1] && !a[2] && i + 1 < argc) {
+			const char *v = argv[++i];
+			switch (a[1]) {
+			case 's': schemaf = v; break;
+			case 'r': rootname = v; break;
+			case 'n': n = atoi(v); break;
+			case 'l': if (parse_dist(&g.list, v)) return usage(argv[0]); break;
+			case 't': if (parse_dist(&g.text, v)) return usage(argv[0]); break;
+			case 'f': g.presence = atof(v); break;
+			case 'u': g.union_ratio = atof(v); break;
+			case 'd': g.max_depth = atoi(v); break;
+			case 'b': g.bits = atoi(v); break;
+			case 'x': g.rng = strtoull(v, NULL, 0); break;
+			default: return usage(argv[0]);
+			}
+		} else if (a[0] != '-' && !outf) {
+			outf = a;
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (!schemaf || !rootname || n < 0 || g.union_ratio <= 0)
+		return usage(argv[0]);
+	if (!g.rng)
+		g.rng = 1;
+
+	f = fopen(schemaf, "rb");
+	if (!f || schema_load(&schema, f)) {
+		fprintf(stderr, "failed to read schema from %s\n", schemaf);
+		return 1;
+	}
+	fclose(f);
+
+	root = schema_find(&schema, rootname);
+	if (!root || root->which != Node__struct) {
+		fprintf(stderr, "no struct %s in %s\n", rootname, schemaf);
+		return 1;
+	}
+
+	if (outf) {
+		fd = open(outf, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(outf);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		struct capn c;
+		capn_ptr r, p;
+
+		capn_init_malloc(&c);
+		r = capn_root(&c);
+		p = capn_new_struct(r.seg, 8*root->datasz, root->ptrs);
+		gen_struct(&g, p, root, 0);
+		capn_setp(r, 0, p);
+
+		if (capn_write_fd(&c, &write_fd, fd, packed) < 0) {
+			perror("write");
+			return 1;
+		}
+		capn_free(&c);
+	}
+
+	if (outf)
+		close(fd);
+	schema_free(&schema);
+	return 0;
+}
@@ -0,0 +1,218 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-grep.c
+ *
+ * Message filter. Reads a stream of framed messages and writes out the ones
+ * whose root struct matches a filter expression (see capn-filter.h), e.g.
+ *
+ *   capn-grep -s schema.bin -r Person 'id >= 100 && email $= "@example.com"'
+ *
+ * The expression is evaluated on the message data, messages are never
+ * decoded.
+ *
+ * usage: capn-grep [-p] [-c] [-v] [-d] -s schema.bin -r Root expr [file]
+ *
+ *   -p  input is packed, and so is the output
+ *   -c  only print the number of matching messages
+ *   -v  select the messages that do not match
+ *   -d  print the compiled filter
+ *   -s  compiled schema, as written by `capnp compile -o- foo.capnp`
+ *   -r  root struct name
+ *
+ * Without a file the messages are read from stdin. Matching messages are
+ * written to stdout.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_priv.h"
+#include "capn-filter.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SEGS 1024
+
+static uint8_t *read_all(FILE *f, size_t *psz) {
+	size_t sz = 0, cap = 1 << 16;
+	uint8_t *buf = (uint8_t*) malloc(cap);
+
+	while (buf) {
+		size_t r = fread(buf + sz, 1, cap - sz, f);
+		sz += r;
+		if (r == 0)
+			break;
+		if (sz == cap) {
+			uint8_t *n = (uint8_t*) realloc(buf, cap *= 2);
+			if (!n)
+				free(buf);
+			buf = n;
+		}
+	}
+
+	*psz = sz;
+	return buf;
+}
+
+static uint8_t *inflate_all(const uint8_t *in, size_t insz, size_t *psz) {
+	struct capn_stream z;
+	size_t cap = insz * 2 + 64;
+	uint8_t *buf = (uint8_t*) malloc(cap);
+
+	memset(&z, 0, sizeof(z));
+	z.next_in = in;
+	z.avail_in = insz;
+	z.next_out = buf;
+	z.avail_out = cap;
+
+	while (buf && (z.avail_in || z.zeros || z.raw || z.avail_buf)) {
+		if (!z.avail_out) {
+			size_t used = cap;
+			uint8_t *n = (uint8_t*) realloc(buf, cap *= 2);
+			if (!n) {
+				free(buf);
+				return NULL;
+			}
+			buf = n;
+			z.next_out = buf + used;
+			z.avail_out = cap - used;
+		}
+		if (capn_inflate(&z) == CAPN_NEED_MORE && z.avail_out) {
+			/* truncated input */
+			free(buf);
+			return NULL;
+		}
+	}
+
+	*psz = cap - z.avail_out;
+	return buf;
+}
+
+static ssize_t write_fd(int fd, const void *p, size_t sz) {
+	return write(fd, p, sz);
+}
+
+static int usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-p] [-c] [-v] [-d] -s schema.bin -r Root expr [file]\n", prog);
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	const char *schemaf = NULL, *rootname = NULL, *expr = NULL, *inf = NULL;
+	int i, packed = 0, count = 0, invert = 0, dump = 0;
+	uint64_t matches = 0;
+	struct schema schema;
+	struct schema_node *root;
+	struct filter *flt;
+	struct capn_segment segs[MAX_SEGS];
+	struct capn c;
+	uint8_t *in, *msgs;
+	size_t insz, sz, off;
+	char err[256];
+	FILE *f;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p")) {
+			packed = 1;
+		} else if (!strcmp(argv[i], "-c")) {
+			count = 1;
+		} else if (!strcmp(argv[i], "-v")) {
+			invert = 1;
+		} else if (!strcmp(argv[i], "-d")) {
+			dump = 1;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			schemaf = argv[++i];
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			rootname = argv[++i];
+		} else if (argv[i][0] != '-' && !expr) {
+			expr = argv[i];
+		} else if (argv[i][0] != '-' && !inf) {
+			inf = argv[i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (!schemaf || !rootname || !expr)
+		return usage(argv[0]);
+
+	f = fopen(schemaf, "rb");
+	if (!f || schema_load(&schema, f)) {
+		fprintf(stderr, "failed to read schema from %s\n", schemaf);
+		return 1;
+	}
+	fclose(f);
+	root = schema_find(&schema, rootname);
+	if (!root || root->which != Node__struct) {
+		fprintf(stderr, "no struct %s in %s\n", rootname, schemaf);
+		return 1;
+	}
+
+	flt = filter_compile(root, expr, err, sizeof(err));
+	if (!flt) {
+		fprintf(stderr, "%s: %s\n", expr, err);
+		return 2;
+	}
+	if (dump) {
+		filter_dump(flt, stderr);
+	}
+
+	f = inf ? fopen(inf, "rb") : stdin;
+	if (!f) {
+		perror(inf);
+		return 1;
+	}
+	in = read_all(f, &insz);
+	if (inf)
+		fclose(f);
+	if (!in) {
+		fprintf(stderr, "failed to read input\n");
+		return 1;
+	}
+
+	/* packing is word based, so a stream of packed messages inflates to
+	 * the stream of unpacked messages */
+	if (packed) {
+		msgs = inflate_all(in, insz, &sz);
+		if (!msgs) {
+			fprintf(stderr, "invalid packed input\n");
+			return 1;
+		}
+		free(in);
+	} else {
+		msgs = in;
+		sz = insz;
+	}
+
+	for (off = 0; off < sz;) {
+		int64_t framesz = capn_init_frame(&c, segs, MAX_SEGS, msgs + off, sz - off);
+
+		if (framesz <= 0) {
+			fprintf(stderr, "invalid message at offset %llu\n", (unsigned long long) off);
+			return 1;
+		}
+
+		if (filter_match(flt, capn_getp(capn_root(&c), 0, 1)) != invert) {
+			matches++;
+			if (count) {
+				/* nothing to write */
+			} else if (packed) {
+				if (capn_write_fd(&c, &write_fd, 1, 1) < 0) {
+					perror("write");
+					return 1;
+				}
+			} else if (fwrite(msgs + off, 1, framesz, stdout) != (size_t) framesz) {
+				perror("write");
+				return 1;
+			}
+		}
+
+		off += framesz;
+	}
+
+	if (count)
+		printf("%llu\n", (unsigned long long) matches);
+
+	filter_free(flt);
+	free(msgs);
+	schema_free(&schema);
+	return 0;
+}
@@ -0,0 +1,557 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-prof.c
+ *
+ * Message shape profiler. Reads a stream of framed messages and reports
+ * where the bytes go: per struct type and per pointer field (or per object
+ * shape without a schema), list sizes, far pointers, bytes not reachable
+ * from the root, segment fill and the packing ratio.
+ *
+ * usage: capn-prof [-p] [-s schema.bin -r Root] [file]
+ *
+ *   -p  input is packed
+ *   -s  compiled schema, as written by `capnp compile -o- foo.capnp`
+ *   -r  root struct name
+ *
+ * Without a file the messages are read from stdin.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capnp_priv.h"
+#include "capn-schema.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define MAX_DEPTH 64
+#define MAX_SEGS 1024
+#define TABLE_SZ 1024
+
+/* struct entry accumulates the objects attributed to one struct type or
+ * pointer field. key is the address of the schema node or type the entry
+ * is for, or the object shape without a schema. */
+struct entry {
+	uint64_t key;
+	char name[128];
+	int is_struct;
+	uint64_t count, bytes;
+	uint64_t elems, max_elems;
+	uint64_t far, double_far;
+	struct entry *next;
+};
+
+struct prof {
+	struct schema *schema;
+	struct schema_node *root;
+
+	struct entry *table[TABLE_SZ];
+	int nentries;
+
+	/* current message */
+	struct capn_segment *segs[MAX_SEGS];
+	uint32_t nsegs;
+	uint8_t *marks[MAX_SEGS];
+	uint64_t reach[MAX_SEGS];
+	int depth;
+
+	/* totals */
+	uint64_t messages, bytes, packed, input;
+	uint64_t ptrs, far, double_far, shared, too_deep;
+	uint64_t seg_count[MAX_SEGS], seg_bytes[MAX_SEGS], seg_reach[MAX_SEGS];
+};
+
+static struct entry *get_entry(struct prof *pf, uint64_t key, int is_struct, const char *fmt, ...) {
+	uint64_t h = (key ^ (key >> 29)) * UINT64_C(0x9e3779b97f4a7c15);
+	struct entry **pe = &pf->table[(h >> 32) % TABLE_SZ];
+	struct entry *e;
+	va_list ap;
+
+	for (e = *pe; e != NULL; e = e->next) {
+		if (e->key == key && e->is_struct == is_struct)
+			return e;
+	}
+
+	e = (struct entry*) calloc(1, sizeof(*e));
+	if (!e) {
+		perror("calloc");
+		exit(1);
+	}
+	e->key = key;
+	e->is_struct = is_struct;
+	va_start(ap, fmt);
+	vsnprintf(e->name, sizeof(e->name), fmt, ap);
+	va_end(ap);
+	e->next = *pe;
+	*pe = e;
+	pf->nentries++;
+	return e;
+}
+
+static uint64_t shape_key(int kind, capn_ptr p) {
+	return ((uint64_t) kind << 48) | ((uint64_t) p.datasz << 16) | p.ptrs;
+}
+
+static size_t obj_size(capn_ptr p) {
+	switch (p.type) {
+	case CAPN_STRUCT:
+		return p.datasz + 8*p.ptrs;
+	case CAPN_PTR_LIST:
+		return 8 * (size_t) p.len;
+	case CAPN_BIT_LIST:
+		return 8 * (((size_t) p.len + 63) / 64);
+	case CAPN_LIST:
+		if (p.is_composite_list)
+			return 8 + (size_t) p.len * (p.datasz + 8*p.ptrs);
+		return ((size_t) p.len * p.datasz + 7) & ~(size_t)7;
+	default:
+		return 0;
+	}
+}
+
+/* mark flags the words in [p, p+sz) of s as reachable. It returns non-zero
+ * if the object was already seen, ie it is shared by multiple pointers. */
+static int mark(struct prof *pf, struct capn_segment *s, const char *p, size_t sz) {
+	uint8_t *m;
+	size_t i, off;
+
+	if (!s || s->id >= pf->nsegs || p < s->data || p + sz > s->data + s->len)
+		return 0;
+
+	m = pf->marks[s->id];
+	off = (p - s->data) / 8;
+	if (sz && (m[off/8] & (1 << (off%8))))
+		return 1;
+
+	for (i = off; i < off + (sz+7)/8; i++) {
+		if (!(m[i/8] & (1 << (i%8)))) {
+			m[i/8] |= 1 << (i%8);
+			pf->reach[s->id] += 8;
+		}
+	}
+	return 0;
+}
+
+static void visit_ptr(struct prof *pf, capn_ptr parent, int idx, const struct schema_type *t, struct entry *e);
+
+static void walk_fields(struct prof *pf, capn_ptr p, const struct schema_node *n) {
+	int i;
+
+	for (i = 0; i < n->nfields; i++) {
+		const struct schema_field *f = &n->fields[i];
+
+		if (!schema_is_active(n, f, p))
+			continue;
+
+		if (f->group) {
+			walk_fields(pf, p, f->group);
+		} else if (schema_is_pointer(&f->type) && f->offset < p.ptrs) {
+			struct entry *e = get_entry(pf, (uintptr_t) &f->type, 0, "%s.%s", n->name, f->name);
+			visit_ptr(pf, p, f->offset, &f->type, e);
+		}
+	}
+}
+
+/* walk_struct attributes the struct to its type. The bytes of the elements
+ * of a composite list are already in the entry of the list, so only the
+ * element count is added for them. */
+static void walk_struct(struct prof *pf, capn_ptr p, const struct schema_node *n, int is_elem) {
+	struct entry *e;
+	int i;
+
+	if (n) {
+		e = get_entry(pf, (uintptr_t) n, 1, "%s", n->name);
+	} else {
+		e = get_entry(pf, shape_key(0, p), 1, "struct(data=%u,ptrs=%u)", p.datasz, p.ptrs);
+	}
+	e->count++;
+	if (!is_elem)
+		e->bytes += p.datasz + 8*p.ptrs;
+
+	if (n) {
+		walk_fields(pf, p, n);
+	} else {
+		for (i = 0; i < p.ptrs; i++)
+			visit_ptr(pf, p, i, NULL, NULL);
+	}
+}
+
+static void visit_obj(struct prof *pf, capn_ptr p, const struct schema_type *t, struct entry *e) {
+	const struct schema_type *elem = t && t->which == Type__list ? t->elem : NULL;
+	const struct schema_node *n = NULL;
+	size_t sz = obj_size(p);
+	int i;
+
+	if (mark(pf, p.seg, p.data - 8*p.is_composite_list, sz)) {
+		pf->shared += sz;
+		return;
+	}
+
+	if (!e && p.type != CAPN_STRUCT) {
+		if (p.type == CAPN_LIST && p.is_composite_list) {
+			e = get_entry(pf, shape_key(1, p), 0, "list(data=%u,ptrs=%u)", p.datasz, p.ptrs);
+		} else if (p.type == CAPN_LIST) {
+			e = get_entry(pf, shape_key(2, p), 0, "list(%u bytes)", p.datasz);
+		} else if (p.type == CAPN_PTR_LIST) {
+			e = get_entry(pf, shape_key(3, p), 0, "list(ptr)");
+		} else {
+			e = get_entry(pf, shape_key(4, p), 0, "list(bit)");
+		}
+	}
+	if (e) {
+		e->count++;
+		e->bytes += sz;
+		if (p.type != CAPN_STRUCT) {
+			e->elems += p.len;
+			if ((uint64_t) p.len > e->max_elems)
+				e->max_elems = p.len;
+		}
+	}
+
+	if (pf->depth >= MAX_DEPTH) {
+		pf->too_deep++;
+		return;
+	}
+	pf->depth++;
+
+	switch (p.type) {
+	case CAPN_STRUCT:
+		walk_struct(pf, p, t && t->which == Type__struct ? t->node : NULL, 0);
+		break;
+
+	case CAPN_LIST:
+		if (elem && elem->which == Type__struct)
+			n = elem->node;
+		if (!n && !p.ptrs)
+			break;
+		for (i = 0; i < p.len; i++)
+			walk_struct(pf, capn_getp(p, i, 1), n, 1);
+		break;
+
+	case CAPN_PTR_LIST:
+		if (elem && schema_is_pointer(elem)) {
+			e = get_entry(pf, (uintptr_t) elem, 0, "%s[]", e->name);
+		} else {
+			e = NULL;
+		}
+		for (i = 0; i < p.len; i++)
+			visit_ptr(pf, p, i, elem, e);
+		break;
+	}
+
+	pf->depth--;
+}
+
+static void visit_ptr(struct prof *pf, capn_ptr parent, int idx, const struct schema_type *t, struct entry *e) {
+	const char *w = parent.data + 8*idx;
+	uint64_t v;
+	capn_ptr p;
+
+	if (parent.type == CAPN_STRUCT)
+		w += parent.datasz;
+	v = capn_flip64(*(const uint64_t*) w);
+	if (!v)
+		return;
+
+	pf->ptrs++;
+	if ((v & 7) == 2 || (v & 7) == 6) {
+		/* landing pad of a far or double-far pointer */
+		uint32_t id = (uint32_t) (v >> 32);
+		size_t off = ((uint32_t) v >> 3) * 8;
+		int dbl = (v & 7) == 6;
+
+		if (dbl) {
+			pf->double_far++;
+			if (e)
+				e->double_far++;
+		} else {
+			pf->far++;
+			if (e)
+				e->far++;
+		}
+		if (id < pf->nsegs)
+			mark(pf, pf->segs[id], pf->segs[id]->data + off, dbl ? 16 : 8);
+	}
+
+	p = capn_getp(parent, idx, 1);
+	if (p.type != CAPN_NULL)
+		visit_obj(pf, p, t, e);
+}
+
+static void profile(struct prof *pf, struct capn *c, size_t framesz) {
+	struct capn_segment *s;
+	struct schema_type root_type;
+	capn_ptr root;
+	uint32_t i;
+	uint8_t *buf;
+	int64_t packed;
+
+	pf->nsegs = 0;
+	for (s = c->seglist; s != NULL && pf->nsegs < MAX_SEGS; s = s->next) {
+		pf->segs[pf->nsegs] = s;
+		pf->marks[pf->nsegs] = (uint8_t*) calloc(1, s->len/64 + 1);
+		pf->reach[pf->nsegs] = 0;
+		pf->nsegs++;
+	}
+
+	memset(&root_type, 0, sizeof(root_type));
+	root_type.which = pf->root ? Type__struct : Type_anyPointer;
+	root_type.node = pf->root;
+
+	root = capn_root(c);
+	if (root.type != CAPN_NULL) {
+		mark(pf, root.seg, root.data, 8);
+		visit_ptr(pf, root, 0, &root_type, NULL);
+	}
+
+	for (i = 0; i < pf->nsegs; i++) {
+		pf->seg_count[i]++;
+		pf->seg_bytes[i] += pf->segs[i]->len;
+		pf->seg_reach[i] += pf->reach[i];
+		free(pf->marks[i]);
+	}
+
+	/* packed output is at most 10 bytes for every 8 */
+	buf = (uint8_t*) malloc(framesz + framesz/4 + 16);
+	packed = buf ? capn_write_mem(c, buf, framesz + framesz/4 + 16, 1) : -1;
+	if (packed > 0)
+		pf->packed += packed;
+	free(buf);
+
+	pf->messages++;
+	pf->bytes += framesz;
+}
+
+static uint8_t *read_all(FILE *f, size_t *psz) {
+	size_t sz = 0, cap = 1 << 16;
+	uint8_t *buf = (uint8_t*) malloc(cap);
+
+	while (buf) {
+		size_t r = fread(buf + sz, 1, cap - sz, f);
+		sz += r;
+		if (r == 0)
+			break;
+		if (sz == cap) {
+			uint8_t *n = (uint8_t*) realloc(buf, cap *= 2);
+			if (!n)
+				free(buf);
+			buf = n;
+		}
+	}
+
+	*psz = sz;
+	return buf;
+}
+
+static uint8_t *inflate_all(const uint8_t *in, size_t insz, size_t *psz) {
+	struct capn_stream z;
+	size_t cap = insz * 2 + 64;
+	uint8_t *buf = (uint8_t*) malloc(cap);
+
+	memset(&z, 0, sizeof(z));
+	z.next_in = in;
+	z.avail_in = insz;
+	z.next_out = buf;
+	z.avail_out = cap;
+
+	while (buf && (z.avail_in || z.zeros || z.raw || z.avail_buf)) {
+		if (!z.avail_out) {
+			size_t used = cap;
+			uint8_t *n = (uint8_t*) realloc(buf, cap *= 2);
+			if (!n) {
+				free(buf);
+				return NULL;
+			}
+			buf = n;
+			z.next_out = buf + used;
+			z.avail_out = cap - used;
+		}
+		if (capn_inflate(&z) == CAPN_NEED_MORE && z.avail_out) {
+			/* truncated input */
+			free(buf);
+			return NULL;
+		}
+	}
+
+	*psz = cap - z.avail_out;
+	return buf;
+}
+
+static int cmp_bytes(const void *a, const void *b) {
+	const struct entry *x = *(struct entry* const*) a, *y = *(struct entry* const*) b;
+	return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static double pct(uint64_t a, uint64_t b) {
+	return b ? 100.0 * a / b : 0;
+}
+
+static void report(struct prof *pf) {
+	struct entry **all = (struct entry**) calloc(pf->nentries + 1, sizeof(*all));
+	uint64_t seg_bytes = 0, seg_reach = 0;
+	int i, n = 0;
+
+	for (i = 0; i < TABLE_SZ; i++) {
+		struct entry *e;
+		for (e = pf->table[i]; e != NULL; e = e->next)
+			all[n++] = e;
+	}
+	qsort(all, n, sizeof(*all), &cmp_bytes);
+
+	for (i = 0; i < MAX_SEGS; i++) {
+		seg_bytes += pf->seg_bytes[i];
+		seg_reach += pf->seg_reach[i];
+	}
+
+	printf("messages      %llu\n", (unsigned long long) pf->messages);
+	printf("bytes         %llu\n", (unsigned long long) pf->bytes);
+	printf("packed        %llu (%.1f%%)\n", (unsigned long long) pf->packed, pct(pf->packed, pf->bytes));
+	if (pf->input)
+		printf("input         %llu (%.1f%%)\n", (unsigned long long) pf->input, pct(pf->input, pf->bytes));
+	printf("pointers      %llu\n", (unsigned long long) pf->ptrs);
+	printf("far           %llu\n", (unsigned long long) pf->far);
+	printf("double far    %llu\n", (unsigned long long) pf->double_far);
+	printf("unreachable   %llu (%.1f%%)\n", (unsigned long long) (seg_bytes - seg_reach), pct(seg_bytes - seg_reach, seg_bytes));
+	printf("shared        %llu\n", (unsigned long long) pf->shared);
+	if (pf->too_deep)
+		printf("too deep      %llu\n", (unsigned long long) pf->too_deep);
+
+	printf("\n%-8s %10s %14s %14s %7s\n", "segment", "count", "bytes", "reachable", "fill");
+	for (i = 0; i < MAX_SEGS; i++) {
+		if (!pf->seg_count[i])
+			continue;
+		printf("%-8d %10llu %14llu %14llu %6.1f%%\n", i,
+				(unsigned long long) pf->seg_count[i],
+				(unsigned long long) pf->seg_bytes[i],
+				(unsigned long long) pf->seg_reach[i],
+				pct(pf->seg_reach[i], pf->seg_bytes[i]));
+	}
+
+	printf("\n%-40s %10s %14s %7s\n", "struct", "count", "bytes", "share");
+	for (i = 0; i < n; i++) {
+		struct entry *e = all[i];
+		if (!e->is_struct)
+			continue;
+		printf("%-40s %10llu %14llu %6.1f%%\n", e->name,
+				(unsigned long long) e->count,
+				(unsigned long long) e->bytes,
+				pct(e->bytes, pf->bytes));
+	}
+
+	printf("\n%-40s %10s %14s %7s %10s %10s %8s %8s\n", "pointer", "count", "bytes", "share", "avg len", "max len", "far", "dfar");
+	for (i = 0; i < n; i++) {
+		struct entry *e = all[i];
+		if (e->is_struct)
+			continue;
+		printf("%-40s %10llu %14llu %6.1f%% %10.1f %10llu %8llu %8llu\n", e->name,
+				(unsigned long long) e->count,
+				(unsigned long long) e->bytes,
+				pct(e->bytes, pf->bytes),
+				e->count ? (double) e->elems / e->count : 0,
+				(unsigned long long) e->max_elems,
+				(unsigned long long) e->far,
+				(unsigned long long) e->double_far);
+	}
+
+	free(all);
+}
+
+static int usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-p] [-s schema.bin -r Root] [file]\n", prog);
+	return 2;
+}
+
+int main(int argc, char **argv) {
+	const char *schemaf = NULL, *rootname = NULL, *inf = NULL;
+	struct schema schema;
+	struct prof *pf;
+	uint8_t *in, *msgs;
+	size_t insz, sz, off;
+	int i, packed = 0;
+	FILE *f;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p")) {
+			packed = 1;
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			schemaf = argv[++i];
+		} else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+			rootname = argv[++i];
+		} else if (argv[i][0] != '-' && !inf) {
+			inf = argv[i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (!schemaf != !rootname)
+		return usage(argv[0]);
+
+	pf = (struct prof*) calloc(1, sizeof(*pf));
+	if (!pf) {
+		perror("calloc");
+		return 1;
+	}
+
+	if (schemaf) {
+		f = fopen(schemaf, "rb");
+		if (!f || schema_load(&schema, f)) {
+			fprintf(stderr, "failed to read schema from %s\n", schemaf);
+			return 1;
+		}
+		fclose(f);
+		pf->schema = &schema;
+		pf->root = schema_find(&schema, rootname);
+		if (!pf->root || pf->root->which != Node__struct) {
+			fprintf(stderr, "no struct %s in %s\n", rootname, schemaf);
+			return 1;
+		}
+	}
+
+	f = inf ? fopen(inf, "rb") : stdin;
+	if (!f) {
+		perror(inf);
+		return 1;
+	}
+	in = read_all(f, &insz);
+	if (inf)
+		fclose(f);
+	if (!in) {
+		fprintf(stderr, "failed to read input\n");
+		return 1;
+	}
+
+	/* packing is word based, so a stream of packed messages inflates to
+	 * the stream of unpacked messages */
+	if (packed) {
+		msgs = inflate_all(in, insz, &sz);
+		if (!msgs) {
+			fprintf(stderr, "invalid packed input\n");
+			return 1;
+		}
+		pf->input = insz;
+		free(in);
+	} else {
+		msgs = in;
+		sz = insz;
+	}
+
+	for (off = 0; off < sz;) {
+		int64_t framesz = capn_frame_size(msgs + off, sz - off);
+		struct capn c;
+
+		if (framesz <= 0 || capn_init_mem(&c, msgs + off, framesz, 0)) {
+			fprintf(stderr, "invalid message at offset %llu\n", (unsigned long long) off);
+			return 1;
+		}
+		profile(pf, &c, framesz);
+		capn_free(&c);
+		off += framesz;
+	}
+
+	report(pf);
+
+	free(msgs);
+	if (schemaf)
+		schema_free(&schema);
+	return 0;
+}
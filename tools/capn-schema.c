@@ -0,0 +1,250 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-schema.c
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "capn-schema.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct schema_node *schema_lookup(struct schema *s, uint64_t id) {
+	struct schema_node *n;
+	for (n = s->nodes; n != NULL; n = n->next) {
+		if (n->id == id)
+			return n;
+	}
+	return NULL;
+}
+
+struct schema_node *schema_find(struct schema *s, const char *name) {
+	struct schema_node *n;
+	size_t len = strlen(name);
+
+	for (n = s->nodes; n != NULL; n = n->next) {
+		const char *dot;
+		if (!strcmp(n->name, name))
+			return n;
+		dot = strrchr(n->name, '.');
+		if (dot && !strcmp(dot+1, name))
+			return n;
+		/* full display name including the file */
+		if (strlen(n->name) < len && name[len - strlen(n->name) - 1] == ':'
+				&& !strcmp(name + len - strlen(n->name), n->name))
+			return n;
+	}
+	return NULL;
+}
+
+static int decode_type(struct schema *s, struct schema_type *st, Type_ptr p) {
+	struct Type t;
+
+	read_Type(&t, p);
+	st->which = t.which;
+
+	switch (t.which) {
+	case Type__list:
+		st->elem = (struct schema_type*) calloc(1, sizeof(*st->elem));
+		if (!st->elem)
+			return -1;
+		return decode_type(s, st->elem, t._list.elementType);
+	case Type__struct:
+		st->node = schema_lookup(s, t._struct.typeId);
+		return st->node ? 0 : -1;
+	case Type__enum:
+		st->node = schema_lookup(s, t._enum.typeId);
+		return st->node ? 0 : -1;
+	default:
+		return 0;
+	}
+}
+
+static void free_type(struct schema_type *st) {
+	if (st->elem) {
+		free_type(st->elem);
+		free(st->elem);
+	}
+}
+
+static uint64_t decode_default(Value_ptr p) {
+	struct Value v;
+
+	read_Value(&v, p);
+	switch (v.which) {
+	case Value__bool:
+		return v._bool;
+	case Value_int8:
+		return (uint8_t) v.int8;
+	case Value_int16:
+		return (uint16_t) v.int16;
+	case Value_int32:
+		return (uint32_t) v.int32;
+	case Value_int64:
+		return (uint64_t) v.int64;
+	case Value_uint8:
+		return v.uint8;
+	case Value_uint16:
+		return v.uint16;
+	case Value_uint32:
+		return v.uint32;
+	case Value_uint64:
+		return v.uint64;
+	case Value_float32:
+		return capn_from_f32(v.float32);
+	case Value_float64:
+		return capn_from_f64(v.float64);
+	case Value__enum:
+		return v._enum;
+	default:
+		return 0;
+	}
+}
+
+static int decode_fields(struct schema *s, struct schema_node *n, struct Node *node) {
+	int i;
+
+	n->nfields = capn_len(node->_struct.fields);
+	n->fields = (struct schema_field*) calloc(n->nfields ? n->nfields : 1, sizeof(*n->fields));
+	if (!n->fields)
+		return -1;
+
+	for (i = 0; i < n->nfields; i++) {
+		struct schema_field *sf = &n->fields[i];
+		struct Field f;
+
+		get_Field(&f, node->_struct.fields, i);
+		sf->name = f.name.str;
+		sf->discriminant = f.discriminantValue;
+
+		if (f.which == Field_group) {
+			sf->group = schema_lookup(s, f.group.typeId);
+			if (!sf->group)
+				return -1;
+		} else {
+			sf->offset = f.slot.offset;
+			sf->def = decode_default(f.slot.defaultValue);
+			if (decode_type(s, &sf->type, f.slot.type))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+int schema_load(struct schema *s, FILE *f) {
+	CodeGeneratorRequest_ptr root;
+	struct CodeGeneratorRequest req;
+	struct schema_node *n;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	if (capn_init_fp(&s->capn, f, 0))
+		return -1;
+
+	root.p = capn_getp(capn_root(&s->capn), 0, 1);
+	read_CodeGeneratorRequest(&req, root);
+
+	for (i = 0; i < capn_len(req.nodes); i++) {
+		struct Node node;
+		const char *colon;
+
+		get_Node(&node, req.nodes, i);
+		if (node.which != Node__struct && node.which != Node__enum)
+			continue;
+
+		n = (struct schema_node*) calloc(1, sizeof(*n));
+		if (!n)
+			goto err;
+
+		n->id = node.id;
+		n->which = node.which;
+		n->name = node.displayName.str ? node.displayName.str : "";
+		colon = strchr(n->name, ':');
+		if (colon)
+			n->name = colon + 1;
+
+		if (node.which == Node__struct) {
+			n->is_group = node._struct.isGroup;
+			n->datasz = node._struct.dataWordCount;
+			n->ptrs = node._struct.pointerCount;
+			n->discriminant_count = node._struct.discriminantCount;
+			n->discriminant_offset = node._struct.discriminantOffset;
+		} else {
+			int j;
+			n->enumerants = capn_len(node._enum.enumerants);
+			n->enumerant_names = (const char**) calloc(n->enumerants ? n->enumerants : 1, sizeof(*n->enumerant_names));
+			if (!n->enumerant_names) {
+				free(n);
+				goto err;
+			}
+			for (j = 0; j < n->enumerants; j++) {
+				struct Enumerant e;
+				get_Enumerant(&e, node._enum.enumerants, j);
+				n->enumerant_names[j] = e.name.str ? e.name.str : "";
+			}
+		}
+
+		n->next = s->nodes;
+		s->nodes = n;
+	}
+
+	/* fields are decoded once all nodes are known so types can be
+	 * resolved */
+	for (i = 0; i < capn_len(req.nodes); i++) {
+		struct Node node;
+
+		get_Node(&node, req.nodes, i);
+		if (node.which != Node__struct)
+			continue;
+
+		n = schema_lookup(s, node.id);
+		if (decode_fields(s, n, &node))
+			goto err;
+	}
+
+	return 0;
+
+err:
+	schema_free(s);
+	return -1;
+}
+
+void schema_free(struct schema *s) {
+	struct schema_node *n = s->nodes;
+
+	while (n != NULL) {
+		struct schema_node *next = n->next;
+		int i;
+		for (i = 0; i < n->nfields; i++) {
+			free_type(&n->fields[i].type);
+		}
+		free(n->fields);
+		free(n->enumerant_names);
+		free(n);
+		n = next;
+	}
+
+	capn_free(&s->capn);
+	memset(s, 0, sizeof(*s));
+}
+
+int schema_is_pointer(const struct schema_type *t) {
+	switch (t->which) {
+	case Type_text:
+	case Type_data:
+	case Type__list:
+	case Type__struct:
+	case Type__interface:
+	case Type_anyPointer:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int schema_is_active(const struct schema_node *n, const struct schema_field *f, capn_ptr p) {
+	if (f->discriminant == Field_noDiscriminant)
+		return 1;
+	return capn_read16(p, 2*n->discriminant_offset) == f->discriminant;
+}
@@ -0,0 +1,92 @@
+/* vim: set sw=8 ts=8 sts=8 noet: */
+/* capn-schema.h
+ *
+ * Runtime view of a compiled schema (a CodeGeneratorRequest as written by
+ * `capnp compile -o-`) for the tools that walk messages without generated
+ * code.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef CAPN_SCHEMA_H
+#define CAPN_SCHEMA_H
+
+#include "schema.capnp.h"
+#include <stdio.h>
+
+/* struct schema_type is a resolved Type. node is set for _struct and _enum,
+ * elem for _list. */
+struct schema_type {
+	enum Type_which which;
+	struct schema_node *node;
+	struct schema_type *elem;
+};
+
+/* struct schema_field is one field of a struct or group node.
+ *
+ * discriminant is Field_noDiscriminant unless the field is a union member.
+ * offset is the slot offset in multiples of the type size (bits for bool,
+ * pointers for pointer types). group is set for group fields instead of
+ * type and offset. def holds the bits of the default value of a scalar
+ * field, which the stored value is xored with.
+ */
+struct schema_field {
+	const char *name;
+	uint16_t discriminant;
+	uint32_t offset;
+	uint64_t def;
+	struct schema_type type;
+	struct schema_node *group;
+};
+
+/* struct schema_node is a struct or enum node.
+ *
+ * name is the display name without the file prefix (eg Person.PhoneNumber).
+ * datasz is in words and ptrs in pointers. discriminant_offset is in
+ * multiples of 16 bits and only valid if discriminant_count is non-zero.
+ * enumerants is the number of values of an enum and enumerant_names their
+ * names.
+ */
+struct schema_node {
+	uint64_t id;
+	const char *name;
+	enum Node_which which;
+	unsigned is_group : 1;
+	uint16_t datasz, ptrs;
+	uint16_t discriminant_count;
+	uint32_t discriminant_offset;
+	int nfields;
+	struct schema_field *fields;
+	int enumerants;
+	const char **enumerant_names;
+	struct schema_node *next;
+};
+
+struct schema {
+	struct capn capn;
+	struct schema_node *nodes;
+};
+
+/* schema_load reads a CodeGeneratorRequest from f. Returns 0 on success and
+ * -1 on a read or format error. schema_free releases everything, including
+ * the names handed out by the nodes. */
+int schema_load(struct schema *s, FILE *f);
+void schema_free(struct schema *s);
+
+/* schema_find looks up a struct or enum node by name, either as the full
+ * display name (addressbook.capnp:Person), without the file prefix
+ * (Person.PhoneNumber) or as the last component (PhoneNumber). Returns NULL
+ * if no node matches. */
+struct schema_node *schema_find(struct schema *s, const char *name);
+struct schema_node *schema_lookup(struct schema *s, uint64_t id);
+
+/* schema_is_pointer returns non-zero if values of t live in the pointer
+ * section. */
+int schema_is_pointer(const struct schema_type *t);
+
+/* schema_is_active returns non-zero if field f of node n is set in p, ie it
+ * is not a union member or is the current union member. */
+int schema_is_active(const struct schema_node *n, const struct schema_field *f, capn_ptr p);
+
+#endif /* CAPN_SCHEMA_H */